@@ -0,0 +1,25 @@
+#include <Arduino.h>
+#include "ModbusMaster.h"
+
+ModbusMaster master;
+uint16_t temperatures[8];
+uint16_t setpoints[4];
+
+//Both polls of slave 2 are read by one request (registers 0-11)
+ModbusPoll polls[] = {
+    {2, FC_READ_INPUT_REGISTERS, 0, 8, temperatures, 500},
+    {2, FC_READ_INPUT_REGISTERS, 8, 4, setpoints, 500},
+};
+
+void setup(){
+    pinMode(LED_BUILTIN, OUTPUT);
+    master.setPolls(polls, 2);
+    master.startModbusMaster(19200UL);
+}
+
+void loop(){
+    if (master.communicationLoop() != -1){
+        //New data arrived
+        digitalWrite(LED_BUILTIN, temperatures[0] > 250);
+    }
+}
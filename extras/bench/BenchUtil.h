@@ -0,0 +1,82 @@
+#ifndef MODBUS_BENCH_UTIL_H
+#define MODBUS_BENCH_UTIL_H
+
+/*Helpers shared by host benchmarks: monotonic time, request frame builders and result reporting.
+*/
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <time.h>
+#include "ModbusRTU.h"
+
+static inline uint64_t benchNowNs(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Builds request with two 16-bit fields (FC3, FC4, FC6) including CRC
+ * @return Length of frame
+ */
+static inline uint16_t benchBuildRequest(uint8_t* frame, uint8_t address, uint8_t functionCode, uint16_t first, uint16_t second){
+    frame[0] = address;
+    frame[1] = functionCode;
+    frame[2] = first >> 8;
+    frame[3] = first & 0xff;
+    frame[4] = second >> 8;
+    frame[5] = second & 0xff;
+    uint16_t crc = modbusCRC16(frame, 6);
+    frame[6] = crc & 0xff;
+    frame[7] = crc >> 8;
+    return 8;
+}
+
+/**
+ * @brief Builds Write Multiple Registers (FC16) or Read/Write Multiple Registers (FC23) request
+ * including CRC. Read fields are used only for FC23.
+ * @return Length of frame
+ */
+static inline uint16_t benchBuildWriteMultiple(uint8_t* frame, uint8_t address, uint8_t functionCode, uint16_t first,
+    uint16_t count, const uint16_t* values, uint16_t readFirst = 0, uint16_t readCount = 0){
+    uint16_t length = 0;
+    frame[length++] = address;
+    frame[length++] = functionCode;
+    if (functionCode == FC_READ_WRITE_MULTIPLE_REGISTERS){
+        frame[length++] = readFirst >> 8;
+        frame[length++] = readFirst & 0xff;
+        frame[length++] = readCount >> 8;
+        frame[length++] = readCount & 0xff;
+    }
+    frame[length++] = first >> 8;
+    frame[length++] = first & 0xff;
+    frame[length++] = count >> 8;
+    frame[length++] = count & 0xff;
+    frame[length++] = count * 2;
+    for (uint16_t i = 0; i < count; ++i){
+        frame[length++] = values[i] >> 8;
+        frame[length++] = values[i] & 0xff;
+    }
+    uint16_t crc = modbusCRC16(frame, length);
+    frame[length++] = crc & 0xff;
+    frame[length++] = crc >> 8;
+    return length;
+}
+
+/**
+ * @brief Checks that response has valid CRC and echoes address and function code of request
+ */
+static inline bool benchValidResponse(const uint8_t* request, const uint8_t* response, size_t length){
+    if (length < 5 || response[0] != request[0] || response[1] != request[1]){
+        return false;
+    }
+    uint16_t crc = modbusCRC16(response, length - 2);
+    return response[length - 2] == (crc & 0xff) && response[length - 1] == (crc >> 8);
+}
+
+static inline void benchReport(const char* name, uint64_t elapsedNs, uint64_t operations, const char* unit){
+    double perOperation = (double)elapsedNs / (double)operations;
+    printf("%-36s %12.1f ns/%s %14.0f %s/s\n", name, perOperation, unit, 1e9 / perOperation, unit);
+}
+
+#endif
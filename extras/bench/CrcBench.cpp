@@ -0,0 +1,112 @@
+/*Comparison of CRC engines. Verifies that all engines agree and reports cost per byte
+for typical Modbus frame sizes (in nanoseconds and, on x86, in TSC cycles).
+Usage: crc_bench [bytes per measurement]
+*/
+
+#include "BenchUtil.h"
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+    #define BENCH_HAS_TSC 1
+#else
+    #define BENCH_HAS_TSC 0
+#endif
+
+typedef uint16_t (*BlockEngine)(uint16_t crc, const uint8_t* data, uint16_t length);
+typedef uint16_t (*ByteEngine)(uint16_t crc, uint8_t data);
+
+static uint16_t incrementalTable(uint16_t crc, const uint8_t* data, uint16_t length){
+    for (uint16_t i = 0; i < length; ++i){
+        crc = modbusCRC16UpdateTable(crc, data[i]);
+    }
+    return crc;
+}
+
+static uint16_t incrementalNibble(uint16_t crc, const uint8_t* data, uint16_t length){
+    for (uint16_t i = 0; i < length; ++i){
+        crc = modbusCRC16UpdateNibble(crc, data[i]);
+    }
+    return crc;
+}
+
+//Reference implementation (bit by bit)
+static uint16_t bitwise(uint16_t crc, const uint8_t* data, uint16_t length){
+    for (uint16_t i = 0; i < length; ++i){
+        crc ^= data[i];
+        for (uint8_t bit = 0; bit < 8; ++bit){
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+static const struct {
+    const char* name;
+    BlockEngine engine;
+} engines[] = {
+    {"bitwise (reference)", bitwise},
+    {"table", modbusCRC16Table},
+    {"nibble", modbusCRC16Nibble},
+    {"slicing-by-4", modbusCRC16Slicing4},
+    {"slicing-by-8", modbusCRC16Slicing8},
+    {"incremental table (per byte)", incrementalTable},
+    {"incremental nibble (per byte)", incrementalNibble},
+};
+#define ENGINE_COUNT (sizeof(engines) / sizeof(engines[0]))
+
+static uint64_t readCycles(){
+    #if BENCH_HAS_TSC
+        return __rdtsc();
+    #else
+        return 0;
+    #endif
+}
+
+int main(int argc, char** argv){
+    uint64_t totalBytes = argc > 1 ? strtoull(argv[1], NULL, 10) : 50000000ULL;
+    uint8_t data[256];
+    srand(1);
+    for (uint16_t i = 0; i < sizeof(data); ++i){
+        data[i] = (uint8_t)rand();
+    }
+
+    //All engines must agree for every length and alignment
+    bool valid = true;
+    for (uint16_t offset = 0; offset < 8; ++offset){
+        for (uint16_t length = 0; length + offset <= sizeof(data); ++length){
+            uint16_t expected = bitwise(MODBUS_CRC_INIT, data + offset, length);
+            for (uint8_t e = 1; e < ENGINE_COUNT; ++e){
+                if (engines[e].engine(MODBUS_CRC_INIT, data + offset, length) != expected){
+                    printf("%s differs (offset %u, length %u)\n", engines[e].name, offset, length);
+                    valid = false;
+                }
+            }
+        }
+    }
+
+    const uint16_t sizes[] = {8, 64, 256};
+    printf("%-32s %8s %12s %12s\n", "engine", "block", "ns/byte", BENCH_HAS_TSC ? "cycles/byte" : "");
+    for (uint8_t e = 0; e < ENGINE_COUNT; ++e){
+        for (uint8_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s){
+            uint16_t size = sizes[s];
+            uint64_t iterations = totalBytes / size / (e == 0 ? 8 : 1);
+            volatile uint16_t sink = 0;
+            uint64_t startCycles = readCycles();
+            uint64_t start = benchNowNs();
+            for (uint64_t i = 0; i < iterations; ++i){
+                data[0] = (uint8_t)i;
+                sink ^= engines[e].engine(MODBUS_CRC_INIT, data, size);
+            }
+            double bytes = (double)iterations * size;
+            double ns = (double)(benchNowNs() - start) / bytes;
+            double cycles = (double)(readCycles() - startCycles) / bytes;
+            (void)sink;
+            if (BENCH_HAS_TSC){
+                printf("%-32s %8u %12.3f %12.2f\n", engines[e].name, size, ns, cycles);
+            }
+            else {
+                printf("%-32s %8u %12.3f\n", engines[e].name, size, ns);
+            }
+        }
+    }
+    return valid ? 0 : 1;
+}
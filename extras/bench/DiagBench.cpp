@@ -0,0 +1,204 @@
+/*Diagnostics benchmark. Requests (reads, long writes, frames of other devices, frames with CRC error,
+frames broken by silence and requests of unmapped registers) are received through interrupt receive ring,
+bytes arrive at the speed of the line, while main loop calls communicationLoop() only once per loop period
+(simulating busy application). Reports counters and latency histogram for several loop periods, so sites,
+which lose frames under load, can be compared. Error counters are also read over the bus by FC8.
+Usage: diag_bench [baud rate] [simulated milliseconds per scenario]
+*/
+
+#include "BenchUtil.h"
+
+#define BENCH_SLAVE_ADDRESS 1
+#define BENCH_OTHER_ADDRESS 2
+#define BENCH_STEP_US 10
+#define BENCH_WRITE_COUNT 50
+
+static ModbusServer<16, 64, MODBUS_FUNCTIONS_ALL | MODBUS_FUNCTIONS_DIAGNOSTICS, MODBUS_DIAGNOSTICS> server;
+static RxRingCtx ring;
+static unsigned long charTime;
+static unsigned long gapSilence; //Silence between t1.5 and t3.5
+
+//Frame being delivered byte by byte
+static uint8_t frame[MODBUS_MAX_FRAME_LEN];
+static uint16_t frameLength;
+static uint16_t frameSent;
+static uint16_t gapIndex; //Byte preceded by silence longer than t1.5 (frameLength if none)
+static unsigned long frameStart;
+
+static struct {
+    uint32_t frames;
+    uint32_t crcErrors;
+    uint32_t gaps;
+    uint32_t exceptions;
+} injected;
+
+static void startFrame(uint16_t length, unsigned long start, uint16_t gap){
+    frameLength = length;
+    frameSent = 0;
+    gapIndex = gap;
+    frameStart = start;
+    ++injected.frames;
+}
+
+//Arrival time of next byte of frame
+static unsigned long nextByteTime(){
+    unsigned long time = frameStart + frameSent * charTime;
+    if (frameSent >= gapIndex){
+        time += gapSilence;
+    }
+    return time;
+}
+
+//Builds next frame of traffic pattern
+static void buildFrame(uint32_t index, unsigned long start){
+    uint16_t values[BENCH_WRITE_COUNT];
+    for (uint16_t i = 0; i < BENCH_WRITE_COUNT; ++i){
+        values[i] = (uint16_t)(index + i);
+    }
+    uint16_t length;
+    uint16_t gap = MODBUS_MAX_FRAME_LEN;
+    switch (index % 4){
+        case 0:
+            length = benchBuildRequest(frame, BENCH_SLAVE_ADDRESS, FC_READ_HOLDING_REGISTERS, 0, 10);
+            break;
+        case 1:
+            length = benchBuildWriteMultiple(frame, BENCH_SLAVE_ADDRESS, FC_WRITE_MULTIPLE_REGISTERS, 0, BENCH_WRITE_COUNT, values);
+            break;
+        case 2:
+            length = benchBuildRequest(frame, BENCH_OTHER_ADDRESS, FC_READ_INPUT_REGISTERS, 0, 10);
+            break;
+        default:
+            length = benchBuildRequest(frame, BENCH_SLAVE_ADDRESS, FC_READ_INPUT_REGISTERS, 0, 16);
+            break;
+    }
+    //Frames of other devices are skipped unchecked, so only errors of own frames are counted
+    bool own = frame[0] == BENCH_SLAVE_ADDRESS;
+    if (index % 5 == 4){
+        frame[3] ^= 0x10;
+        injected.crcErrors += own;
+    }
+    else if (index % 7 == 6){
+        gap = length / 2;
+        injected.gaps += own;
+    }
+    else if (index % 11 == 10){
+        //Unmapped registers
+        length = benchBuildRequest(frame, BENCH_SLAVE_ADDRESS, FC_READ_HOLDING_REGISTERS, 100, 1);
+        ++injected.exceptions;
+    }
+    startFrame(length, start, gap);
+}
+
+//Delivers due bytes and calls communication loop once per loop period
+static void runBus(unsigned long duration, unsigned long loopPeriod, bool traffic){
+    unsigned long start = micros();
+    unsigned long nextLoop = start;
+    uint32_t index = 0;
+    while (micros() - start < duration){
+        unsigned long now = micros();
+        while (frameSent < frameLength && (long)(now - nextByteTime()) >= 0){
+            server.receiveByteISR(frame[frameSent++]);
+        }
+        if (traffic && frameSent == frameLength){
+            //Next frame follows after response time
+            buildFrame(index++, nextByteTime() + 3 * MODBUS_FIXED_T35);
+        }
+        if ((long)(now - nextLoop) >= 0){
+            server.communicationLoop();
+            Serial.clearTx();
+            nextLoop += loopPeriod;
+        }
+        ArduinoShim::advanceMicros(BENCH_STEP_US);
+    }
+}
+
+//Reads counter by Diagnostics request, -1 if response is invalid
+static long readCounter(uint16_t subFunction){
+    uint8_t request[8];
+    startFrame(benchBuildRequest(request, BENCH_SLAVE_ADDRESS, FC_DIAGNOSTICS, subFunction, 0), micros(), MODBUS_MAX_FRAME_LEN);
+    memcpy(frame, request, sizeof(request));
+    Serial.clearTx();
+    unsigned long start = micros();
+    while (Serial.txSize() == 0 && micros() - start < 100000UL){
+        unsigned long now = micros();
+        while (frameSent < frameLength && (long)(now - nextByteTime()) >= 0){
+            server.receiveByteISR(frame[frameSent++]);
+        }
+        server.communicationLoop();
+        ArduinoShim::advanceMicros(BENCH_STEP_US);
+    }
+    const uint8_t* response = Serial.txBuffer();
+    if (Serial.txSize() != 8 || !benchValidResponse(request, response, Serial.txSize())){
+        return -1;
+    }
+    return ((uint16_t)response[4] << 8) | response[5];
+}
+
+static bool benchScenario(unsigned long loopPeriod, unsigned long duration){
+    memset(&injected, 0, sizeof(injected));
+    frameSent = frameLength = 0;
+    frameStart = micros();
+    server.resetDiagnostics();
+    runBus(duration * 1000UL, loopPeriod, true);
+    //Let the last frame finish
+    runBus(MODBUS_MAX_FRAME_LEN * charTime + 10000UL, BENCH_STEP_US, false);
+
+    ModbusDiagnostics diagnostics;
+    server.getDiagnostics(&diagnostics);
+    printf("loop period %6lu us: %6u frames (%u injected), %5u served, %4u CRC errors (%u injected), "
+        "%4u discarded (%u with gap injected), %4u overruns, %4u exceptions (%u injected)\n",
+        loopPeriod, diagnostics.busMessages, injected.frames, diagnostics.serverMessages, diagnostics.busCommunicationErrors,
+        injected.crcErrors, diagnostics.discardedFrames, injected.gaps, diagnostics.characterOverruns,
+        diagnostics.busExceptionErrors, injected.exceptions);
+    printf("  latency:");
+    for (uint8_t i = 0; i < MODBUS_LATENCY_BUCKETS; ++i){
+        if (i < MODBUS_LATENCY_BUCKETS - 1){
+            printf("  <%lu us: %u", MODBUS_LATENCY_BUCKET_US << i, diagnostics.latency[i]);
+        }
+        else {
+            printf("  more: %u", diagnostics.latency[i]);
+        }
+    }
+    printf("\n");
+
+    //Without overruns, every injected error is counted at its site
+    bool valid = true;
+    if (diagnostics.characterOverruns == 0){
+        valid = diagnostics.busCommunicationErrors == (uint16_t)injected.crcErrors &&
+            diagnostics.discardedFrames == (uint16_t)injected.gaps &&
+            diagnostics.busExceptionErrors == (uint16_t)injected.exceptions &&
+            diagnostics.busMessages == (uint16_t)injected.frames;
+    }
+    //Error counters are not changed by Diagnostics requests
+    valid &= readCounter(DIAG_BUS_COMMUNICATION_ERROR_COUNT) == diagnostics.busCommunicationErrors &&
+        readCounter(DIAG_BUS_EXCEPTION_ERROR_COUNT) == diagnostics.busExceptionErrors &&
+        readCounter(DIAG_BUS_CHARACTER_OVERRUN_COUNT) == diagnostics.characterOverruns &&
+        readCounter(DIAG_DISCARDED_FRAME_COUNT) == diagnostics.discardedFrames;
+    if (!valid){
+        printf("  counters differ from injected traffic or from counters read by FC8\n");
+    }
+    return valid;
+}
+
+int main(int argc, char** argv){
+    unsigned long baudRate = argc > 1 ? strtoul(argv[1], NULL, 10) : 115200;
+    unsigned long duration = argc > 2 ? strtoul(argv[2], NULL, 10) : 2000;
+
+    ArduinoShim::useSimulatedClock(true);
+    ArduinoShim::setMicros(1000000UL);
+    SerialCtx timing;
+    initSerialCtx(&timing, NULL, baudRate);
+    charTime = timing.charTime;
+    //Interval between bytes is one character time longer than silence
+    gapSilence = (timing.interCharTimeout + timing.interFrameTimeout) / 2 - charTime;
+    server.setInterruptReceive(&ring);
+    server.startModbusServer(BENCH_SLAVE_ADDRESS, baudRate);
+
+    printf("%lu baud, %lu ms simulated, receive ring %u bytes\n", baudRate, duration, MODBUS_RX_RING_SIZE);
+    bool valid = true;
+    const unsigned long loopPeriods[] = {100, 1000, 5000, 20000};
+    for (uint8_t i = 0; i < sizeof(loopPeriods) / sizeof(loopPeriods[0]); ++i){
+        valid &= benchScenario(loopPeriods[i], duration);
+    }
+    return valid ? 0 : 1;
+}
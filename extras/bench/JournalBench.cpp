@@ -0,0 +1,248 @@
+/*Holding register journal benchmark. Random FC6/FC16 writes are served while the journal flushes in the
+background into simulated EEPROM. Reports request handling time with and without journal, records written
+per write request (coalescing), wear of the most written byte against average and restore time.
+Power cut test interrupts storage in the middle of a record many times and checks that restore
+always yields state of the last completely written record (snapshot is applied only as a whole).
+Usage: journal_bench [requests] [power cuts]
+*/
+
+#include "BenchUtil.h"
+#include "ModbusJournal.h"
+
+#define BENCH_SLAVE_ADDRESS 1
+#define BENCH_BAUD_RATE 115200UL
+#define BENCH_REGISTERS 100
+#define BENCH_FIRST 16 //First journaled register
+#define BENCH_JOURNALED 64
+#define BENCH_EEPROM_SIZE 2048
+#define BENCH_EEPROM_WRITE_US 3300 //Write time of EEPROM byte (AVR)
+#define BENCH_REQUEST_PERIOD_US 10000
+
+static ModbusServer<0, BENCH_REGISTERS, MODBUS_FUNCTIONS_ALL> server;
+static ModbusJournal<BENCH_JOURNALED> journal;
+
+//Simulated EEPROM, power cut stops writes after given number of bytes
+typedef struct {
+    uint8_t data[BENCH_EEPROM_SIZE];
+    uint32_t wear[BENCH_EEPROM_SIZE];
+    uint64_t bytesWritten;
+    int32_t writeBudget; //Bytes, which may still be written, -1 for unlimited
+    //State, which restore must yield (updated by completely written records)
+    uint16_t durable[BENCH_JOURNALED];
+    uint16_t pending[BENCH_JOURNALED]; //Snapshot being written
+    int32_t snapshotNext; //Register expected in snapshot, -1 if no snapshot is being written
+} BenchEeprom;
+
+static BenchEeprom eeprom;
+static uint32_t registerWrites[BENCH_REGISTERS]; //Writes of each register by requests
+
+static bool eepromRead(uint32_t address, void* data, uint16_t length, void* ctx){
+    memcpy(data, eeprom.data + address, length);
+    return true;
+}
+
+static void trackRecord(const ModbusJournalRecord* record){
+    uint16_t offset = record->offset & ~MODBUS_JOURNAL_SNAPSHOT;
+    if (record->offset == MODBUS_JOURNAL_SNAPSHOT){
+        eeprom.snapshotNext = 0;
+    }
+    if (eeprom.snapshotNext >= 0){
+        eeprom.pending[offset] = record->value;
+        if (++eeprom.snapshotNext == BENCH_JOURNALED){
+            memcpy(eeprom.durable, eeprom.pending, sizeof(eeprom.durable));
+            eeprom.snapshotNext = -1;
+        }
+    }
+    else {
+        eeprom.durable[offset] = record->value;
+    }
+}
+
+static bool eepromWrite(uint32_t address, const void* data, uint16_t length, void* ctx){
+    for (uint16_t i = 0; i < length; ++i){
+        if (eeprom.writeBudget == 0){
+            //Record is complete if old bytes happen to match the rest
+            if (memcmp(eeprom.data + address, data, length) == 0){
+                trackRecord((const ModbusJournalRecord*)data);
+            }
+            return false;
+        }
+        if (eeprom.writeBudget > 0){
+            --eeprom.writeBudget;
+        }
+        eeprom.data[address + i] = ((const uint8_t*)data)[i];
+        ++eeprom.wear[address + i];
+        ++eeprom.bytesWritten;
+    }
+    trackRecord((const ModbusJournalRecord*)data);
+    return true;
+}
+
+static const ModbusStorage storage = {BENCH_EEPROM_SIZE, eepromRead, eepromWrite, NULL, NULL};
+
+static void eepromErase(){
+    memset(&eeprom, 0, sizeof(eeprom));
+    memset(eeprom.data, 0xFF, sizeof(eeprom.data));
+    eeprom.writeBudget = -1;
+    eeprom.snapshotNext = -1;
+}
+
+static uint32_t benchRandom(){
+    static uint32_t state = 12345;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+/**
+ * @brief Builds random FC6 or FC16 request
+ */
+static uint16_t buildRandomWrite(uint8_t* frame){
+    if (benchRandom() % 4 != 0){
+        uint16_t address = benchRandom() % BENCH_REGISTERS;
+        ++registerWrites[address];
+        return benchBuildRequest(frame, BENCH_SLAVE_ADDRESS, FC_WRITE_SINGLE_REGISTER, address, benchRandom());
+    }
+    uint16_t values[8];
+    uint16_t count = 1 + benchRandom() % 8;
+    uint16_t address = benchRandom() % (BENCH_REGISTERS - count + 1);
+    for (uint16_t i = 0; i < count; ++i){
+        values[i] = benchRandom();
+        ++registerWrites[address + i];
+    }
+    return benchBuildWriteMultiple(frame, BENCH_SLAVE_ADDRESS, FC_WRITE_MULTIPLE_REGISTERS, address, count, values);
+}
+
+/**
+ * @brief Serves one request (simulated clock advances by request period), returns handling time
+ */
+static uint64_t serveRequest(const uint8_t* frame, uint16_t length){
+    Serial.injectRx(frame, length);
+    uint64_t start = benchNowNs();
+    for (uint16_t poll = 0; poll < 1000 && Serial.txSize() == 0; ++poll){
+        server.communicationLoop();
+    }
+    uint64_t elapsed = benchNowNs() - start;
+    Serial.clearTx();
+    Serial.clearRx();
+    ArduinoShim::advanceMicros(BENCH_REQUEST_PERIOD_US);
+    return elapsed;
+}
+
+static bool registersMatch(const uint16_t* expected){
+    uint16_t values[BENCH_JOURNALED];
+    server.copyFromHoldingRegisters(values, BENCH_JOURNALED, BENCH_FIRST);
+    return memcmp(values, expected, sizeof(values)) == 0;
+}
+
+static void clearRegisters(){
+    uint16_t zeros[BENCH_REGISTERS] = {};
+    server.copyToHoldingRegisters(zeros, BENCH_REGISTERS, 0);
+}
+
+static bool benchThroughput(uint32_t requests){
+    uint8_t frame[MODBUS_MAX_FRAME_LEN];
+    eepromErase();
+    clearRegisters();
+    server.setHoldingWrittenFunction(NULL, NULL);
+    uint64_t plainNs = 0;
+    for (uint32_t i = 0; i < requests; ++i){
+        plainNs += serveRequest(frame, buildRandomWrite(frame));
+    }
+
+    if (journal.begin(server, &storage, BENCH_FIRST) != 0){
+        printf("Erased storage restored registers\n");
+        return false;
+    }
+    memset(registerWrites, 0, sizeof(registerWrites));
+    uint64_t journalNs = 0;
+    uint64_t flushNs = 0;
+    uint64_t records = 0;
+    uint16_t maxBatch = 0; //Records written by one flush() call (snapshot included)
+    for (uint32_t i = 0; i < requests; ++i){
+        journalNs += serveRequest(frame, buildRandomWrite(frame));
+        uint64_t start = benchNowNs();
+        uint16_t batch = journal.flush();
+        flushNs += benchNowNs() - start;
+        records += batch;
+        maxBatch = batch > maxBatch ? batch : maxBatch;
+    }
+    journal.sync();
+    uint16_t expected[BENCH_JOURNALED];
+    server.copyFromHoldingRegisters(expected, BENCH_JOURNALED, BENCH_FIRST);
+
+    benchReport("FC6/FC16 without journal", plainNs, requests, "req");
+    benchReport("FC6/FC16 with journal", journalNs, requests, "req");
+    benchReport("flush() per call", flushNs, requests, "call");
+    uint32_t maxWear = 0;
+    for (uint32_t i = 0; i < BENCH_EEPROM_SIZE; ++i){
+        maxWear = eeprom.wear[i] > maxWear ? eeprom.wear[i] : maxWear;
+    }
+    uint32_t maxRegisterWrites = 0;
+    for (uint16_t i = BENCH_FIRST; i < BENCH_FIRST + BENCH_JOURNALED; ++i){
+        maxRegisterWrites = registerWrites[i] > maxRegisterWrites ? registerWrites[i] : maxRegisterWrites;
+    }
+    double averageWear = (double)eeprom.bytesWritten / BENCH_EEPROM_SIZE;
+    printf("%u requests (%lu ms apart): %llu records (%.2f per request), %u snapshots, %.1f s of EEPROM writes\n",
+        requests, BENCH_REQUEST_PERIOD_US / 1000UL, (unsigned long long)records, (double)records / requests,
+        journal.getSnapshotCount(), eeprom.bytesWritten * BENCH_EEPROM_WRITE_US / 1e6);
+    printf("Longest flush() call: %u records (%.1f ms of EEPROM writes)\n", maxBatch,
+        maxBatch * MODBUS_JOURNAL_RECORD_LEN * BENCH_EEPROM_WRITE_US / 1000.0);
+    printf("Wear: most written byte %u writes, average %.1f (writes in place from write event: %u)\n",
+        maxWear, averageWear, maxRegisterWrites);
+
+    //Restore into cleared registers
+    clearRegisters();
+    uint64_t start = benchNowNs();
+    int32_t restored = journal.begin(server, &storage, BENCH_FIRST);
+    uint64_t restoreNs = benchNowNs() - start;
+    printf("Restore of %d registers from %u records: %.1f us\n", restored, BENCH_EEPROM_SIZE / MODBUS_JOURNAL_RECORD_LEN,
+        restoreNs / 1000.0);
+    bool valid = restored == BENCH_JOURNALED && registersMatch(expected);
+    if (!valid){
+        printf("  restored registers differ\n");
+    }
+    return valid;
+}
+
+static bool benchPowerCuts(uint32_t cuts){
+    uint8_t frame[MODBUS_MAX_FRAME_LEN];
+    eepromErase();
+    clearRegisters();
+    journal.begin(server, &storage, BENCH_FIRST);
+    uint32_t mismatches = 0;
+    uint64_t records = 0;
+    for (uint32_t cut = 0; cut < cuts; ++cut){
+        //Cut power in the middle of random record (sometimes during snapshot)
+        eeprom.writeBudget = benchRandom() % (MODBUS_JOURNAL_RECORD_LEN * (BENCH_JOURNALED + 40));
+        while (eeprom.writeBudget != 0){
+            serveRequest(frame, buildRandomWrite(frame));
+            records += journal.flush();
+        }
+        eeprom.writeBudget = -1;
+        eeprom.snapshotNext = -1;
+        clearRegisters();
+        journal.begin(server, &storage, BENCH_FIRST);
+        if (!registersMatch(eeprom.durable)){
+            ++mismatches;
+        }
+    }
+    printf("%u power cuts (%llu records between them): %u restores differ from the last complete record\n",
+        cuts, (unsigned long long)records, mismatches);
+    return mismatches == 0;
+}
+
+int main(int argc, char** argv){
+    uint32_t requests = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    uint32_t cuts = argc > 2 ? strtoul(argv[2], NULL, 10) : 2000;
+    ArduinoShim::useSimulatedClock(true);
+    ArduinoShim::setMicros(1000000UL);
+    server.startModbusServer(BENCH_SLAVE_ADDRESS, BENCH_BAUD_RATE);
+
+    printf("%u journaled registers, %u byte EEPROM, flush delay %u ms, batch %u records\n", BENCH_JOURNALED,
+        BENCH_EEPROM_SIZE, MODBUS_JOURNAL_DELAY_MS, MODBUS_JOURNAL_BATCH);
+    bool valid = benchThroughput(requests);
+    valid &= benchPowerCuts(cuts);
+    return valid ? 0 : 1;
+}
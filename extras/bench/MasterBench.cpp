@@ -0,0 +1,127 @@
+/*Poll scheduler benchmark. Master on Serial1 polls 30 slaves (one server answering 30 unit IDs on Serial)
+over simulated RS-485 bus, bytes are delivered at the speed of the line. Reports achieved poll cycle
+time per slave and bus utilization for different merge gaps (gap 0 merges only adjacent polls, gaps between polls
+of a slave are 0, 4, 8 and 12 registers, so each merge gap of the sweep changes the plan).
+Usage: master_bench [baud rate] [simulated milliseconds]
+*/
+
+#include "BenchUtil.h"
+#include "ModbusMaster.h"
+
+#define BENCH_SLAVES 30
+#define BENCH_POLLS_PER_SLAVE 5
+#define BENCH_STEP_US 20
+
+static ModbusRTU server;
+static ModbusMaster master;
+static ModbusUnit units[BENCH_SLAVES];
+static ModbusPoll polls[BENCH_SLAVES * BENCH_POLLS_PER_SLAVE];
+static uint16_t values[BENCH_SLAVES * BENCH_POLLS_PER_SLAVE][20];
+
+//Register ranges read from every slave (separated by 0, 4, 8 and 12 unrequested registers)
+static const struct {
+    uint16_t first;
+    uint16_t count;
+} ranges[BENCH_POLLS_PER_SLAVE] = {{0, 10}, {10, 10}, {24, 20}, {52, 6}, {70, 4}};
+
+//Moves transmitted bytes to the other side of the bus, one byte per character time
+static void deliver(HardwareSerial& from, HardwareSerial& to, unsigned long charTime, uint64_t* busBytes){
+    if (from.txSize() > 0){
+        to.injectRx(from.txBuffer(), from.txSize(), micros() + charTime, charTime);
+        *busBytes += from.txSize();
+        from.clearTx();
+    }
+}
+
+static bool benchSchedule(uint8_t mergeGap, unsigned long baudRate, unsigned long duration){
+    unsigned long charTime = (MODBUS_CHAR_BITS * 1000000UL + baudRate - 1) / baudRate;
+    for (uint8_t s = 0; s < BENCH_SLAVES; ++s){
+        for (uint8_t p = 0; p < BENCH_POLLS_PER_SLAVE; ++p){
+            ModbusPoll* poll = &polls[s * BENCH_POLLS_PER_SLAVE + p];
+            memset(poll, 0, sizeof(ModbusPoll));
+            poll->slave = s + 1;
+            poll->functionCode = FC_READ_HOLDING_REGISTERS;
+            poll->first = ranges[p].first;
+            poll->count = ranges[p].count;
+            poll->destination = values[s * BENCH_POLLS_PER_SLAVE + p];
+            poll->period = 0; //As fast as possible
+        }
+    }
+    //Transaction interrupted by the end of previous run is dropped, both sides finish frames after silence
+    master.setPolls(polls, 0);
+    Serial.clearRx();
+    Serial1.clearRx();
+    ArduinoShim::advanceMicros(100000UL);
+    master.communicationLoop();
+    server.communicationLoop();
+    Serial.clearTx();
+    Serial1.clearTx();
+    //Merged requests may read long responses, which take more than default timeout on slow line
+    master.setResponseTimeout(MODBUS_MASTER_RESPONSE_TIMEOUT + MODBUS_MAX_FRAME_LEN * charTime / 1000);
+    master.setMergeGap(mergeGap);
+    master.setPolls(polls, BENCH_SLAVES * BENCH_POLLS_PER_SLAVE);
+
+    uint16_t requests = 0;
+    for (uint8_t i = 0; i < BENCH_SLAVES * BENCH_POLLS_PER_SLAVE; ++i){
+        requests += polls[i].blockPolls != 0;
+    }
+
+    uint64_t busBytes = 0;
+    unsigned long start = micros();
+    while (micros() - start < duration * 1000UL){
+        master.communicationLoop();
+        deliver(Serial1, Serial, charTime, &busBytes);
+        server.communicationLoop();
+        deliver(Serial, Serial1, charTime, &busBytes);
+        ArduinoShim::advanceMicros(BENCH_STEP_US);
+    }
+
+    bool valid = true;
+    unsigned long worst = 0;
+    uint64_t sum = 0;
+    for (uint8_t s = 1; s <= BENCH_SLAVES; ++s){
+        unsigned long cycleTime = master.getSlaveCycleTime(s);
+        valid &= cycleTime != 0;
+        sum += cycleTime;
+        worst = cycleTime > worst ? cycleTime : worst;
+    }
+    for (uint8_t i = 0; i < BENCH_SLAVES * BENCH_POLLS_PER_SLAVE; ++i){
+        valid &= polls[i].status == POLL_OK && polls[i].errors == 0;
+        valid &= polls[i].destination[polls[i].count - 1] == polls[i].first + polls[i].count - 1;
+    }
+    printf("merge gap %-3u %4u requests/cycle  cycle %8.1f ms (worst %8.1f ms)  bus load %5.1f %%\n",
+        mergeGap, requests, sum / 1000.0 / BENCH_SLAVES, worst / 1000.0,
+        100.0 * busBytes * charTime / (duration * 1000.0));
+    return valid;
+}
+
+int main(int argc, char** argv){
+    unsigned long baudRate = argc > 1 ? strtoul(argv[1], NULL, 10) : 19200;
+    unsigned long duration = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000;
+
+    ArduinoShim::useSimulatedClock(true);
+    ArduinoShim::setMicros(1000000UL);
+    master.setCustomSerialPort(&Serial1);
+    Serial1.begin(baudRate, SERIAL_8E1);
+    master.startModbusMaster(baudRate);
+    server.startModbusServer(1, baudRate);
+    for (uint8_t s = 1; s < BENCH_SLAVES; ++s){
+        units[s] = {(uint8_t)(s + 1), 0, 0, 0, HOLDING_REGISTER_NUM, NULL};
+        server.addUnit(&units[s]);
+    }
+    for (uint16_t i = 0; i < HOLDING_REGISTER_NUM; ++i){
+        server.copyToHoldingRegisters(&i, 1, i);
+    }
+
+    printf("%u slaves, %u polls per slave, %lu baud, %lu ms simulated\n", BENCH_SLAVES, BENCH_POLLS_PER_SLAVE,
+        baudRate, duration);
+    bool valid = true;
+    const uint8_t gaps[] = {0, 2, 4, 8, 12, 16};
+    for (uint8_t i = 0; i < sizeof(gaps); ++i){
+        valid &= benchSchedule(gaps[i], baudRate, duration);
+    }
+    if (!valid){
+        printf("some polls failed\n");
+    }
+    return valid ? 0 : 1;
+}
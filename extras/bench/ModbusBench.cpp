@@ -0,0 +1,225 @@
+/*Request throughput benchmark. Feeds FC1-FC23 requests through simulated serial port into
+communicationLoop() and measures time needed to produce the response.
+Usage: modbus_bench [iterations]
+*/
+
+#include "BenchUtil.h"
+#include "ModbusRegisterMap.h"
+
+#define BENCH_SLAVE_ADDRESS 1
+#define BENCH_BAUD_RATE 115200UL
+#define BENCH_BITS 500
+#define BENCH_PROVIDED 50
+#define BENCH_SAMPLES 64 //Samples averaged by provider for each register
+
+static ModbusRTU modbus;
+//Digital I/O map (coils and discrete inputs stored packed)
+static ModbusServer<0, 0, MODBUS_FUNCTIONS_BITS, 0, BENCH_BITS, BENCH_BITS> bitServer;
+//Input registers computed on demand by providers
+static ModbusServer<BENCH_PROVIDED, 0, MODBUS_FC_MASK(FC_READ_INPUT_REGISTERS)> providerServer;
+static ModbusRTUBase* server = &modbus; //Server under test
+static SparseRegisterMap<RegisterRange<0, 21>, RegisterRange<1000, 41>, RegisterRange<30000, 11>> sparseHolding;
+
+/**
+ * @brief Sends given request repeatedly and measures time until response is produced
+ * @param burst Number of copies of request injected back-to-back at once
+ * @return False if any response was invalid or missing
+ */
+static bool benchRequest(const char* name, const uint8_t* request, uint16_t length, uint32_t iterations, uint8_t burst = 1){
+    uint32_t invalid = 0;
+    uint8_t frames[4 * MODBUS_MAX_FRAME_LEN];
+    for (uint8_t i = 0; i < burst; ++i){
+        memcpy(frames + i * length, request, length);
+    }
+
+    //Learn length of single response
+    Serial.injectRx(request, length);
+    for (uint16_t poll = 0; poll < 1000 && Serial.txSize() == 0; ++poll){
+        server->communicationLoop();
+    }
+    size_t responseLength = Serial.txSize();
+    Serial.clearTx();
+
+    uint64_t start = benchNowNs();
+    for (uint32_t i = 0; i < iterations; ++i){
+        Serial.injectRx(frames, length * burst);
+        //Poll until all responses are produced (or requests are dropped)
+        for (uint16_t poll = 0; poll < 1000 && Serial.txSize() < responseLength * burst; ++poll){
+            server->communicationLoop();
+        }
+        if (Serial.txSize() != responseLength * burst ||
+            !benchValidResponse(request, Serial.txBuffer() + responseLength * (burst - 1), responseLength)){
+            ++invalid;
+        }
+        Serial.clearTx();
+        Serial.clearRx();
+    }
+    benchReport(name, benchNowNs() - start, (uint64_t)iterations * burst, "req");
+    if (invalid != 0){
+        printf("  %u invalid responses\n", invalid);
+    }
+    return invalid == 0;
+}
+
+/**
+ * @brief Simulates DMA transmit: whole response is taken at once, completion is signaled
+ * by the benchmark through transmitCompleteISR()
+ */
+static uint16_t dmaWrite(const char* buffer, uint16_t length, void* ctx){
+    return ((HardwareSerial*)ctx)->write((const uint8_t*)buffer, length);
+}
+
+/**
+ * @brief Measures request handling with asynchronous transmit, where communicationLoop()
+ * only queues the response
+ */
+static bool benchAsyncRequest(const char* name, const uint8_t* request, uint16_t length, uint32_t iterations){
+    uint32_t invalid = 0;
+    modbus.setAsyncSerialWriteFunction(dmaWrite, NULL, &Serial);
+    uint64_t start = benchNowNs();
+    for (uint32_t i = 0; i < iterations; ++i){
+        Serial.injectRx(request, length);
+        for (uint16_t poll = 0; poll < 1000 && !modbus.isTransmitting(); ++poll){
+            modbus.communicationLoop();
+        }
+        modbus.transmitCompleteISR();
+        if (!benchValidResponse(request, Serial.txBuffer(), Serial.txSize())){
+            ++invalid;
+        }
+        Serial.clearTx();
+        Serial.clearRx();
+    }
+    benchReport(name, benchNowNs() - start, iterations, "req");
+    if (invalid != 0){
+        printf("  %u invalid responses\n", invalid);
+    }
+    return invalid == 0;
+}
+
+static uint64_t providedRegisters = 0;
+
+//Stands for averaging of ADC samples
+static void averageProvider(uint16_t* values, uint16_t first, uint16_t count, void* ctx){
+    for (uint16_t i = 0; i < count; ++i){
+        volatile uint32_t sum = 0;
+        for (uint16_t sample = 0; sample < BENCH_SAMPLES; ++sample){
+            sum += (first + i) * 16 + (sample & 15);
+        }
+        values[i] = sum / BENCH_SAMPLES;
+    }
+    providedRegisters += count;
+}
+
+static bool benchProviders(uint32_t iterations){
+    static ModbusProvider onDemand = {0, BENCH_PROVIDED / 2, averageProvider, NULL, 0};
+    static ModbusProvider cached = {BENCH_PROVIDED / 2, BENCH_PROVIDED / 2, averageProvider, NULL, 100};
+    providerServer.addInputProvider(&onDemand);
+    providerServer.addInputProvider(&cached);
+    providerServer.startModbusServer(BENCH_SLAVE_ADDRESS, BENCH_BAUD_RATE);
+    server = &providerServer;
+    uint8_t request[MODBUS_MAX_FRAME_LEN];
+    bool valid = true;
+    uint16_t length = benchBuildRequest(request, BENCH_SLAVE_ADDRESS, FC_READ_INPUT_REGISTERS, 5, 10);
+    providedRegisters = 0;
+    valid &= benchRequest("FC4 read 10, provider on demand", request, length, iterations);
+    printf("  %llu registers computed for %u requests\n", (unsigned long long)providedRegisters, iterations + 1);
+    length = benchBuildRequest(request, BENCH_SLAVE_ADDRESS, FC_READ_INPUT_REGISTERS, BENCH_PROVIDED / 2 + 5, 10);
+    providedRegisters = 0;
+    valid &= benchRequest("FC4 read 10, provider cached 100 ms", request, length, iterations);
+    printf("  %llu registers computed for %u requests\n", (unsigned long long)providedRegisters, iterations + 1);
+    server = &modbus;
+    return valid;
+}
+
+static void benchCRC(uint32_t iterations){
+    uint8_t data[256];
+    for (uint16_t i = 0; i < sizeof(data); ++i){
+        data[i] = (uint8_t)(i * 31 + 7);
+    }
+    volatile uint16_t sink = 0;
+    uint64_t start = benchNowNs();
+    for (uint32_t i = 0; i < iterations; ++i){
+        data[0] = (uint8_t)i;
+        sink ^= modbusCRC16(data, sizeof(data));
+    }
+    benchReport("CRC (256 byte blocks)", benchNowNs() - start, (uint64_t)iterations * sizeof(data), "byte");
+    (void)sink;
+}
+
+int main(int argc, char** argv){
+    uint32_t iterations = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 10) : 200000;
+
+    modbus.startModbusServer(BENCH_SLAVE_ADDRESS, BENCH_BAUD_RATE);
+    for (uint16_t i = 0; i < INPUT_REGISTER_NUM; ++i){
+        modbus.copyToInputRegisters(&i, 1, i);
+    }
+    for (uint16_t i = 0; i < HOLDING_REGISTER_NUM; ++i){
+        modbus.copyToHoldingRegisters(&i, 1, i);
+    }
+
+    uint8_t request[MODBUS_MAX_FRAME_LEN];
+    uint16_t values[MAX_WRITE_REGISTER_COUNT];
+    for (uint16_t i = 0; i < MAX_WRITE_REGISTER_COUNT; ++i){
+        values[i] = i * 3;
+    }
+    uint16_t maxInputRead = INPUT_REGISTER_NUM < MAX_READ_REGISTER_COUNT ? INPUT_REGISTER_NUM : MAX_READ_REGISTER_COUNT;
+    bool valid = true;
+
+    //Footprint of server object (register buffers + state), host pointers are wider than on AVR
+    printf("sizeof(ModbusRTU) = %u, sizeof(ModbusServer<0, 16, FC3 | FC6>) = %u\n", (unsigned)sizeof(ModbusRTU),
+        (unsigned)sizeof(ModbusServer<0, 16, MODBUS_FC_MASK(FC_READ_HOLDING_REGISTERS) | MODBUS_FC_MASK(FC_WRITE_SINGLE_REGISTER)>));
+    printf("%u iterations per scenario\n", iterations);
+    uint16_t length = benchBuildRequest(request, BENCH_SLAVE_ADDRESS, FC_READ_HOLDING_REGISTERS, 0, 10);
+    valid &= benchRequest("FC3 read 10 holding registers", request, length, iterations);
+    length = benchBuildRequest(request, BENCH_SLAVE_ADDRESS, FC_READ_INPUT_REGISTERS, 0, maxInputRead);
+    valid &= benchRequest("FC4 read max input registers", request, length, iterations);
+    length = benchBuildRequest(request, BENCH_SLAVE_ADDRESS, FC_WRITE_SINGLE_REGISTER, 5, 0x1234);
+    valid &= benchRequest("FC6 write single register", request, length, iterations);
+    length = benchBuildWriteMultiple(request, BENCH_SLAVE_ADDRESS, FC_WRITE_MULTIPLE_REGISTERS, 10, 40, values);
+    valid &= benchRequest("FC16 write 40 registers", request, length, iterations);
+    length = benchBuildWriteMultiple(request, BENCH_SLAVE_ADDRESS, FC_READ_WRITE_MULTIPLE_REGISTERS, 10, 40, values, 10, 40);
+    valid &= benchRequest("FC23 write/read 40 registers", request, length, iterations);
+    length = benchBuildRequest(request, BENCH_SLAVE_ADDRESS, FC_READ_HOLDING_REGISTERS, 0, 10);
+    valid &= benchRequest("FC3 back-to-back (4 frames)", request, length, iterations / 4 + 1, 4);
+    modbus.setHoldingRegisterMap(sparseHolding);
+    length = benchBuildRequest(request, BENCH_SLAVE_ADDRESS, FC_READ_HOLDING_REGISTERS, 30000, 10);
+    valid &= benchRequest("FC3 read 10, sparse map (3rd range)", request, length, iterations);
+    valid &= benchProviders(iterations);
+
+    //Points stored as packed bits instead of one holding register each
+    uint8_t pattern[(BENCH_BITS + 7) / 8];
+    for (uint16_t i = 0; i < sizeof(pattern); ++i){
+        pattern[i] = (uint8_t)(i * 37);
+    }
+    bitServer.copyToCoils(pattern, BENCH_BITS, 0);
+    bitServer.copyToDiscreteInputs(pattern, BENCH_BITS, 0);
+    bitServer.startModbusServer(BENCH_SLAVE_ADDRESS, BENCH_BAUD_RATE);
+    server = &bitServer;
+    printf("%u points: %u bytes packed, %u bytes as holding registers\n", BENCH_BITS, (unsigned)sizeof(pattern),
+        (unsigned)(BENCH_BITS * sizeof(uint16_t)));
+    length = benchBuildRequest(request, BENCH_SLAVE_ADDRESS, FC_READ_COILS, 0, BENCH_BITS);
+    valid &= benchRequest("FC1 read 500 coils", request, length, iterations);
+    length = benchBuildRequest(request, BENCH_SLAVE_ADDRESS, FC_READ_DISCRETE_INPUTS, 3, BENCH_BITS - 3);
+    valid &= benchRequest("FC2 read 497 inputs (unaligned)", request, length, iterations);
+    length = benchBuildRequest(request, BENCH_SLAVE_ADDRESS, FC_WRITE_SINGLE_COIL, 77, COIL_ON);
+    valid &= benchRequest("FC5 write single coil", request, length, iterations);
+    request[0] = BENCH_SLAVE_ADDRESS;
+    request[1] = FC_WRITE_MULTIPLE_COILS;
+    request[2] = 0;
+    request[3] = 5;
+    request[4] = (BENCH_BITS - 5) >> 8;
+    request[5] = (BENCH_BITS - 5) & 0xff;
+    request[6] = (BENCH_BITS - 5 + 7) / 8;
+    memcpy(request + 7, pattern, request[6]);
+    length = 7 + request[6];
+    put_16bit_into_byte_buffer(request, length, modbusCRC16(request, length));
+    valid &= benchRequest("FC15 write 495 coils (unaligned)", request, length + CRC_LEN, iterations);
+    server = &modbus;
+
+    //Transmit mode stays asynchronous, so this goes last
+    length = benchBuildRequest(request, BENCH_SLAVE_ADDRESS, FC_READ_INPUT_REGISTERS, 0, maxInputRead);
+    valid &= benchAsyncRequest("FC4 max input, async (DMA) transmit", request, length, iterations);
+    benchCRC(iterations / 10 + 1);
+
+    return valid ? 0 : 1;
+}
@@ -0,0 +1,76 @@
+/*Interrupt driven receive benchmark. Measures cost of idle communicationLoop() with polled
+and interrupt driven receive, and request throughput when bytes are delivered by another thread
+through receiveByteISR() (simulating UART RX interrupt).
+Usage: ring_bench [iterations]
+*/
+
+#include "BenchUtil.h"
+#include <atomic>
+#include <thread>
+
+#define BENCH_SLAVE_ADDRESS 1
+#define BENCH_BAUD_RATE 115200UL
+
+static ModbusRTU modbus;
+static RxRingCtx ring;
+static std::atomic<uint32_t> responses(0);
+static std::atomic<bool> running(true);
+
+static void benchIdle(const char* name, uint32_t iterations){
+    uint64_t start = benchNowNs();
+    for (uint32_t i = 0; i < iterations; ++i){
+        modbus.communicationLoop();
+    }
+    benchReport(name, benchNowNs() - start, iterations, "call");
+}
+
+/**
+ * @brief Simulated master with RX interrupt: pushes request bytes one by one
+ * and waits for the response before sending the next request
+ */
+static void producer(const uint8_t* request, uint16_t length, uint32_t iterations){
+    for (uint32_t i = 0; i < iterations; ++i){
+        for (uint16_t b = 0; b < length; ++b){
+            modbus.receiveByteISR(request[b]);
+        }
+        while (responses.load(std::memory_order_acquire) <= i){
+            std::this_thread::yield();
+        }
+    }
+    running = false;
+}
+
+int main(int argc, char** argv){
+    uint32_t iterations = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 10) : 200000;
+
+    modbus.startModbusServer(BENCH_SLAVE_ADDRESS, BENCH_BAUD_RATE);
+    benchIdle("idle loop, polled receive", iterations * 10);
+    modbus.setInterruptReceive(&ring);
+    benchIdle("idle loop, interrupt receive", iterations * 10);
+
+    uint8_t request[8];
+    uint16_t length = benchBuildRequest(request, BENCH_SLAVE_ADDRESS, FC_READ_HOLDING_REGISTERS, 0, 10);
+    size_t responseLength = MODBUS_RESPONSE_BASE_LEN + 10 * 2 + CRC_LEN;
+    uint32_t invalid = 0;
+
+    uint64_t start = benchNowNs();
+    std::thread producerThread(producer, request, length, iterations);
+    while (running){
+        modbus.communicationLoop();
+        if (Serial.txSize() >= responseLength){
+            if (!benchValidResponse(request, Serial.txBuffer(), Serial.txSize())){
+                ++invalid;
+            }
+            Serial.clearTx();
+            responses.fetch_add(1, std::memory_order_release);
+            //Let the producer run on single core machines
+            std::this_thread::yield();
+        }
+    }
+    producerThread.join();
+    benchReport("FC3 via receiveByteISR (thread)", benchNowNs() - start, iterations, "req");
+    if (invalid != 0){
+        printf("  %u invalid responses\n", invalid);
+    }
+    return invalid == 0 ? 0 : 1;
+}
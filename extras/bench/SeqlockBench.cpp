@@ -0,0 +1,88 @@
+/*Consistent register bank benchmark. Producer thread (simulating ADC interrupt) keeps rewriting block
+of input registers with the same value in every register, while main thread serves FC4 reads of the block.
+Reports read rate and number of torn reads (registers of one response differ) for plain and
+sequence locked (MODBUS_CONSISTENT_REGISTERS) bank.
+Usage: seqlock_bench [milliseconds per scenario]
+*/
+
+#include "BenchUtil.h"
+#include <atomic>
+#include <thread>
+
+#define BENCH_SLAVE_ADDRESS 1
+#define BENCH_BLOCK 32
+
+static std::atomic<bool> running(false);
+static uint8_t request[8];
+static uint16_t requestLength;
+static uint32_t reads;
+static uint32_t torn;
+
+//Request is "received" on every call (with CRC already verified)
+static uint16_t requestRead(char* buffer, void* ctx){
+    (void)ctx;
+    memcpy(buffer, request, requestLength);
+    return requestLength | MODBUS_FRAME_CRC_OK;
+}
+
+static void responseWrite(const char* buffer, uint16_t length, void* ctx){
+    (void)ctx;
+    (void)length;
+    const uint8_t* data = (const uint8_t*)buffer + MODBUS_RESPONSE_BASE_LEN;
+    for (uint8_t i = 1; i < BENCH_BLOCK; ++i){
+        if (data[2 * i] != data[0] || data[2 * i + 1] != data[1]){
+            ++torn;
+            break;
+        }
+    }
+    ++reads;
+}
+
+template<typename Server>
+static void producer(Server* server){
+    uint16_t block[BENCH_BLOCK];
+    uint16_t value = 0;
+    while (running.load(std::memory_order_relaxed)){
+        ++value;
+        for (uint8_t i = 0; i < BENCH_BLOCK; ++i){
+            block[i] = value;
+        }
+        server->copyToInputRegisters(block, BENCH_BLOCK, 0);
+    }
+}
+
+template<typename Server>
+static uint32_t benchBank(const char* name, Server* server, unsigned long duration){
+    server->setSerialReadFunction(requestRead, NULL);
+    server->setSerialWriteFunction(responseWrite, NULL);
+    server->startModbusServer(BENCH_SLAVE_ADDRESS, 0);
+    reads = 0;
+    torn = 0;
+
+    running = true;
+    std::thread producerThread(producer<Server>, server);
+    uint64_t start = benchNowNs();
+    uint64_t end = start + (uint64_t)duration * 1000000ULL;
+    while (benchNowNs() < end){
+        for (uint16_t i = 0; i < 1000; ++i){
+            server->communicationLoop();
+        }
+    }
+    uint64_t elapsed = benchNowNs() - start;
+    running = false;
+    producerThread.join();
+    benchReport(name, elapsed, reads, "read");
+    printf("  %u torn reads\n", torn);
+    return torn;
+}
+
+int main(int argc, char** argv){
+    unsigned long duration = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000;
+    static ModbusServer<BENCH_BLOCK, 0, MODBUS_FC_MASK(FC_READ_INPUT_REGISTERS)> plain;
+    static ModbusServer<BENCH_BLOCK, 0, MODBUS_FC_MASK(FC_READ_INPUT_REGISTERS), MODBUS_CONSISTENT_REGISTERS> consistent;
+
+    requestLength = benchBuildRequest(request, BENCH_SLAVE_ADDRESS, FC_READ_INPUT_REGISTERS, 0, BENCH_BLOCK);
+    benchBank("FC4 plain bank, concurrent writer", &plain, duration);
+    uint32_t consistentTorn = benchBank("FC4 consistent bank, concurrent writer", &consistent, duration);
+    return consistentTorn == 0 ? 0 : 1;
+}
@@ -0,0 +1,206 @@
+/*Modbus TCP benchmark. Server thread serves TCP port on localhost, client threads read the same block of
+holding registers, each keeping given number of requests in flight (pipelined). Every response is checked
+(transaction ID, register values, CRC for RTU over TCP). Reports request rate and round trip time for
+several numbers of clients, pipeline depths and both stream framings.
+Usage: tcp_bench [milliseconds per scenario]
+*/
+
+#include "BenchUtil.h"
+#include "ModbusTcp.h"
+#include <atomic>
+#include <thread>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define BENCH_SLAVE_ADDRESS 1
+#define BENCH_REGISTERS 20
+#define BENCH_MAX_CLIENTS MODBUS_TCP_MAX_CLIENTS
+#define BENCH_MAX_DEPTH 8
+
+static ModbusServer<0, 100, MODBUS_FC_MASK(FC_READ_HOLDING_REGISTERS)> server;
+static ModbusTcpServer tcp;
+static std::atomic<bool> serving(false);
+
+typedef struct {
+    uint64_t responses;
+    uint64_t totalNs;
+    uint64_t worstNs;
+    uint32_t errors;
+} ClientResult;
+
+static void serve(){
+    while (serving.load(std::memory_order_relaxed)){
+        tcp.wait(10);
+        while (tcp.hasRequest()){
+            server.communicationLoop();
+        }
+    }
+}
+
+static bool receiveExactly(int fd, uint8_t* buffer, size_t length){
+    while (length > 0){
+        ssize_t count = recv(fd, buffer, length, 0);
+        if (count <= 0){
+            return false;
+        }
+        buffer += count;
+        length -= count;
+    }
+    return true;
+}
+
+//Builds read request, returns its length
+static uint16_t buildRequest(uint8_t* request, uint8_t framing, uint16_t transaction){
+    uint8_t rtu[8];
+    benchBuildRequest(rtu, BENCH_SLAVE_ADDRESS, FC_READ_HOLDING_REGISTERS, 0, BENCH_REGISTERS);
+    if (framing == MODBUS_RTU_OVER_TCP){
+        memcpy(request, rtu, sizeof(rtu));
+        return sizeof(rtu);
+    }
+    request[0] = transaction >> 8;
+    request[1] = transaction & 0xff;
+    request[2] = 0;
+    request[3] = 0;
+    request[4] = 0;
+    request[5] = MODBUS_REQUEST_BASE_LENGTH;
+    memcpy(request + MBAP_HEADER_LEN - 1, rtu, MODBUS_REQUEST_BASE_LENGTH);
+    return MBAP_HEADER_LEN - 1 + MODBUS_REQUEST_BASE_LENGTH;
+}
+
+//Receives and checks response of oldest request
+static bool receiveResponse(int fd, uint8_t framing, uint16_t transaction){
+    uint8_t response[MBAP_HEADER_LEN + MODBUS_MAX_FRAME_LEN];
+    const uint8_t* pdu;
+    if (framing == MODBUS_TCP){
+        if (!receiveExactly(fd, response, MBAP_HEADER_LEN - 1)){
+            return false;
+        }
+        uint16_t length = ((uint16_t)response[4] << 8) | response[5];
+        if (length != MODBUS_RESPONSE_BASE_LEN + BENCH_REGISTERS * 2 || !receiveExactly(fd, response + MBAP_HEADER_LEN - 1, length) ||
+            response[0] != (transaction >> 8) || response[1] != (transaction & 0xff)){
+            return false;
+        }
+        pdu = response + MBAP_HEADER_LEN - 1;
+    }
+    else {
+        if (!receiveExactly(fd, response, MODBUS_RESPONSE_BASE_LEN + BENCH_REGISTERS * 2 + CRC_LEN) ||
+            modbusCRC16(response, MODBUS_RESPONSE_BASE_LEN + BENCH_REGISTERS * 2 + CRC_LEN) != 0){
+            return false;
+        }
+        pdu = response;
+    }
+    if (pdu[0] != BENCH_SLAVE_ADDRESS || pdu[1] != FC_READ_HOLDING_REGISTERS || pdu[2] != BENCH_REGISTERS * 2){
+        return false;
+    }
+    for (uint16_t i = 0; i < BENCH_REGISTERS; ++i){
+        if (pdu[MODBUS_RESPONSE_BASE_LEN + 2 * i] != 0 || pdu[MODBUS_RESPONSE_BASE_LEN + 2 * i + 1] != i){
+            return false;
+        }
+    }
+    return true;
+}
+
+static void client(uint16_t port, uint8_t framing, uint8_t depth, uint64_t end, ClientResult* result){
+    memset(result, 0, sizeof(ClientResult));
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in remote;
+    memset(&remote, 0, sizeof(remote));
+    remote.sin_family = AF_INET;
+    remote.sin_port = htons(port);
+    remote.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    if (connect(fd, (struct sockaddr*)&remote, sizeof(remote)) != 0){
+        result->errors = 1;
+        close(fd);
+        return;
+    }
+
+    uint8_t request[MBAP_HEADER_LEN + MODBUS_MAX_FRAME_LEN];
+    uint64_t sent[BENCH_MAX_DEPTH];
+    uint16_t nextTransaction = 0;
+    uint16_t oldestTransaction = 0;
+    uint8_t inFlight = 0;
+    while (true){
+        bool running = benchNowNs() < end;
+        if (running && inFlight < depth){
+            uint16_t length = buildRequest(request, framing, nextTransaction);
+            sent[nextTransaction % depth] = benchNowNs();
+            ++nextTransaction;
+            ++inFlight;
+            if (send(fd, request, length, MSG_NOSIGNAL) != length){
+                ++result->errors;
+                break;
+            }
+            continue;
+        }
+        if (inFlight == 0){
+            break;
+        }
+        if (!receiveResponse(fd, framing, oldestTransaction)){
+            ++result->errors;
+            break;
+        }
+        uint64_t elapsed = benchNowNs() - sent[oldestTransaction % depth];
+        ++oldestTransaction;
+        --inFlight;
+        ++result->responses;
+        result->totalNs += elapsed;
+        result->worstNs = elapsed > result->worstNs ? elapsed : result->worstNs;
+    }
+    close(fd);
+}
+
+static bool benchScenario(uint8_t framing, uint8_t clients, uint8_t depth, unsigned long duration){
+    if (!tcp.begin(0, framing, "127.0.0.1")){
+        perror("listen");
+        return false;
+    }
+    serving = true;
+    std::thread serverThread(serve);
+
+    std::thread threads[BENCH_MAX_CLIENTS];
+    ClientResult results[BENCH_MAX_CLIENTS];
+    uint64_t start = benchNowNs();
+    uint64_t end = start + (uint64_t)duration * 1000000ULL;
+    for (uint8_t i = 0; i < clients; ++i){
+        threads[i] = std::thread(client, tcp.getPort(), framing, depth, end, &results[i]);
+    }
+    ClientResult total = {0, 0, 0, 0};
+    for (uint8_t i = 0; i < clients; ++i){
+        threads[i].join();
+        total.responses += results[i].responses;
+        total.totalNs += results[i].totalNs;
+        total.worstNs = results[i].worstNs > total.worstNs ? results[i].worstNs : total.worstNs;
+        total.errors += results[i].errors;
+    }
+    uint64_t elapsed = benchNowNs() - start;
+    serving = false;
+    serverThread.join();
+    tcp.end();
+
+    printf("%-12s %3u clients x %u in flight %10.0f req/s  round trip %8.1f us (worst %8.1f us)  %u errors\n",
+        framing == MODBUS_TCP ? "TCP" : "RTU over TCP", clients, depth, total.responses * 1e9 / elapsed,
+        total.responses ? total.totalNs / 1000.0 / total.responses : 0.0, total.worstNs / 1000.0, total.errors);
+    return total.errors == 0 && total.responses > 0;
+}
+
+int main(int argc, char** argv){
+    unsigned long duration = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000;
+    for (uint16_t i = 0; i < BENCH_REGISTERS; ++i){
+        server.copyToHoldingRegisters(&i, 1, i);
+    }
+    server.startModbusServer(BENCH_SLAVE_ADDRESS, 0);
+    server.addPort(&tcp);
+
+    bool valid = true;
+    valid &= benchScenario(MODBUS_TCP, 1, 1, duration);
+    valid &= benchScenario(MODBUS_TCP, 32, 1, duration);
+    valid &= benchScenario(MODBUS_TCP, 32, 4, duration);
+    valid &= benchScenario(MODBUS_RTU_OVER_TCP, 32, 4, duration);
+    printf("(32 clients polling every 100 ms need 320 req/s)\n");
+    return valid ? 0 : 1;
+}
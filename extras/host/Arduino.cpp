@@ -0,0 +1,187 @@
+#include "Arduino.h"
+#include <time.h>
+
+static bool simulatedClock = false;
+static unsigned long simulatedMicros = 0;
+static uint8_t pinStates[NUM_DIGITAL_PINS] = {0};
+
+static unsigned long monotonicMicros(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long)now.tv_sec * 1000000UL + (unsigned long)now.tv_nsec / 1000UL;
+}
+
+unsigned long micros(){
+    return simulatedClock ? simulatedMicros : monotonicMicros();
+}
+
+unsigned long millis(){
+    return micros() / 1000UL;
+}
+
+void delayMicroseconds(unsigned int us){
+    if (simulatedClock){
+        simulatedMicros += us;
+        return;
+    }
+    unsigned long start = monotonicMicros();
+    while (monotonicMicros() - start < us);
+}
+
+void delay(unsigned long ms){
+    if (simulatedClock){
+        simulatedMicros += ms * 1000UL;
+        return;
+    }
+    struct timespec duration = {(time_t)(ms / 1000UL), (long)(ms % 1000UL) * 1000000L};
+    nanosleep(&duration, NULL);
+}
+
+void pinMode(uint8_t pin, uint8_t mode){
+    (void)pin; (void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value){
+    if (pin < NUM_DIGITAL_PINS){
+        pinStates[pin] = value;
+    }
+}
+
+int digitalRead(uint8_t pin){
+    return pin < NUM_DIGITAL_PINS ? pinStates[pin] : LOW;
+}
+
+void noInterrupts(){}
+void interrupts(){}
+
+void ArduinoShim::useSimulatedClock(bool enabled){
+    if (enabled && !simulatedClock){
+        simulatedMicros = monotonicMicros();
+    }
+    simulatedClock = enabled;
+}
+
+void ArduinoShim::setMicros(unsigned long timestamp){
+    simulatedMicros = timestamp;
+}
+
+void ArduinoShim::advanceMicros(unsigned long delta){
+    simulatedMicros += delta;
+}
+
+
+
+HardwareSerial Serial;
+HardwareSerial Serial1;
+
+HardwareSerial::HardwareSerial(size_t rxCapacity, size_t txCapacity) :
+    rxCapacity(rxCapacity), txCapacity(txCapacity){
+    rxData = new uint8_t[rxCapacity];
+    rxArrival = new unsigned long[rxCapacity];
+    txData = new uint8_t[txCapacity];
+}
+
+HardwareSerial::~HardwareSerial(){
+    delete[] rxData;
+    delete[] rxArrival;
+    delete[] txData;
+}
+
+void HardwareSerial::begin(unsigned long baud, uint8_t config){
+    (void)config;
+    baudRate = baud;
+    started = true;
+}
+
+void HardwareSerial::end(){
+    started = false;
+}
+
+void HardwareSerial::updateVisible(){
+    if (rxVisible == rxTail){
+        return;
+    }
+    unsigned long now = micros();
+    //Bytes are stored in order of arrival, so first not yet arrived byte ends the search
+    while (rxVisible < rxTail && (long)(now - rxArrival[rxVisible]) >= 0){
+        ++rxVisible;
+    }
+}
+
+int HardwareSerial::available(){
+    updateVisible();
+    return (int)(rxVisible - rxHead);
+}
+
+int HardwareSerial::availableForWrite(){
+    return (int)(txCapacity - txLength);
+}
+
+int HardwareSerial::peek(){
+    if (rxHead == rxVisible){
+        updateVisible();
+        if (rxHead == rxVisible){
+            return -1;
+        }
+    }
+    return rxData[rxHead];
+}
+
+int HardwareSerial::read(){
+    int value = peek();
+    if (value != -1){
+        ++rxHead;
+        if (rxHead == rxTail){
+            rxHead = rxTail = rxVisible = 0;
+        }
+    }
+    return value;
+}
+
+size_t HardwareSerial::readBytes(char* buffer, size_t length){
+    size_t count = 0;
+    while (count < length){
+        int value = read();
+        if (value == -1){
+            break;
+        }
+        buffer[count++] = (char)value;
+    }
+    return count;
+}
+
+size_t HardwareSerial::write(uint8_t value){
+    return write(&value, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t length){
+    if (length > txCapacity - txLength){
+        length = txCapacity - txLength;
+    }
+    memcpy(txData + txLength, buffer, length);
+    txLength += length;
+    return length;
+}
+
+size_t HardwareSerial::injectRx(const uint8_t* data, size_t length, unsigned long arrival, unsigned long bytePeriod){
+    if (rxHead != 0 && rxCapacity - rxTail < length){
+        //Compact buffer
+        memmove(rxData, rxData + rxHead, rxTail - rxHead);
+        memmove(rxArrival, rxArrival + rxHead, (rxTail - rxHead) * sizeof(unsigned long));
+        rxTail -= rxHead;
+        rxVisible -= rxHead;
+        rxHead = 0;
+    }
+    if (length > rxCapacity - rxTail){
+        length = rxCapacity - rxTail;
+    }
+    if (arrival == 0){
+        arrival = micros();
+    }
+    for (size_t i = 0; i < length; ++i){
+        rxData[rxTail] = data[i];
+        rxArrival[rxTail] = arrival + i * bytePeriod;
+        ++rxTail;
+    }
+    return length;
+}
@@ -0,0 +1,142 @@
+#ifndef ARDUINO_HOST_SHIM_H
+#define ARDUINO_HOST_SHIM_H
+
+/*Minimal Arduino API shim used to build the library natively on Linux (benchmarks, tools).
+Only the parts used by the library are provided. Time can either follow the real monotonic
+clock or be driven manually (simulated), which allows to script exact byte arrival times.
+HardwareSerial is replaced with in-memory implementation: received bytes are injected by the
+host program (optionally with arrival timestamps) and transmitted bytes are collected in a buffer.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define LED_BUILTIN 13
+#define NUM_DIGITAL_PINS 64
+
+#define SERIAL_8N1 0x06
+#define SERIAL_8E1 0x26
+#define SERIAL_8O1 0x36
+
+#ifndef SERIAL_RX_BUFFER_SIZE
+    #define SERIAL_RX_BUFFER_SIZE 4096
+#endif
+#ifndef SERIAL_TX_BUFFER_SIZE
+    #define SERIAL_TX_BUFFER_SIZE 4096
+#endif
+
+unsigned long micros();
+unsigned long millis();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+void noInterrupts();
+void interrupts();
+
+namespace ArduinoShim {
+    /**
+     * @brief Switches between real monotonic clock (default) and manually driven clock
+     * @param enabled True to use simulated clock
+     */
+    void useSimulatedClock(bool enabled);
+
+    /**
+     * @brief Sets simulated clock to given time (in microseconds)
+     */
+    void setMicros(unsigned long timestamp);
+
+    /**
+     * @brief Advances simulated clock by given amount of microseconds
+     */
+    void advanceMicros(unsigned long delta);
+}
+
+class HardwareSerial {
+    private:
+    //Received bytes together with time (micros()) from which they are visible
+    uint8_t* rxData;
+    unsigned long* rxArrival;
+    size_t rxHead = 0;
+    size_t rxTail = 0;
+    size_t rxVisible = 0; //Bytes before this index are known to have arrived
+    size_t rxCapacity;
+
+    uint8_t* txData;
+    size_t txLength = 0;
+    size_t txCapacity;
+
+    unsigned long baudRate = 0;
+    bool started = false;
+
+    void updateVisible();
+
+    public:
+    HardwareSerial(size_t rxCapacity = SERIAL_RX_BUFFER_SIZE, size_t txCapacity = SERIAL_TX_BUFFER_SIZE);
+    ~HardwareSerial();
+    HardwareSerial(const HardwareSerial&) = delete;
+    HardwareSerial& operator=(const HardwareSerial&) = delete;
+
+    //Arduino API
+    void begin(unsigned long baud, uint8_t config = SERIAL_8N1);
+    void end();
+    int available();
+    int availableForWrite();
+    int peek();
+    int read();
+    size_t readBytes(char* buffer, size_t length);
+    size_t readBytes(uint8_t* buffer, size_t length){return readBytes((char*)buffer, length);}
+    size_t write(uint8_t value);
+    size_t write(const uint8_t* buffer, size_t length);
+    void flush(){}
+    operator bool(){return started;}
+
+    //Scripting API
+    /**
+     * @brief Injects bytes into receive buffer
+     *
+     * @param data Bytes to be received
+     * @param length Number of bytes
+     * @param arrival Time (micros()) when the first byte becomes available, 0 for immediately
+     * @param bytePeriod Delay between consecutive bytes in microseconds (0 for whole block at once)
+     * @return Number of bytes which fit into the receive buffer
+     */
+    size_t injectRx(const uint8_t* data, size_t length, unsigned long arrival = 0, unsigned long bytePeriod = 0);
+
+    /**
+     * @brief Number of bytes, which were injected but are not read yet (regardless of arrival time)
+     */
+    size_t pendingRx() const {return rxTail - rxHead;}
+
+    /**
+     * @brief Drops all injected bytes
+     */
+    void clearRx(){rxHead = rxTail = rxVisible = 0;}
+
+    /**
+     * @brief Transmitted data since last clearTx()
+     */
+    const uint8_t* txBuffer() const {return txData;}
+    size_t txSize() const {return txLength;}
+    void clearTx(){txLength = 0;}
+
+    unsigned long getBaudRate() const {return baudRate;}
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+
+#endif
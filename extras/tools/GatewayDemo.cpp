@@ -0,0 +1,332 @@
+/*End to end test of caching gateway. Simulated slave runs in its own thread on master side of pseudo-terminal
+(responses are delayed by time the request and response would take on the line), gateway serves Modbus TCP clients
+on localhost and forwards their requests to slave side of pseudo-terminal. Clients read the same input registers,
+which hold time of sampling (milliseconds), and write their holding register and read it back.
+Reports serial transactions per client request, age of data returned to clients and read after write mismatches.
+Finally one response of slave is corrupted, client must get exception 0x0B without waiting for response timeout,
+broadcast write must be confirmed after turnaround delay, and broadcast read and unit 0xFF must get exception 0x0A
+without serial transaction.
+Usage: gateway_demo [seconds] [clients] [max age ms]
+*/
+
+#include "ModbusGateway.h"
+#include "ModbusLinuxSerial.h"
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <thread>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define DEMO_SLAVE_ADDRESS 1
+#define DEMO_BAUD_RATE 19200UL
+#define DEMO_REGISTERS 16
+#define DEMO_SAMPLED 8 //Input registers holding time of sampling
+#define DEMO_WRITE_PERIOD 5 //Every n-th request of client is write followed by read back
+#define DEMO_AGE_MARGIN 100 //Milliseconds of line time allowed above max age
+#define DEMO_CLIENT_TIMEOUT 2 //Seconds
+#define DEMO_BROADCAST_VALUE 0x55AA //Written by broadcast to the last holding register
+
+static ModbusServer<DEMO_REGISTERS, DEMO_REGISTERS, MODBUS_FUNCTIONS_ALL> slave;
+static ModbusLinuxSerial slaveSerial;
+static ModbusLinuxSerial gatewaySerial;
+static ModbusTcpServer tcp;
+static ModbusGateway gateway;
+static std::atomic<bool> running(true); //Clients send requests
+static std::atomic<bool> slaveRunning(true);
+static std::atomic<uint8_t> finishedClients(0);
+static std::atomic<bool> corruptResponse(false); //Next FC6 response of slave is sent with invalid CRC
+static unsigned long charTime;
+
+typedef struct {
+    uint32_t requests;
+    uint32_t failures; //Timeouts and exceptions
+    uint32_t writes;
+    uint32_t mismatches; //Read back value differs from written value
+    uint16_t maxAge; //Milliseconds
+} DemoClient;
+
+/**
+ * @brief Write function of simulated slave, response is delayed by line time of request and response
+ */
+static void lineWrite(const char* buffer, uint16_t length, void* ctx){
+    usleep((length + MODBUS_REQUEST_BASE_LENGTH + CRC_LEN) * charTime);
+    char frame[MODBUS_MAX_FRAME_LEN];
+    memcpy(frame, buffer, length);
+    if (frame[1] == FC_WRITE_SINGLE_REGISTER && corruptResponse.exchange(false)){
+        frame[length - 1] ^= 0x01;
+    }
+    ModbusLinuxSerial::linuxSerialWriteFunction(frame, length, ctx);
+}
+
+static void serveSlave(){
+    while (slaveRunning.load(std::memory_order_relaxed)){
+        uint16_t sample[DEMO_SAMPLED];
+        for (uint16_t i = 0; i < DEMO_SAMPLED; ++i){
+            sample[i] = (uint16_t)millis();
+        }
+        slave.copyToInputRegisters(sample, DEMO_SAMPLED, 0);
+        slaveSerial.wait(1);
+        slave.communicationLoop();
+    }
+}
+
+/**
+ * @brief Sends Modbus TCP request and receives response (exception is left in response)
+ * @return Length of response PDU (with unit ID), 0 on error or exception
+ */
+static uint16_t transact(int fd, uint16_t transaction, const uint8_t* pdu, uint16_t length, uint8_t* response,
+    uint8_t unit = DEMO_SLAVE_ADDRESS){
+    uint8_t request[MBAP_HEADER_LEN + MODBUS_MAX_FRAME_LEN] = {(uint8_t)(transaction >> 8), (uint8_t)transaction, 0, 0,
+        (uint8_t)((length + 1) >> 8), (uint8_t)(length + 1), unit};
+    memcpy(request + MBAP_HEADER_LEN, pdu, length);
+    if (send(fd, request, MBAP_HEADER_LEN + length, MSG_NOSIGNAL) != MBAP_HEADER_LEN + length){
+        return 0;
+    }
+    uint16_t received = 0;
+    uint16_t expected = MBAP_HEADER_LEN - 1;
+    while (received < expected){
+        ssize_t count = recv(fd, response + received, expected - received, 0);
+        if (count <= 0){
+            return 0;
+        }
+        received += count;
+        if (received == MBAP_HEADER_LEN - 1){
+            expected += ((uint16_t)response[4] << 8) | response[5];
+        }
+    }
+    if (response[0] != request[0] || response[1] != request[1] || (response[MBAP_HEADER_LEN] & 0x80)){
+        return 0;
+    }
+    return received - (MBAP_HEADER_LEN - 1);
+}
+
+static int connectClient(uint16_t port){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in remote;
+    memset(&remote, 0, sizeof(remote));
+    remote.sin_family = AF_INET;
+    remote.sin_port = htons(port);
+    remote.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    struct timeval timeout = {DEMO_CLIENT_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    if (connect(fd, (struct sockaddr*)&remote, sizeof(remote)) != 0){
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void runClient(uint16_t port, uint8_t index, DemoClient* client){
+    int fd = connectClient(port);
+    if (fd < 0){
+        client->failures = 1;
+        ++finishedClients;
+        return;
+    }
+
+    uint8_t response[MBAP_HEADER_LEN + MODBUS_MAX_FRAME_LEN];
+    uint16_t transaction = 0;
+    while (running.load(std::memory_order_relaxed)){
+        ++transaction;
+        ++client->requests;
+        if (transaction % DEMO_WRITE_PERIOD == 0){
+            //Own holding register is written and read back (cached block of all registers must be invalidated)
+            uint8_t write[] = {FC_WRITE_SINGLE_REGISTER, 0, index, (uint8_t)(transaction >> 8), (uint8_t)transaction};
+            uint8_t read[] = {FC_READ_HOLDING_REGISTERS, 0, 0, 0, DEMO_REGISTERS};
+            ++client->writes;
+            ++client->requests;
+            if (transact(fd, transaction, write, sizeof(write), response) == 0 ||
+                transact(fd, transaction, read, sizeof(read), response) != 3 + DEMO_REGISTERS * 2){
+                ++client->failures;
+                continue;
+            }
+            const uint8_t* value = response + MBAP_HEADER_LEN + 2 + 2 * index;
+            client->mismatches += value[0] != write[3] || value[1] != write[4];
+            continue;
+        }
+        //Clients read overlapping ranges of sampled registers
+        uint8_t first = index % 2 ? 2 : 0;
+        uint8_t count = index % 2 ? 4 : DEMO_SAMPLED;
+        uint8_t read[] = {FC_READ_INPUT_REGISTERS, 0, first, 0, count};
+        if (transact(fd, transaction, read, sizeof(read), response) != 3 + count * 2){
+            ++client->failures;
+            continue;
+        }
+        uint16_t now = (uint16_t)millis();
+        for (uint8_t r = 0; r < count; ++r){
+            const uint8_t* value = response + MBAP_HEADER_LEN + 2 + 2 * r;
+            uint16_t age = now - (((uint16_t)value[0] << 8) | value[1]);
+            client->maxAge = age > client->maxAge ? age : client->maxAge;
+        }
+    }
+    close(fd);
+    ++finishedClients;
+}
+
+/**
+ * @brief Writes register while response of slave is corrupted
+ * @param answered Set if exception EX_GATEWAY_TARGET_FAILED was received
+ * @param elapsed Time until client got response (milliseconds)
+ */
+static void runCorruptedWrite(uint16_t port, bool* answered, unsigned long* elapsed){
+    int fd = connectClient(port);
+    uint8_t response[MBAP_HEADER_LEN + MODBUS_MAX_FRAME_LEN];
+    uint8_t write[] = {FC_WRITE_SINGLE_REGISTER, 0, 0, 0, 1};
+    unsigned long start = millis();
+    corruptResponse = true;
+    *answered = fd >= 0 && transact(fd, 1, write, sizeof(write), response) == 0 &&
+        response[MBAP_HEADER_LEN] == (FC_WRITE_SINGLE_REGISTER | 0x80) && response[MBAP_HEADER_LEN + 1] == EX_GATEWAY_TARGET_FAILED;
+    *elapsed = millis() - start;
+    if (fd >= 0){
+        close(fd);
+    }
+    ++finishedClients;
+}
+
+/**
+ * @brief Sends requests to broadcast unit 0 and unit 0xFF
+ * @param valid Set if broadcast write was confirmed after turnaround delay and the other requests got
+ * exception EX_GATEWAY_PATH_UNAVAILABLE within response timeout
+ * @param elapsed Time until broadcast write was confirmed (milliseconds)
+ */
+static void runUnitChecks(uint16_t port, bool* valid, unsigned long* elapsed){
+    int fd = connectClient(port);
+    uint8_t response[MBAP_HEADER_LEN + MODBUS_MAX_FRAME_LEN];
+    uint8_t write[] = {FC_WRITE_SINGLE_REGISTER, 0, DEMO_REGISTERS - 1, DEMO_BROADCAST_VALUE >> 8, DEMO_BROADCAST_VALUE & 0xFF};
+    uint8_t read[] = {FC_READ_HOLDING_REGISTERS, 0, 0, 0, 1};
+    unsigned long start = millis();
+    *valid = fd >= 0 && transact(fd, 1, write, sizeof(write), response, MODBUS_BROADCAST_ADDRESS) == sizeof(write) + 1 &&
+        memcmp(response + MBAP_HEADER_LEN, write, sizeof(write)) == 0;
+    *elapsed = millis() - start;
+    *valid = *valid && *elapsed >= MODBUS_GATEWAY_TURNAROUND_DELAY;
+    const uint8_t units[] = {MODBUS_BROADCAST_ADDRESS, MODBUS_TCP_DEVICE_UNIT};
+    for (uint8_t i = 0; i < sizeof(units) && *valid; ++i){
+        start = millis();
+        *valid = transact(fd, 2 + i, read, sizeof(read), response, units[i]) == 0 &&
+            response[MBAP_HEADER_LEN] == (FC_READ_HOLDING_REGISTERS | 0x80) &&
+            response[MBAP_HEADER_LEN + 1] == EX_GATEWAY_PATH_UNAVAILABLE &&
+            millis() - start < MODBUS_GATEWAY_RESPONSE_TIMEOUT;
+    }
+    if (fd >= 0){
+        close(fd);
+    }
+    ++finishedClients;
+}
+
+int main(int argc, char** argv){
+    unsigned long seconds = argc > 1 ? strtoul(argv[1], NULL, 10) : 3;
+    uint8_t clientCount = argc > 2 ? (uint8_t)strtoul(argv[2], NULL, 10) : 8;
+    unsigned long maxAge = argc > 3 ? strtoul(argv[3], NULL, 10) : 500;
+    clientCount = clientCount > DEMO_REGISTERS ? DEMO_REGISTERS : clientCount;
+    charTime = MODBUS_CHAR_BITS * 1000000UL / DEMO_BAUD_RATE;
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0){
+        perror("posix_openpt");
+        return 1;
+    }
+    const char* device = ptsname(master);
+    //Both sides configure the same pseudo-terminal, which does not keep parity
+    if (!gatewaySerial.begin(device, DEMO_BAUD_RATE, MODBUS_PARITY_NONE) ||
+        !slaveSerial.begin(master, DEMO_BAUD_RATE, MODBUS_PARITY_NONE)){
+        perror(device);
+        return 1;
+    }
+    slaveSerial.attach(slave);
+    slave.setSerialWriteFunction(lineWrite, &slaveSerial);
+    slave.startModbusServer(DEMO_SLAVE_ADDRESS, 0);
+
+    gatewaySerial.setFrameLengthFunction(modbusResponseLength);
+    gatewaySerial.attach(gateway);
+    if (!tcp.begin(0, MODBUS_TCP, "127.0.0.1")){
+        perror("listen");
+        return 1;
+    }
+    gateway.setMaxAge(maxAge);
+    gateway.startModbusGateway(&tcp, DEMO_BAUD_RATE);
+
+    std::thread slaveThread(serveSlave);
+    DemoClient clients[DEMO_REGISTERS];
+    std::thread clientThreads[DEMO_REGISTERS];
+    memset(clients, 0, sizeof(clients));
+    for (uint8_t i = 0; i < clientCount; ++i){
+        clientThreads[i] = std::thread(runClient, tcp.getPort(), i, &clients[i]);
+    }
+    unsigned long start = millis();
+    while (millis() - start < seconds * 1000UL){
+        tcp.wait(1);
+        gateway.communicationLoop();
+    }
+    running = false;
+    //Clients finish their last request
+    while (finishedClients.load() < clientCount){
+        tcp.wait(1);
+        gateway.communicationLoop();
+    }
+    for (uint8_t i = 0; i < clientCount; ++i){
+        clientThreads[i].join();
+    }
+    const ModbusGatewayStats* stats = gateway.getStats();
+    uint32_t timeouts = stats->timeouts;
+    bool corruptedAnswered = false;
+    unsigned long corruptedElapsed = 0;
+    std::thread corruptedThread(runCorruptedWrite, tcp.getPort(), &corruptedAnswered, &corruptedElapsed);
+    while (finishedClients.load() < clientCount + 1){
+        tcp.wait(1);
+        gateway.communicationLoop();
+    }
+    corruptedThread.join();
+    //Corrupted response is not a timeout
+    bool corruptedValid = corruptedAnswered && corruptedElapsed < MODBUS_GATEWAY_RESPONSE_TIMEOUT &&
+        stats->crcErrors == 1 && stats->timeouts == timeouts;
+
+    uint32_t rejected = stats->rejected;
+    bool unitsValid = false;
+    unsigned long broadcastElapsed = 0;
+    std::thread unitThread(runUnitChecks, tcp.getPort(), &unitsValid, &broadcastElapsed);
+    while (finishedClients.load() < clientCount + 2){
+        tcp.wait(1);
+        gateway.communicationLoop();
+    }
+    unitThread.join();
+    slaveRunning = false;
+    slaveThread.join();
+    //Broadcast read and unit 0xFF are rejected by gateway, broadcast write is executed by slave
+    uint16_t broadcastValue = 0;
+    slave.copyFromHoldingRegisters(&broadcastValue, 1, DEMO_REGISTERS - 1);
+    unitsValid = unitsValid && stats->rejected == rejected + 2 && broadcastValue == DEMO_BROADCAST_VALUE;
+
+    DemoClient total;
+    memset(&total, 0, sizeof(total));
+    for (uint8_t i = 0; i < clientCount; ++i){
+        total.requests += clients[i].requests;
+        total.failures += clients[i].failures;
+        total.writes += clients[i].writes;
+        total.mismatches += clients[i].mismatches;
+        total.maxAge = clients[i].maxAge > total.maxAge ? clients[i].maxAge : total.maxAge;
+    }
+    printf("%u clients for %lu s over %s at %lu baud, max age %lu ms\n", clientCount, seconds, device, DEMO_BAUD_RATE, maxAge);
+    printf("%u client requests (%.0f/s), %u serial transactions (%u background polls), %.2f transactions per request\n",
+        total.requests, total.requests / (double)seconds, stats->transactions, stats->polls,
+        total.requests ? stats->transactions / (double)total.requests : 0.0);
+    printf("gateway: %u cache hits, %u coalesced reads, %u timeouts, %u CRC errors, %u rejected\n", stats->cacheHits,
+        stats->coalesced, stats->timeouts, stats->crcErrors, stats->rejected);
+    printf("oldest data returned: %u ms, %u failed requests, %u of %u writes not read back\n", total.maxAge,
+        total.failures, total.mismatches, total.writes);
+    printf("corrupted response: %s after %lu ms\n", corruptedAnswered ? "exception 0x0B" : "no exception", corruptedElapsed);
+    printf("broadcast write confirmed after %lu ms, unit 0 read and unit 0xFF: %s\n", broadcastElapsed,
+        unitsValid ? "exception 0x0A" : "failed");
+    slaveSerial.end();
+    gatewaySerial.end();
+    tcp.end();
+    return total.failures == 0 && total.mismatches == 0 && total.maxAge <= maxAge + DEMO_AGE_MARGIN && corruptedValid &&
+        unitsValid ? 0 : 1;
+}
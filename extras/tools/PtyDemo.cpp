@@ -0,0 +1,194 @@
+/*End to end test of Linux serial backend. Server runs in its own thread on slave side of pseudo-terminal,
+client writes requests to master side and checks responses (written registers are read back, frame
+broken by silence longer than t1.5 must not be answered, frame delivered in chunks with short silence
+between them must be answered). Reports round trip time and diagnostics of server.
+With device given, server is run on real tty instead (until interrupted).
+Usage: pty_demo [requests]
+       pty_demo <device> [baud rate] [address]
+*/
+
+#include "ModbusLinuxSerial.h"
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+#define DEMO_SLAVE_ADDRESS 1
+#define DEMO_BAUD_RATE 19200UL
+#define DEMO_REGISTERS 10
+#define DEMO_RESPONSE_TIMEOUT 500 //Milliseconds
+
+static ModbusServer<0, 64, MODBUS_FUNCTIONS_ALL | MODBUS_FUNCTIONS_DIAGNOSTICS, MODBUS_DIAGNOSTICS> server;
+static ModbusLinuxSerial serial;
+static std::atomic<bool> running(true);
+
+static uint64_t nowNs(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static void serve(){
+    while (running.load(std::memory_order_relaxed)){
+        serial.wait(50);
+        server.communicationLoop();
+    }
+}
+
+static uint16_t appendCRC(uint8_t* frame, uint16_t length){
+    uint16_t crc = modbusCRC16(frame, length);
+    frame[length++] = crc & 0xff;
+    frame[length++] = crc >> 8;
+    return length;
+}
+
+/**
+ * @brief Receives response on master side of pseudo-terminal
+ * @return Length of response, 0 on timeout or invalid response
+ */
+static uint16_t receiveResponse(int fd, uint8_t* response, int timeout){
+    uint16_t received = 0;
+    uint16_t expected = 0;
+    struct pollfd input = {fd, POLLIN, 0};
+    while (expected == 0 || received < expected){
+        if (poll(&input, 1, timeout) <= 0){
+            return 0;
+        }
+        ssize_t count = read(fd, response + received, MODBUS_MAX_FRAME_LEN - received);
+        if (count <= 0){
+            return 0;
+        }
+        received += count;
+        expected = modbusResponseLength(response, received);
+    }
+    return received == expected && modbusCRC16(response, received) == 0 ? received : 0;
+}
+
+/**
+ * @brief Sends request and receives response on master side of pseudo-terminal
+ * @return Length of response, 0 on timeout or invalid response
+ */
+static uint16_t transact(int fd, const uint8_t* request, uint16_t length, uint8_t* response, int timeout){
+    if (write(fd, request, length) != length){
+        return 0;
+    }
+    return receiveResponse(fd, response, timeout);
+}
+
+static int runSelfTest(uint32_t requests){
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0){
+        perror("posix_openpt");
+        return 1;
+    }
+    const char* slave = ptsname(master);
+    if (!serial.begin(slave, DEMO_BAUD_RATE)){
+        perror(slave);
+        return 1;
+    }
+    serial.attach(server);
+    server.startModbusServer(DEMO_SLAVE_ADDRESS, 0);
+    std::thread serverThread(serve);
+
+    uint8_t request[MODBUS_MAX_FRAME_LEN];
+    uint8_t response[MODBUS_MAX_FRAME_LEN];
+    uint64_t worst = 0;
+    uint64_t total = 0;
+    uint32_t failures = 0;
+    for (uint32_t i = 0; i < requests; ++i){
+        //Write block of registers
+        uint16_t length = 0;
+        request[length++] = DEMO_SLAVE_ADDRESS;
+        request[length++] = FC_WRITE_MULTIPLE_REGISTERS;
+        request[length++] = 0;
+        request[length++] = 0;
+        request[length++] = 0;
+        request[length++] = DEMO_REGISTERS;
+        request[length++] = DEMO_REGISTERS * 2;
+        for (uint16_t r = 0; r < DEMO_REGISTERS; ++r){
+            request[length++] = (uint8_t)(i >> 8);
+            request[length++] = (uint8_t)(i + r);
+        }
+        length = appendCRC(request, length);
+        uint64_t start = nowNs();
+        bool valid = transact(master, request, length, response, DEMO_RESPONSE_TIMEOUT) == MODBUS_REQUEST_BASE_LENGTH + CRC_LEN;
+
+        //Read it back
+        uint8_t readRequest[] = {DEMO_SLAVE_ADDRESS, FC_READ_HOLDING_REGISTERS, 0, 0, 0, DEMO_REGISTERS, 0, 0};
+        length = appendCRC(readRequest, MODBUS_REQUEST_BASE_LENGTH);
+        valid = valid && transact(master, readRequest, length, response, DEMO_RESPONSE_TIMEOUT) ==
+            MODBUS_RESPONSE_BASE_LEN + DEMO_REGISTERS * 2 + CRC_LEN;
+        for (uint16_t r = 0; valid && r < DEMO_REGISTERS; ++r){
+            valid = response[MODBUS_RESPONSE_BASE_LEN + 2 * r] == (uint8_t)(i >> 8) &&
+                response[MODBUS_RESPONSE_BASE_LEN + 2 * r + 1] == (uint8_t)(i + r);
+        }
+        uint64_t elapsed = (nowNs() - start) / 2;
+        total += elapsed;
+        worst = elapsed > worst ? elapsed : worst;
+        failures += !valid;
+    }
+
+    //Frame with silence longer than t1.5 (but shorter than t3.5) inside must be ignored
+    uint8_t broken[] = {DEMO_SLAVE_ADDRESS, FC_READ_HOLDING_REGISTERS, 0, 0, 0, 1, 0, 0};
+    appendCRC(broken, MODBUS_REQUEST_BASE_LENGTH);
+    bool ignored = write(master, broken, 4) == 4;
+    usleep(1200);
+    //Byte after the gap is delivered alone (gap before multi-byte chunk may be its transmission time)
+    ignored = ignored && write(master, broken + 4, 1) == 1;
+    usleep(100);
+    ignored = ignored && transact(master, broken + 5, 3, response, 100) == 0;
+    usleep(10000);
+
+    //Frame delivered in chunks (as by UART FIFO or USB adapter) with one character of silence between them
+    //must be answered, transmission time of chunk is not silence
+    uint8_t chunked[] = {DEMO_SLAVE_ADDRESS, FC_READ_HOLDING_REGISTERS, 0, 0, 0, 1, 0, 0};
+    appendCRC(chunked, MODBUS_REQUEST_BASE_LENGTH);
+    unsigned long charTime = MODBUS_CHAR_BITS * 1000000UL / DEMO_BAUD_RATE;
+    bool chunkedAnswered = true;
+    for (uint16_t i = 0; i < sizeof(chunked); i += 2){
+        if (i > 0){
+            usleep(3 * charTime);
+        }
+        chunkedAnswered = chunkedAnswered && write(master, chunked + i, 2) == 2;
+    }
+    chunkedAnswered = chunkedAnswered && receiveResponse(master, response, DEMO_RESPONSE_TIMEOUT) ==
+        MODBUS_RESPONSE_BASE_LEN + 2 + CRC_LEN;
+
+    running = false;
+    serverThread.join();
+    ModbusDiagnostics diagnostics;
+    server.getDiagnostics(&diagnostics);
+    const SerialCtx* link = serial.getSerialCtx();
+    printf("%u transactions over %s, round trip %.1f us (worst %.1f us), %u failed\n", requests * 2, slave,
+        total / 1000.0 / requests, worst / 1000.0, failures);
+    printf("server: %u requests, %u exceptions, %u CRC errors, %u discarded frames\n", diagnostics.serverMessages,
+        diagnostics.busExceptionErrors, link->crcErrors, link->discardedFrames);
+    printf("frame with gap %s\n", ignored ? "ignored" : "answered");
+    printf("frame in chunks %s\n", chunkedAnswered ? "answered" : "ignored");
+    serial.end();
+    close(master);
+    return failures == 0 && ignored && chunkedAnswered ? 0 : 1;
+}
+
+int main(int argc, char** argv){
+    if (argc > 1 && argv[1][0] == '/'){
+        unsigned long baudRate = argc > 2 ? strtoul(argv[2], NULL, 10) : DEMO_BAUD_RATE;
+        uint8_t address = argc > 3 ? (uint8_t)strtoul(argv[3], NULL, 10) : DEMO_SLAVE_ADDRESS;
+        if (!serial.begin(argv[1], baudRate)){
+            perror(argv[1]);
+            return 1;
+        }
+        serial.attach(server);
+        server.startModbusServer(address, 0);
+        printf("serving unit %u on %s at %lu baud\n", address, argv[1], baudRate);
+        while (true){
+            serial.wait(-1);
+            server.communicationLoop();
+        }
+    }
+    return runSelfTest(argc > 1 ? strtoul(argv[1], NULL, 10) : 1000);
+}
@@ -0,0 +1,528 @@
+/*Replay of captured traffic (ModbusCapture log) for load and regression testing. Received bytes are injected
+into ModbusRTU on simulated clock at their captured times, responses of server are compared with captured
+responses. Idle time between frames may be shortened (speed), time inside frames is kept, so frame boundaries
+(t1.5, t3.5) are reproduced. Registers read by captured FC3/FC4 requests are loaded from captured responses
+before the request is injected, so values changed by application of the device do not count as divergence.
+Comparison starts at the first frame preceded by t3.5 silence (capture from ring may start inside frame).
+Reports time spent in communicationLoop() per answered request and divergent responses.
+Usage: modbus_replay <capture> [-s speed] [-a address] [-i input count] [-r holding count] [-n] [-v]
+         -s  idle time between frames is divided by speed, 0 sends frames back to back (default 1)
+         -a  server address (default: address of the first captured response)
+         -i, -r  number of input and holding registers of server (default INPUT_REGISTER_NUM, HOLDING_REGISTER_NUM)
+         -n  registers are not loaded from captured responses
+         -v  prints every divergent response (default first 10)
+       modbus_replay -g <capture> [frames] [baud rate]
+         writes capture of synthetic traffic (ModbusRTU at address 1, requests for address 2 answered by other device)
+*/
+
+#include "ModbusCapture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define REPLAY_DEFAULT_DIVERGENCES 10
+#define REPLAY_GENERATE_ADDRESS 1
+#define REPLAY_FOREIGN_ADDRESS 2
+
+typedef struct {
+    bool tx;
+    uint32_t delta; //Microseconds since previous event
+    uint32_t offset; //Bytes in capture
+    uint8_t length;
+} ReplayEvent;
+
+//Registers read by request, loaded from captured response before the request is injected
+typedef struct {
+    uint32_t event; //Index of the last received event of request
+    uint8_t functionCode;
+    uint16_t first;
+    uint16_t count;
+    const uint8_t* values; //Big endian values in captured response
+} ReplaySync;
+
+//Register bank of runtime size
+typedef struct {
+    uint16_t* values;
+    uint32_t count;
+} ReplayMap;
+
+static ModbusRTU server;
+
+static uint16_t* resolveReplayMap(uint16_t first, uint16_t count, void* ctx){
+    ReplayMap* map = (ReplayMap*)ctx;
+    return (uint32_t)first + count <= map->count ? map->values + first : NULL;
+}
+
+static uint64_t nowNs(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static void printHex(const char* label, const uint8_t* data, size_t length){
+    printf("    %-9s", label);
+    for (size_t i = 0; i < length; ++i){
+        printf(" %02x", data[i]);
+    }
+    printf(length == 0 ? " (none)\n" : "\n");
+}
+
+static uint8_t* readFile(const char* path, size_t* length){
+    FILE* file = fopen(path, "rb");
+    if (file == NULL){
+        return NULL;
+    }
+    size_t capacity = 65536;
+    uint8_t* data = (uint8_t*)malloc(capacity);
+    *length = 0;
+    size_t count;
+    while ((count = fread(data + *length, 1, capacity - *length, file)) > 0){
+        *length += count;
+        if (*length == capacity){
+            capacity *= 2;
+            data = (uint8_t*)realloc(data, capacity);
+        }
+    }
+    fclose(file);
+    return data;
+}
+
+/**
+ * @brief Splits capture into events
+ * @return Number of events, -1 if capture is damaged
+ */
+static int64_t parseEvents(const uint8_t* data, size_t length, ReplayEvent** events){
+    size_t capacity = 1024;
+    size_t count = 0;
+    *events = (ReplayEvent*)malloc(capacity * sizeof(ReplayEvent));
+    size_t position = MODBUS_CAPTURE_HEADER_LEN;
+    while (position < length){
+        ReplayEvent event;
+        uint8_t tag = data[position++];
+        event.tx = (tag & MODBUS_CAPTURE_TX) != 0;
+        event.length = (tag & 0x7F) + 1;
+        event.delta = 0;
+        for (uint8_t shift = 0; ; shift += 7){
+            if (position >= length || shift >= 7 * MODBUS_CAPTURE_MAX_TIME_LEN){
+                return -1;
+            }
+            uint8_t value = data[position++];
+            event.delta |= (uint32_t)(value & 0x7F) << shift;
+            if (!(value & 0x80)){
+                break;
+            }
+        }
+        if (position + event.length > length){
+            return -1;
+        }
+        event.offset = position;
+        position += event.length;
+        if (count == capacity){
+            capacity *= 2;
+            *events = (ReplayEvent*)realloc(*events, capacity * sizeof(ReplayEvent));
+        }
+        (*events)[count++] = event;
+    }
+    return count;
+}
+
+/**
+ * @brief Pairs captured read requests of server with their responses (original timing)
+ * @return Number of syncs
+ */
+static size_t findSyncs(const uint8_t* data, const ReplayEvent* events, size_t eventCount, uint8_t address,
+    unsigned long interFrameTimeout, ReplaySync* syncs){
+    uint8_t request[MODBUS_MAX_FRAME_LEN];
+    uint16_t requestLength = 0;
+    uint32_t lastRx = 0;
+    uint64_t time = 0;
+    uint64_t lastRxTime = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < eventCount; ++i){
+        const ReplayEvent* event = &events[i];
+        const uint8_t* bytes = data + event->offset;
+        time += event->delta;
+        if (!event->tx){
+            if (time - lastRxTime >= interFrameTimeout){
+                requestLength = 0;
+            }
+            for (uint8_t j = 0; j < event->length && requestLength < sizeof(request); ++j){
+                request[requestLength++] = bytes[j];
+            }
+            lastRx = i;
+            lastRxTime = time;
+            continue;
+        }
+        if (requestLength == MODBUS_REQUEST_BASE_LENGTH + CRC_LEN && request[0] == address &&
+            (request[1] == FC_READ_HOLDING_REGISTERS || request[1] == FC_READ_INPUT_REGISTERS) &&
+            modbusCRC16(request, requestLength) == 0 && event->length >= MODBUS_RESPONSE_BASE_LEN + CRC_LEN &&
+            bytes[0] == address && bytes[1] == request[1] && modbusCRC16(bytes, event->length) == 0){
+            uint16_t registerCount = ((uint16_t)request[4] << 8) | request[5];
+            if (bytes[2] == registerCount * 2 && event->length == MODBUS_RESPONSE_BASE_LEN + registerCount * 2 + CRC_LEN){
+                syncs[count].event = lastRx;
+                syncs[count].functionCode = request[1];
+                syncs[count].first = ((uint16_t)request[2] << 8) | request[3];
+                syncs[count].count = registerCount;
+                syncs[count].values = bytes + MODBUS_RESPONSE_BASE_LEN;
+                ++count;
+            }
+        }
+        requestLength = 0;
+    }
+    return count;
+}
+
+static void loadRegisters(const ReplaySync* sync){
+    uint16_t values[MAX_READ_REGISTER_COUNT];
+    for (uint16_t i = 0; i < sync->count && i < MAX_READ_REGISTER_COUNT; ++i){
+        values[i] = ((uint16_t)sync->values[2 * i] << 8) | sync->values[2 * i + 1];
+    }
+    if (sync->functionCode == FC_READ_INPUT_REGISTERS){
+        server.copyToInputRegisters(values, sync->count, sync->first);
+    }
+    else {
+        server.copyToHoldingRegisters(values, sync->count, sync->first);
+    }
+}
+
+typedef struct {
+    uint64_t loopNs;
+    uint32_t matched;
+    uint32_t different;
+    uint32_t missing;
+    uint32_t unexpected;
+    uint32_t printed;
+    uint32_t printLimit;
+    bool comparing;
+} ReplayResult;
+
+/**
+ * @brief Compares responses of server with captured responses since the last comparison
+ */
+static void compareResponses(ReplayResult* result, const uint8_t* expected, uint16_t expectedLength, unsigned long time){
+    const uint8_t* produced = Serial.txBuffer();
+    size_t producedLength = Serial.txSize();
+    if (expectedLength == 0 && producedLength == 0){
+        return;
+    }
+    if (!result->comparing){
+        Serial.clearTx();
+        return;
+    }
+    const char* kind = NULL;
+    if (expectedLength == producedLength && memcmp(expected, produced, producedLength) == 0){
+        ++result->matched;
+    }
+    else if (producedLength == 0){
+        ++result->missing;
+        kind = "missing";
+    }
+    else if (expectedLength == 0){
+        ++result->unexpected;
+        kind = "unexpected";
+    }
+    else {
+        ++result->different;
+        kind = "different";
+    }
+    if (kind != NULL && result->printed < result->printLimit){
+        ++result->printed;
+        printf("  %s response at %.3f ms\n", kind, time / 1000.0);
+        printHex("captured", expected, expectedLength);
+        printHex("replayed", produced, producedLength);
+    }
+    Serial.clearTx();
+}
+
+static int replay(const char* path, double speed, int address, int32_t inputCount, int32_t holdingCount, bool sync,
+    uint32_t printLimit){
+    size_t length;
+    uint8_t* data = readFile(path, &length);
+    if (data == NULL){
+        perror(path);
+        return 2;
+    }
+    if (length < MODBUS_CAPTURE_HEADER_LEN || memcmp(data, MODBUS_CAPTURE_MAGIC, 4) != 0 || data[4] != MODBUS_CAPTURE_VERSION){
+        printf("%s is not capture (version %u)\n", path, MODBUS_CAPTURE_VERSION);
+        return 2;
+    }
+    unsigned long baudRate = data[5] | ((unsigned long)data[6] << 8) | ((unsigned long)data[7] << 16) | ((unsigned long)data[8] << 24);
+    ReplayEvent* events;
+    int64_t eventCount = parseEvents(data, length, &events);
+    if (eventCount < 0){
+        printf("Capture is damaged\n");
+        return 2;
+    }
+    if (address < 0){
+        for (int64_t i = 0; i < eventCount && address < 0; ++i){
+            if (events[i].tx){
+                address = data[events[i].offset];
+            }
+        }
+        address = address < 0 ? 1 : address;
+    }
+
+    SerialCtx timing;
+    initSerialCtx(&timing, NULL, baudRate);
+    unsigned long charTime = timing.charTime > 0 ? timing.charTime : 1;
+    unsigned long minimumIdle = timing.interFrameTimeout + charTime;
+    //Server keeps polling this long after received bytes, then the clock jumps to the next event
+    unsigned long settle = timing.interFrameTimeout + MODBUS_MAX_FRAME_LEN * charTime;
+    unsigned long step = charTime / 2 > 0 ? charTime / 2 : 1;
+
+    ReplayMap inputMap = {NULL, 0};
+    ReplayMap holdingMap = {NULL, 0};
+    if (inputCount >= 0){
+        inputMap.count = inputCount;
+        inputMap.values = (uint16_t*)calloc(inputCount + 1, sizeof(uint16_t));
+        server.setInputRegisterMap(resolveReplayMap, &inputMap);
+    }
+    if (holdingCount >= 0){
+        holdingMap.count = holdingCount;
+        holdingMap.values = (uint16_t*)calloc(holdingCount + 1, sizeof(uint16_t));
+        server.setHoldingRegisterMap(resolveReplayMap, &holdingMap);
+    }
+    ReplaySync* syncs = (ReplaySync*)malloc((eventCount + 1) * sizeof(ReplaySync));
+    size_t syncCount = sync ? findSyncs(data, events, eventCount, address, timing.interFrameTimeout, syncs) : 0;
+
+    ArduinoShim::useSimulatedClock(true);
+    unsigned long start = 1000000UL;
+    ArduinoShim::setMicros(start);
+    server.startModbusServer(address, baudRate);
+
+    ReplayResult result = {0, 0, 0, 0, 0, 0, printLimit, false};
+    uint8_t expected[4 * MODBUS_MAX_FRAME_LEN];
+    uint16_t expectedLength = 0;
+    uint64_t capturedTime = 0;
+    unsigned long now = start;
+    unsigned long target = start;
+    unsigned long lastRx = start;
+    uint64_t rxBytes = 0;
+    uint32_t requests = 0;
+    size_t nextSync = 0;
+    uint64_t wallStart = nowNs();
+    for (int64_t i = 0; i <= eventCount; ++i){
+        const ReplayEvent* event = i < eventCount ? &events[i] : NULL;
+        unsigned long delta = event != NULL ? event->delta : settle;
+        capturedTime += delta;
+        if (delta >= timing.interFrameTimeout){
+            //Idle time between frames is shortened, but never below t3.5
+            unsigned long idle = speed > 0 ? (unsigned long)(delta / speed) : 0;
+            delta = idle > minimumIdle ? idle : minimumIdle;
+        }
+        target += delta;
+
+        //Server runs until the event
+        while ((long)(target - now) > 0){
+            uint64_t loopStart = nowNs();
+            server.communicationLoop();
+            result.loopNs += nowNs() - loopStart;
+            unsigned long advance = now - lastRx < settle ? step : target - now;
+            advance = advance < target - now ? advance : target - now;
+            ArduinoShim::advanceMicros(advance);
+            now += advance;
+        }
+        if (event == NULL){
+            server.communicationLoop();
+            compareResponses(&result, expected, expectedLength, now - start);
+            break;
+        }
+        const uint8_t* bytes = data + event->offset;
+        if (event->tx){
+            if (expectedLength + event->length <= sizeof(expected)){
+                memcpy(expected + expectedLength, bytes, event->length);
+                expectedLength += event->length;
+            }
+            ++requests;
+            continue;
+        }
+        compareResponses(&result, expected, expectedLength, now - start);
+        expectedLength = 0;
+        if (event->delta >= timing.interFrameTimeout){
+            result.comparing = true;
+        }
+        while (nextSync < syncCount && syncs[nextSync].event < i){
+            ++nextSync;
+        }
+        while (nextSync < syncCount && syncs[nextSync].event == i){
+            loadRegisters(&syncs[nextSync++]);
+        }
+        Serial.injectRx(bytes, event->length, now, 0);
+        rxBytes += event->length;
+        lastRx = now;
+    }
+    uint64_t wallNs = nowNs() - wallStart;
+
+    uint32_t divergent = result.different + result.missing + result.unexpected;
+    printf("%s: %lld events, %llu bytes received, %u responses captured, %lu baud, server address %d\n", path,
+        (long long)eventCount, (unsigned long long)rxBytes, requests, baudRate, address);
+    printf("Replay at speed %g: %.3f s simulated (%.3f s captured), %.0f responses/s on the bus\n", speed,
+        (now - start) / 1e6, capturedTime / 1e6, requests * 1e6 / (double)(now - start));
+    printf("communicationLoop(): %.3f ms in total, %.1f us per captured response (replay took %.3f s)\n",
+        result.loopNs / 1e6, requests ? result.loopNs / 1000.0 / requests : 0.0, wallNs / 1e9);
+    printf("Responses: %u equal, %u different, %u missing, %u unexpected (%zu register loads)\n",
+        result.matched, result.different, result.missing, result.unexpected, syncCount);
+    free(syncs);
+    free(events);
+    free(data);
+    free(inputMap.values);
+    free(holdingMap.values);
+    return divergent == 0 ? 0 : 1;
+}
+
+static uint32_t replayRandom(){
+    static uint32_t state = 2463534242UL;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+/**
+ * @brief Runs server until given time
+ */
+static void runUntil(unsigned long* now, unsigned long target, unsigned long step){
+    while ((long)(target - *now) > 0){
+        server.communicationLoop();
+        unsigned long advance = step < target - *now ? step : target - *now;
+        ArduinoShim::advanceMicros(advance);
+        *now += advance;
+    }
+}
+
+static uint16_t buildFrame(uint8_t* frame, uint8_t address, uint8_t functionCode, uint16_t first, uint16_t second){
+    frame[0] = address;
+    frame[1] = functionCode;
+    frame[2] = first >> 8;
+    frame[3] = first & 0xff;
+    frame[4] = second >> 8;
+    frame[5] = second & 0xff;
+    put_16bit_into_byte_buffer(frame, 6, modbusCRC16(frame, 6));
+    return 8;
+}
+
+static int generate(const char* path, uint32_t frames, unsigned long baudRate){
+    FILE* file = fopen(path, "wb");
+    if (file == NULL){
+        perror(path);
+        return 2;
+    }
+    SerialCtx timing;
+    initSerialCtx(&timing, NULL, baudRate);
+    unsigned long step = timing.charTime / 2 > 0 ? timing.charTime / 2 : 1;
+    ArduinoShim::useSimulatedClock(true);
+    unsigned long now = 1000000UL;
+    ArduinoShim::setMicros(now);
+    server.startModbusServer(REPLAY_GENERATE_ADDRESS, baudRate);
+
+    ModbusCapture capture;
+    capture.begin(baudRate, modbusCaptureFileWrite, file);
+    capture.attach(server);
+    uint8_t frame[MODBUS_MAX_FRAME_LEN];
+    for (uint32_t i = 0; i < frames; ++i){
+        //Application of device changes measurements
+        uint16_t value = replayRandom();
+        server.copyToInputRegisters(&value, 1, replayRandom() % INPUT_REGISTER_NUM);
+
+        uint8_t address = replayRandom() % 5 == 0 ? REPLAY_FOREIGN_ADDRESS : REPLAY_GENERATE_ADDRESS;
+        uint16_t first = replayRandom() % 90;
+        uint16_t count = 1 + replayRandom() % 10;
+        uint16_t length;
+        switch (replayRandom() % 4){
+            case 0:
+                length = buildFrame(frame, address, FC_READ_HOLDING_REGISTERS, first, count);
+                break;
+            case 1:
+                length = buildFrame(frame, address, FC_READ_INPUT_REGISTERS, first, count);
+                break;
+            case 2:
+                length = buildFrame(frame, address, FC_WRITE_SINGLE_REGISTER, first, replayRandom());
+                break;
+            default:
+                frame[0] = address;
+                frame[1] = FC_WRITE_MULTIPLE_REGISTERS;
+                frame[2] = first >> 8;
+                frame[3] = first & 0xff;
+                frame[4] = 0;
+                frame[5] = count;
+                frame[6] = count * 2;
+                for (uint16_t j = 0; j < count * 2; ++j){
+                    frame[7 + j] = replayRandom();
+                }
+                length = 7 + count * 2;
+                put_16bit_into_byte_buffer(frame, length, modbusCRC16(frame, length));
+                length += CRC_LEN;
+                break;
+        }
+        //Bytes of request arrive one character apart, response of other device follows its request
+        Serial.injectRx(frame, length, now, timing.charTime);
+        unsigned long end = now + length * timing.charTime + timing.interFrameTimeout + MODBUS_MAX_FRAME_LEN * timing.charTime;
+        if (address == REPLAY_FOREIGN_ADDRESS){
+            uint16_t responseLength = frame[1] <= FC_READ_INPUT_REGISTERS ? MODBUS_RESPONSE_BASE_LEN + count * 2 : 6;
+            if (frame[1] <= FC_READ_INPUT_REGISTERS){
+                frame[2] = count * 2;
+                for (uint16_t j = 0; j < count * 2; ++j){
+                    frame[MODBUS_RESPONSE_BASE_LEN + j] = replayRandom();
+                }
+            }
+            put_16bit_into_byte_buffer(frame, responseLength, modbusCRC16(frame, responseLength));
+            Serial.injectRx(frame, responseLength + CRC_LEN, now + length * timing.charTime + 2 * timing.interFrameTimeout,
+                timing.charTime);
+            end += (responseLength + CRC_LEN) * timing.charTime + 2 * timing.interFrameTimeout;
+        }
+        runUntil(&now, end, step);
+        Serial.clearTx();
+        //Poll period of master
+        runUntil(&now, now + 5000 + replayRandom() % 45000, 1000);
+    }
+    capture.flush();
+    fclose(file);
+    printf("%u frames at %lu baud written to %s\n", frames, baudRate, path);
+    return 0;
+}
+
+int main(int argc, char** argv){
+    if (argc >= 3 && strcmp(argv[1], "-g") == 0){
+        uint32_t frames = argc > 3 ? strtoul(argv[3], NULL, 10) : 10000;
+        unsigned long baudRate = argc > 4 ? strtoul(argv[4], NULL, 10) : 19200;
+        return generate(argv[2], frames, baudRate);
+    }
+    if (argc < 2){
+        printf("Usage: modbus_replay <capture> [-s speed] [-a address] [-i input count] [-r holding count] [-n] [-v]\n"
+            "       modbus_replay -g <capture> [frames] [baud rate]\n");
+        return 2;
+    }
+    double speed = 1;
+    int address = -1;
+    int32_t inputCount = -1;
+    int32_t holdingCount = -1;
+    bool sync = true;
+    uint32_t printLimit = REPLAY_DEFAULT_DIVERGENCES;
+    for (int i = 2; i < argc; ++i){
+        bool value = i + 1 < argc;
+        if (strcmp(argv[i], "-s") == 0 && value){
+            speed = strtod(argv[++i], NULL);
+        }
+        else if (strcmp(argv[i], "-a") == 0 && value){
+            address = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-i") == 0 && value){
+            inputCount = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-r") == 0 && value){
+            holdingCount = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-n") == 0){
+            sync = false;
+        }
+        else if (strcmp(argv[i], "-v") == 0){
+            printLimit = UINT32_MAX;
+        }
+        else {
+            printf("Unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+    return replay(argv[1], speed, address, inputCount, holdingCount, sync, printLimit);
+}
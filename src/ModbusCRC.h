@@ -0,0 +1,74 @@
+#ifndef MODBUS_CRC_H
+#define MODBUS_CRC_H
+
+#include <Arduino.h>
+
+/*CRC-16/MODBUS engines. All engines produce the same result, they differ in speed and memory:
+TABLE      - 256 entry table (512 bytes, in program memory on AVR), 1 lookup per byte
+NIBBLE     - 16 entry table (32 bytes), 2 lookups per byte, for RAM/flash starved parts
+SLICING4   - 4 tables (2 kB), processes 4 bytes per iteration, for 32-bit MCUs
+SLICING8   - 8 tables (4 kB), processes 8 bytes per iteration, for fast 32-bit MCUs and Linux hosts
+Only the tables of selected engine are linked into the firmware (unused functions are removed by linker).
+With incremental CRC, each received byte is folded into CRC as it arrives, so the frame is verified
+the moment its last byte lands (CRC over data including received CRC is 0 for valid frame).
+*/
+
+//Adjust if necessary (can be also set by build flags)
+#define MODBUS_CRC_ENGINE_TABLE 0
+#define MODBUS_CRC_ENGINE_NIBBLE 1
+#define MODBUS_CRC_ENGINE_SLICING4 2
+#define MODBUS_CRC_ENGINE_SLICING8 3
+
+#ifndef MODBUS_CRC_ENGINE
+    #define MODBUS_CRC_ENGINE MODBUS_CRC_ENGINE_TABLE
+#endif
+#ifndef MODBUS_INCREMENTAL_CRC
+    #define MODBUS_INCREMENTAL_CRC true
+#endif
+
+#define MODBUS_CRC_INIT 0xFFFF
+
+//Engine functions, crc is the value returned by previous call (or MODBUS_CRC_INIT)
+extern uint16_t modbusCRC16Table(uint16_t crc, const uint8_t* data, uint16_t length);
+extern uint16_t modbusCRC16Nibble(uint16_t crc, const uint8_t* data, uint16_t length);
+extern uint16_t modbusCRC16Slicing4(uint16_t crc, const uint8_t* data, uint16_t length);
+extern uint16_t modbusCRC16Slicing8(uint16_t crc, const uint8_t* data, uint16_t length);
+extern uint16_t modbusCRC16UpdateTable(uint16_t crc, uint8_t data);
+extern uint16_t modbusCRC16UpdateNibble(uint16_t crc, uint8_t data);
+
+/**
+ * @brief Calculates CRC of given data using selected engine
+ *
+ * @param data Data buffer
+ * @param length Length of data (in bytes)
+ * @return uint16_t Calculated CRC (low byte is transmitted first)
+ */
+static inline uint16_t modbusCRC16(const uint8_t* data, uint16_t length){
+    #if MODBUS_CRC_ENGINE == MODBUS_CRC_ENGINE_NIBBLE
+        return modbusCRC16Nibble(MODBUS_CRC_INIT, data, length);
+    #elif MODBUS_CRC_ENGINE == MODBUS_CRC_ENGINE_SLICING4
+        return modbusCRC16Slicing4(MODBUS_CRC_INIT, data, length);
+    #elif MODBUS_CRC_ENGINE == MODBUS_CRC_ENGINE_SLICING8
+        return modbusCRC16Slicing8(MODBUS_CRC_INIT, data, length);
+    #else
+        return modbusCRC16Table(MODBUS_CRC_INIT, data, length);
+    #endif
+}
+
+/**
+ * @brief Folds single byte into CRC (used for incremental CRC calculation)
+ * Nibble engine uses its own small table, other engines share the byte-wise table.
+ *
+ * @param crc Current CRC (MODBUS_CRC_INIT for first byte)
+ * @param data Received byte
+ * @return uint16_t Updated CRC
+ */
+static inline uint16_t modbusCRC16Update(uint16_t crc, uint8_t data){
+    #if MODBUS_CRC_ENGINE == MODBUS_CRC_ENGINE_NIBBLE
+        return modbusCRC16UpdateNibble(crc, data);
+    #else
+        return modbusCRC16UpdateTable(crc, data);
+    #endif
+}
+
+#endif
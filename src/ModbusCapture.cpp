@@ -0,0 +1,111 @@
+#include "ModbusCapture.h"
+
+#define MODBUS_CAPTURE_DATA_OFFSET (1 + MODBUS_CAPTURE_MAX_TIME_LEN)
+
+void ModbusCapture::begin(unsigned long baudRate, void (*function)(const uint8_t* data, uint16_t length, void* ctx), void* ctx){
+    writeFunction = function;
+    writeCtx = ctx;
+    eventLength = 0;
+    lastTimestamp = micros();
+    uint8_t header[MODBUS_CAPTURE_HEADER_LEN] = {MODBUS_CAPTURE_MAGIC[0], MODBUS_CAPTURE_MAGIC[1], MODBUS_CAPTURE_MAGIC[2],
+        MODBUS_CAPTURE_MAGIC[3], MODBUS_CAPTURE_VERSION, (uint8_t)baudRate, (uint8_t)(baudRate >> 8),
+        (uint8_t)(baudRate >> 16), (uint8_t)(baudRate >> 24)};
+    writeFunction(header, sizeof(header), writeCtx);
+}
+
+void ModbusCapture::flush(){
+    if (eventLength == 0 || writeFunction == NULL){
+        return;
+    }
+    //Time is encoded backwards, right in front of bytes, so the whole event is written at once
+    uint8_t time[MODBUS_CAPTURE_MAX_TIME_LEN];
+    uint8_t timeLength = 0;
+    uint32_t delta = eventTimestamp - lastTimestamp;
+    do {
+        time[timeLength++] = (delta & 0x7F) | (delta > 0x7F ? 0x80 : 0);
+        delta >>= 7;
+    } while (delta != 0);
+    uint8_t offset = MODBUS_CAPTURE_DATA_OFFSET - timeLength - 1;
+    event[offset] = (eventDirection == MODBUS_TRAFFIC_TX ? MODBUS_CAPTURE_TX : 0) | (eventLength - 1);
+    memcpy(event + offset + 1, time, timeLength);
+    writeFunction(event + offset, 1 + timeLength + eventLength, writeCtx);
+    lastTimestamp = eventTimestamp;
+    eventLength = 0;
+}
+
+void ModbusCapture::trafficFunction(uint8_t direction, unsigned long timestamp, const uint8_t* data, uint16_t length, void* ctx){
+    ModbusCapture* capture = (ModbusCapture*)ctx;
+    if (capture->writeFunction == NULL){
+        return;
+    }
+    if (capture->eventLength != 0 && (direction != capture->eventDirection || timestamp != capture->eventTimestamp ||
+        direction == MODBUS_TRAFFIC_TX)){
+        capture->flush();
+    }
+    while (length > 0){
+        if (capture->eventLength == MODBUS_CAPTURE_MAX_BYTES){
+            capture->flush();
+        }
+        capture->eventDirection = direction;
+        capture->eventTimestamp = timestamp;
+        uint16_t count = MODBUS_CAPTURE_MAX_BYTES - capture->eventLength;
+        count = length < count ? length : count;
+        memcpy(capture->event + MODBUS_CAPTURE_DATA_OFFSET + capture->eventLength, data, count);
+        capture->eventLength += count;
+        data += count;
+        length -= count;
+    }
+    if (direction == MODBUS_TRAFFIC_TX){
+        //Frame is sent as a whole
+        capture->flush();
+    }
+}
+
+/**
+ * @brief Drops the oldest event (tag, time and bytes)
+ */
+void ModbusCaptureRingBase::dropOldest(){
+    uint16_t length = 1;
+    while (length < used && (at(length) & 0x80)){
+        ++length;
+    }
+    length += 1 + (at(0) & 0x7F) + 1;
+    length = length < used ? length : used;
+    start = (uint32_t)(start + length) % size;
+    used -= length;
+    ++droppedEvents;
+}
+
+void ModbusCaptureRingBase::write(const uint8_t* bytes, uint16_t length, void* ctx){
+    ModbusCaptureRingBase* ring = (ModbusCaptureRingBase*)ctx;
+    if (!ring->headerStored){
+        memcpy(ring->header, bytes, length < MODBUS_CAPTURE_HEADER_LEN ? length : MODBUS_CAPTURE_HEADER_LEN);
+        ring->headerStored = true;
+        return;
+    }
+    if (length > ring->size){
+        return;
+    }
+    while (ring->size - ring->used < length){
+        ring->dropOldest();
+    }
+    uint16_t end = (uint32_t)(ring->start + ring->used) % ring->size;
+    uint16_t first = ring->size - end < length ? ring->size - end : length;
+    memcpy(ring->data + end, bytes, first);
+    memcpy(ring->data, bytes + first, length - first);
+    ring->used += length;
+}
+
+void ModbusCaptureRingBase::dump(void (*function)(const uint8_t* data, uint16_t length, void* ctx), void* ctx){
+    if (!headerStored){
+        return;
+    }
+    function(header, MODBUS_CAPTURE_HEADER_LEN, ctx);
+    uint16_t first = size - start < used ? size - start : used;
+    if (first > 0){
+        function(data + start, first, ctx);
+    }
+    if (used > first){
+        function(data, used - first, ctx);
+    }
+}
@@ -0,0 +1,147 @@
+#ifndef MODBUS_CAPTURE_H
+#define MODBUS_CAPTURE_H
+
+#include "ModbusRTU.h"
+
+/*Capture of raw traffic of port (ModbusTrafficHook) into compact binary log, to reproduce field issues
+and to replay production traffic (extras/tools/ReplayTool.cpp). Log is header followed by events:
+    header: 'M' 'B' 'C' 'P', version, baud rate (uint32, little endian)
+    event:  tag (MODBUS_CAPTURE_TX for sent frame, bits 0-6 number of bytes - 1),
+            microseconds since previous event (unsigned LEB128, the first event counts from begin()), bytes
+Received bytes with the same timestamp are merged into one event, so byte read by default read function
+costs about 3 bytes of log, chunk of Linux serial port 2 bytes + its length. Interrupt ring passes runs of bytes
+without t1.5 silence stamped with arrival time of their last byte, so gaps between frames are kept.
+Log is streamed to write function: ModbusCaptureRing keeps the newest events in RAM (MCU),
+modbusCaptureFileWrite() appends to file (Linux).
+
+Example:
+    ModbusCaptureRing<2048> ring;
+    ModbusCapture capture;
+    capture.begin(19200, ModbusCaptureRing<2048>::write, &ring);
+    capture.attach(modbus);
+    ...
+    capture.flush();
+    ring.dump(sendToHost, NULL); //Log in order (header first)
+*/
+
+#define MODBUS_CAPTURE_MAGIC "MBCP"
+#define MODBUS_CAPTURE_VERSION 1
+#define MODBUS_CAPTURE_HEADER_LEN 9
+#define MODBUS_CAPTURE_TX 0x80 //Tag flag of sent frame
+#define MODBUS_CAPTURE_MAX_BYTES 128 //Bytes of one event (longer data is split)
+#define MODBUS_CAPTURE_MAX_TIME_LEN 5 //LEB128 of 32-bit time
+#define MODBUS_CAPTURE_MAX_EVENT (1 + MODBUS_CAPTURE_MAX_TIME_LEN + MODBUS_CAPTURE_MAX_BYTES)
+
+class ModbusCapture{
+
+    private:
+    void (*writeFunction)(const uint8_t* data, uint16_t length, void* ctx) = NULL;
+    void* writeCtx = NULL;
+    unsigned long lastTimestamp = 0; //Time of the last written event
+    //Event being collected, bytes are stored behind space for tag and time
+    uint8_t event[MODBUS_CAPTURE_MAX_EVENT];
+    uint8_t eventLength = 0; //Number of collected bytes
+    uint8_t eventDirection = MODBUS_TRAFFIC_RX;
+    unsigned long eventTimestamp = 0;
+
+    public:
+    /**
+     * @brief Starts capture, header is written immediately
+     *
+     * @param baudRate Baud rate of captured port (stored in header for replay)
+     * @param function Write function, gets header and then whole events (one event per call)
+     * @param ctx User-defined context, which will be passed to function
+     */
+    void begin(unsigned long baudRate, void (*function)(const uint8_t* data, uint16_t length, void* ctx), void* ctx);
+
+    /**
+     * @brief Captures traffic of server (built-in port) or port
+     */
+    template<typename Port>
+    void attach(Port& port){port.setTrafficHook(trafficFunction, this);}
+
+    /**
+     * @brief Writes collected received bytes (events are written once the next event starts)
+     */
+    void flush();
+
+    /**
+     * @brief Traffic hook function (ctx is ModbusCapture)
+     */
+    static void trafficFunction(uint8_t direction, unsigned long timestamp, const uint8_t* data, uint16_t length, void* ctx);
+};
+
+//Ring of the newest events in RAM (oldest events are dropped as whole)
+class ModbusCaptureRingBase{
+
+    private:
+    uint8_t* data;
+    uint16_t size;
+    uint16_t start = 0; //Oldest byte
+    uint16_t used = 0;
+    uint8_t header[MODBUS_CAPTURE_HEADER_LEN];
+    bool headerStored = false;
+    uint32_t droppedEvents = 0;
+
+    protected:
+    ModbusCaptureRingBase(uint8_t* buffer, uint16_t bufferSize) : data(buffer), size(bufferSize){}
+
+    public:
+    /**
+     * @brief Write function of ModbusCapture (ctx is ring). The first write (header) is kept aside.
+     */
+    static void write(const uint8_t* bytes, uint16_t length, void* ctx);
+
+    /**
+     * @brief Passes header and stored events (oldest first) to function
+     */
+    void dump(void (*function)(const uint8_t* data, uint16_t length, void* ctx), void* ctx);
+
+    /**
+     * @brief Drops stored events and header (call before ModbusCapture::begin())
+     */
+    void clear(){start = 0; used = 0; headerStored = false; droppedEvents = 0;}
+
+    /**
+     * @brief Number of stored bytes (without header)
+     */
+    uint16_t length(){return used;}
+
+    /**
+     * @brief Number of events dropped to make room for newer ones
+     */
+    uint32_t getDroppedEvents(){return droppedEvents;}
+
+    private:
+    uint8_t at(uint16_t offset){return data[(uint16_t)((uint32_t)(start + offset) % size)];}
+    void dropOldest();
+};
+
+/**
+ * @brief Ring of Size bytes (at least 2 * MODBUS_CAPTURE_MAX_EVENT)
+ */
+template<uint16_t Size>
+class ModbusCaptureRing : public ModbusCaptureRingBase{
+    static_assert(Size >= 2 * MODBUS_CAPTURE_MAX_EVENT, "Capture ring must hold at least two events");
+
+    private:
+    uint8_t buffer[Size];
+
+    public:
+    ModbusCaptureRing() : ModbusCaptureRingBase(buffer, Size){}
+    ModbusCaptureRing(const ModbusCaptureRing&) = delete;
+    ModbusCaptureRing& operator=(const ModbusCaptureRing&) = delete;
+};
+
+#if defined(__linux__)
+#include <stdio.h>
+
+/**
+ * @brief Write function of ModbusCapture appending to file (ctx is FILE*)
+ */
+static inline void modbusCaptureFileWrite(const uint8_t* data, uint16_t length, void* ctx){
+    fwrite(data, 1, length, (FILE*)ctx);
+}
+#endif
+
+#endif
@@ -0,0 +1,515 @@
+#include "ModbusGateway.h"
+
+#if defined(__linux__)
+
+//Fields of requests and responses are big endian
+static inline uint16_t readWord(const uint8_t* frame, uint16_t offset){
+    return ((uint16_t)frame[offset] << 8) | frame[offset + 1];
+}
+
+static inline void writeWord(uint8_t* frame, uint16_t offset, uint16_t value){
+    frame[offset] = (uint8_t)(value >> 8);
+    frame[offset + 1] = (uint8_t)value;
+}
+
+/**
+ * @brief Whether request is read of registers, which may be cached
+ */
+static inline bool isCacheableRead(const uint8_t* frame, uint16_t length){
+    uint16_t count = readWord(frame, 4);
+    return (frame[1] == FC_READ_HOLDING_REGISTERS || frame[1] == FC_READ_INPUT_REGISTERS) &&
+        length == MODBUS_REQUEST_BASE_LENGTH && count > 0 && count <= MAX_READ_REGISTER_COUNT &&
+        frame[0] != MODBUS_BROADCAST_ADDRESS;
+}
+
+ModbusGateway::ModbusGateway(){
+    //Frame assembler accepts responses as soon as their last byte arrives
+    defaultSerialCtx.frameLength = modbusResponseLength;
+    for (uint8_t i = 0; i < MODBUS_GATEWAY_CACHE_BLOCKS; ++i){
+        blocks[i].count = 0;
+        blocks[i].valid = false;
+        blocks[i].queued = false;
+    }
+    memset(&stats, 0, sizeof(stats));
+}
+
+void ModbusGateway::startModbusGateway(ModbusTcpServer* tcp, unsigned long baudRate){
+    upstream = tcp;
+    if (defaultSerialCtx.serial == NULL && serialReadFunction == defaultSerialReadFunction){
+        defaultSerialCtx.serial = &Serial;
+        Serial.begin(baudRate, SERIAL_8E1);
+    }
+    begin(baudRate);
+    lineIdleTimestamp = micros() - defaultSerialCtx.interFrameTimeout;
+}
+
+bool ModbusGateway::addCacheBlock(uint8_t slave, uint8_t functionCode, uint16_t first, uint16_t count, unsigned long period){
+    if ((functionCode != FC_READ_HOLDING_REGISTERS && functionCode != FC_READ_INPUT_REGISTERS) || count == 0 ||
+        count > MAX_READ_REGISTER_COUNT || slave == MODBUS_BROADCAST_ADDRESS){
+        return false;
+    }
+    for (uint8_t i = 0; i < MODBUS_GATEWAY_CACHE_BLOCKS; ++i){
+        ModbusGatewayBlock* block = &blocks[i];
+        if (block->count != 0){
+            continue;
+        }
+        block->slave = slave;
+        block->functionCode = functionCode;
+        block->first = first;
+        block->count = count;
+        block->period = period;
+        //Block is polled immediately
+        block->lastPoll = millis() - period;
+        block->lastRead = 0;
+        block->valid = false;
+        block->queued = false;
+        return true;
+    }
+    return false;
+}
+
+void ModbusGateway::invalidateCache(){
+    for (uint8_t i = 0; i < MODBUS_GATEWAY_CACHE_BLOCKS; ++i){
+        blocks[i].valid = false;
+    }
+}
+
+/**
+ * @brief Finds cache block covering registers
+ *
+ * @param fresh Block must be valid and younger than max age
+ * @return int16_t Index of block, -1 if none
+ */
+int16_t ModbusGateway::findBlock(uint8_t slave, uint8_t functionCode, uint16_t first, uint16_t count, bool fresh){
+    unsigned long now = millis();
+    for (uint8_t i = 0; i < MODBUS_GATEWAY_CACHE_BLOCKS; ++i){
+        const ModbusGatewayBlock* block = &blocks[i];
+        if (block->count == 0 || block->slave != slave || block->functionCode != functionCode || first < block->first ||
+            (uint32_t)first + count > (uint32_t)block->first + block->count){
+            continue;
+        }
+        if (!fresh || (block->valid && now - block->updated < maxAge)){
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Takes free cache block, or block read by clients least recently
+ *
+ * @return int16_t Index of block, -1 if all blocks are polled or being read
+ */
+int16_t ModbusGateway::allocateBlock(){
+    unsigned long now = millis();
+    int16_t oldest = -1;
+    for (uint8_t i = 0; i < MODBUS_GATEWAY_CACHE_BLOCKS; ++i){
+        const ModbusGatewayBlock* block = &blocks[i];
+        if (block->count == 0){
+            return i;
+        }
+        if (block->period == 0 && !block->queued && (oldest < 0 || now - block->lastRead > now - blocks[oldest].lastRead)){
+            oldest = i;
+        }
+    }
+    return oldest;
+}
+
+/**
+ * @brief Invalidates cached holding registers overlapping written registers
+ *
+ * @param slave Slave address (broadcast invalidates registers of all slaves)
+ */
+void ModbusGateway::invalidateBlocks(uint8_t slave, uint16_t first, uint16_t count){
+    for (uint8_t i = 0; i < MODBUS_GATEWAY_CACHE_BLOCKS; ++i){
+        ModbusGatewayBlock* block = &blocks[i];
+        if (block->count != 0 && block->functionCode == FC_READ_HOLDING_REGISTERS &&
+            (slave == MODBUS_BROADCAST_ADDRESS || block->slave == slave) &&
+            first < (uint32_t)block->first + block->count && (uint32_t)first + count > block->first){
+            block->valid = false;
+        }
+    }
+}
+
+void ModbusGateway::respondException(uint32_t token, uint8_t slave, uint8_t functionCode, uint8_t exception){
+    uint8_t response[MODBUS_RESPONSE_BASE_LEN + CRC_LEN] = {slave, (uint8_t)(functionCode | 0x80), exception};
+    calculateCRC(response, MODBUS_RESPONSE_BASE_LEN, true);
+    upstream->respond(token, response, sizeof(response));
+}
+
+/**
+ * @brief Answers read request from cache
+ *
+ * @param frame Read request (FC3 or FC4)
+ * @param token Token of request
+ * @return Whether request was answered
+ */
+bool ModbusGateway::answerFromCache(const uint8_t* frame, uint32_t token){
+    uint16_t first = readWord(frame, 2);
+    uint16_t count = readWord(frame, 4);
+    int16_t index = findBlock(frame[0], frame[1], first, count, true);
+    if (index < 0){
+        return false;
+    }
+    ModbusGatewayBlock* block = &blocks[index];
+    block->lastRead = millis();
+    uint8_t response[MODBUS_MAX_FRAME_LEN];
+    response[0] = frame[0];
+    response[1] = frame[1];
+    response[2] = (uint8_t)(count * 2);
+    memcpy(response + MODBUS_RESPONSE_BASE_LEN, block->data + 2 * (first - block->first), count * 2);
+    calculateCRC(response, MODBUS_RESPONSE_BASE_LEN + count * 2, true);
+    upstream->respond(token, response, MODBUS_RESPONSE_BASE_LEN + count * 2 + CRC_LEN);
+    ++stats.cacheHits;
+    return true;
+}
+
+/**
+ * @brief Lets read request wait for queued (or running) read of the same registers
+ *
+ * @param frame Read request (FC3 or FC4)
+ * @param token Token of request
+ * @return Whether request waits for transaction
+ */
+bool ModbusGateway::joinTransaction(const uint8_t* frame, uint32_t token){
+    uint16_t first = readWord(frame, 2);
+    uint16_t count = readWord(frame, 4);
+    for (uint8_t i = 0; i < queueLength; ++i){
+        ModbusGatewayTransaction* transaction = &queue[(queueStart + i) % MODBUS_GATEWAY_QUEUE_LEN];
+        uint16_t transactionFirst = readWord(transaction->frame, 2);
+        uint16_t transactionCount = readWord(transaction->frame, 4);
+        if (!transaction->joinable || transaction->waiterCount == MODBUS_GATEWAY_WAITERS ||
+            transaction->frame[0] != frame[0] || transaction->frame[1] != frame[1] || first < transactionFirst ||
+            (uint32_t)first + count > (uint32_t)transactionFirst + transactionCount){
+            continue;
+        }
+        ModbusGatewayWaiter* waiter = &transaction->waiters[transaction->waiterCount++];
+        waiter->token = token;
+        waiter->first = first;
+        waiter->count = count;
+        if (transaction->block >= 0){
+            blocks[transaction->block].lastRead = millis();
+        }
+        ++stats.coalesced;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Appends transaction to queue
+ *
+ * @param frame Request (without CRC)
+ * @param length Length of request
+ * @return Transaction (without waiters, not cached, not joinable), NULL if queue is full
+ */
+ModbusGatewayTransaction* ModbusGateway::queueTransaction(const uint8_t* frame, uint16_t length){
+    if (queueLength == MODBUS_GATEWAY_QUEUE_LEN){
+        return NULL;
+    }
+    ModbusGatewayTransaction* transaction = &queue[(queueStart + queueLength) % MODBUS_GATEWAY_QUEUE_LEN];
+    ++queueLength;
+    memcpy(transaction->frame, frame, length);
+    transaction->length = length;
+    transaction->block = -1;
+    transaction->joinable = false;
+    transaction->waiterCount = 0;
+    return transaction;
+}
+
+/**
+ * @brief Handles request taken from TCP server
+ *
+ * @param frame Request
+ * @param result Result of ModbusTcpServer::takeRequest() (length | MODBUS_FRAME_CRC_OK)
+ * @param token Token of request
+ */
+void ModbusGateway::handleClientRequest(uint8_t* frame, uint16_t result, uint32_t token){
+    uint16_t length = result & ~MODBUS_FRAME_CRC_OK;
+    ++stats.requests;
+    if (!(result & MODBUS_FRAME_CRC_OK) && !calculateCRC(frame, length - CRC_LEN, false)){
+        //Corrupted RTU over TCP frame is not answered (as on serial line)
+        upstream->respond(token, NULL, 0);
+        return;
+    }
+    length -= CRC_LEN;
+    uint8_t slave = frame[0];
+    uint8_t functionCode = frame[1];
+    uint16_t first = readWord(frame, 2);
+    uint16_t count = readWord(frame, 4);
+    if (slave > MODBUS_MAX_SLAVE_ADDRESS || (slave == MODBUS_BROADCAST_ADDRESS && !isBroadcastFunction(functionCode))){
+        //Unit 0xFF (gateway itself, which has no data) or reserved address, read can't be broadcast
+        ++stats.rejected;
+        respondException(token, slave, functionCode, EX_GATEWAY_PATH_UNAVAILABLE);
+        return;
+    }
+    bool read = isCacheableRead(frame, length);
+    if (read && (answerFromCache(frame, token) || joinTransaction(frame, token))){
+        return;
+    }
+
+    ModbusGatewayTransaction* transaction = queueTransaction(frame, length);
+    if (transaction == NULL){
+        ++stats.rejected;
+        respondException(token, slave, functionCode, EX_GATEWAY_PATH_UNAVAILABLE);
+        return;
+    }
+    transaction->waiters[0].token = token;
+    transaction->waiters[0].first = first;
+    transaction->waiters[0].count = count;
+    transaction->waiterCount = 1;
+    if (!read){
+        //Reads queued before write (or other request with side effects) are not joined by later reads
+        for (uint8_t i = 0; i < queueLength; ++i){
+            ModbusGatewayTransaction* queued = &queue[(queueStart + i) % MODBUS_GATEWAY_QUEUE_LEN];
+            if (slave == MODBUS_BROADCAST_ADDRESS || queued->frame[0] == slave){
+                queued->joinable = false;
+            }
+        }
+        return;
+    }
+
+    transaction->joinable = true;
+    int16_t index = findBlock(slave, functionCode, first, count, false);
+    if (index >= 0 && blocks[index].queued){
+        //Block is read by transaction, which may not be joined, response is only forwarded
+        return;
+    }
+    unsigned long now = millis();
+    if (index >= 0){
+        //Stale block is refreshed as a whole
+        writeWord(transaction->frame, 2, blocks[index].first);
+        writeWord(transaction->frame, 4, blocks[index].count);
+    }
+    else {
+        index = allocateBlock();
+        if (index < 0){
+            return;
+        }
+        ModbusGatewayBlock* block = &blocks[index];
+        block->slave = slave;
+        block->functionCode = functionCode;
+        block->first = first;
+        block->count = count;
+        block->period = 0;
+        block->valid = false;
+    }
+    blocks[index].lastRead = now;
+    blocks[index].lastPoll = now;
+    blocks[index].queued = true;
+    transaction->block = index;
+}
+
+/**
+ * @brief Queues read of the first block due for refresh (round robin), queue must be empty
+ */
+void ModbusGateway::pollBlock(){
+    unsigned long now = millis();
+    unsigned long refresh = maxAge - maxAge / 4;
+    for (uint8_t i = 0; i < MODBUS_GATEWAY_CACHE_BLOCKS; ++i){
+        uint8_t index = (uint8_t)((nextPoll + i) % MODBUS_GATEWAY_CACHE_BLOCKS);
+        ModbusGatewayBlock* block = &blocks[index];
+        if (block->count == 0 || block->queued){
+            continue;
+        }
+        unsigned long interval = block->period;
+        if (interval == 0){
+            //Blocks of clients are refreshed before they expire, while clients read them
+            if (maxAge == 0 || now - block->lastRead >= MODBUS_GATEWAY_KEEP_ALIVE){
+                continue;
+            }
+            interval = refresh;
+        }
+        if (now - block->lastPoll < interval){
+            continue;
+        }
+
+        uint8_t frame[MODBUS_REQUEST_BASE_LENGTH] = {block->slave, block->functionCode};
+        writeWord(frame, 2, block->first);
+        writeWord(frame, 4, block->count);
+        ModbusGatewayTransaction* transaction = queueTransaction(frame, MODBUS_REQUEST_BASE_LENGTH);
+        transaction->block = index;
+        transaction->joinable = true;
+        block->queued = true;
+        nextPoll = (uint8_t)((index + 1) % MODBUS_GATEWAY_CACHE_BLOCKS);
+        ++stats.polls;
+        return;
+    }
+}
+
+/**
+ * @brief Sends request of the first queued transaction, line must be idle
+ */
+void ModbusGateway::sendNextRequest(){
+    //Request must be preceded by t3.5 silence
+    if (queueLength == 0 || micros() - lineIdleTimestamp < defaultSerialCtx.interFrameTimeout){
+        return;
+    }
+    ModbusGatewayTransaction* transaction = &queue[queueStart];
+    if (transaction->block >= 0){
+        blocks[transaction->block].lastPoll = millis();
+    }
+    //Request is built in frame buffer (response is received to the same buffer)
+    memcpy((uint8_t*)rxFrame.raw_data, transaction->frame, transaction->length);
+    active = true;
+    requestTimestamp = micros();
+    ++stats.transactions;
+    sendFrame(transaction->length);
+}
+
+/**
+ * @brief Answers clients waiting for the first transaction and removes it from queue
+ *
+ * @param response Response of slave (with CRC), NULL if there is none
+ * @param length Length of response (without CRC)
+ * @param exception Exception reported to clients without response (0 for broadcast)
+ */
+void ModbusGateway::finishTransaction(const uint8_t* response, uint16_t length, uint8_t exception){
+    ModbusGatewayTransaction* transaction = &queue[queueStart];
+    uint8_t slave = transaction->frame[0];
+    uint8_t functionCode = transaction->frame[1];
+    uint16_t first = readWord(transaction->frame, 2);
+    uint16_t count = readWord(transaction->frame, 4);
+    bool read = isCacheableRead(transaction->frame, transaction->length);
+    bool rejected = response != NULL && response[1] == (functionCode | 0x80) && length == MODBUS_RESPONSE_BASE_LEN;
+
+    if (!read){
+        if (response != NULL && response[1] == functionCode){
+            //Written holding registers are read again from slave
+            if (functionCode == FC_WRITE_SINGLE_REGISTER){
+                invalidateBlocks(slave, first, 1);
+            }
+            else if (functionCode == FC_WRITE_MULTIPLE_REGISTERS){
+                invalidateBlocks(slave, first, count);
+            }
+            else if (functionCode == FC_READ_WRITE_MULTIPLE_REGISTERS && transaction->length > 9){
+                invalidateBlocks(slave, readWord(transaction->frame, 6),
+                    readWord(transaction->frame, 8));
+            }
+        }
+        else if (response == NULL && exception == 0){
+            //Broadcast (there is no response to confirm write)
+            invalidateBlocks(MODBUS_BROADCAST_ADDRESS, 0, 0xFFFF);
+        }
+        if (response != NULL){
+            upstream->respond(transaction->waiters[0].token, response, length + CRC_LEN);
+        }
+        else if (exception != 0){
+            respondException(transaction->waiters[0].token, slave, functionCode, exception);
+        }
+        else {
+            //Broadcast write is confirmed after turnaround delay by normal response (echo of address and quantity)
+            uint8_t answer[MODBUS_REQUEST_BASE_LENGTH + CRC_LEN];
+            memcpy(answer, transaction->frame, MODBUS_REQUEST_BASE_LENGTH);
+            calculateCRC(answer, MODBUS_REQUEST_BASE_LENGTH, true);
+            upstream->respond(transaction->waiters[0].token, answer, sizeof(answer));
+        }
+    }
+    else {
+        bool valid = response != NULL && response[1] == functionCode && response[2] == count * 2 &&
+            length == MODBUS_RESPONSE_BASE_LEN + count * 2;
+        if (response != NULL && !valid && !rejected){
+            exception = EX_GATEWAY_TARGET_FAILED;
+        }
+        if (transaction->block >= 0){
+            ModbusGatewayBlock* block = &blocks[transaction->block];
+            block->queued = false;
+            if (valid){
+                memcpy(block->data, response + MODBUS_RESPONSE_BASE_LEN, count * 2);
+                block->updated = millis();
+                block->valid = true;
+            }
+            else if (response != NULL){
+                block->valid = false;
+            }
+        }
+        for (uint8_t i = 0; i < transaction->waiterCount; ++i){
+            const ModbusGatewayWaiter* waiter = &transaction->waiters[i];
+            if (!valid){
+                respondException(waiter->token, slave, functionCode, rejected ? response[2] : exception);
+                continue;
+            }
+            uint8_t answer[MODBUS_MAX_FRAME_LEN];
+            answer[0] = slave;
+            answer[1] = functionCode;
+            answer[2] = (uint8_t)(waiter->count * 2);
+            memcpy(answer + MODBUS_RESPONSE_BASE_LEN, response + MODBUS_RESPONSE_BASE_LEN + 2 * (waiter->first - first),
+                waiter->count * 2);
+            calculateCRC(answer, MODBUS_RESPONSE_BASE_LEN + waiter->count * 2, true);
+            upstream->respond(waiter->token, answer, MODBUS_RESPONSE_BASE_LEN + waiter->count * 2 + CRC_LEN);
+        }
+    }
+    queueStart = (uint8_t)((queueStart + 1) % MODBUS_GATEWAY_QUEUE_LEN);
+    --queueLength;
+    active = false;
+}
+
+/**
+ * @brief Handles frame received while waiting for response
+ *
+ * @param result Result of read function (length | MODBUS_FRAME_CRC_OK)
+ */
+void ModbusGateway::handleResponse(uint16_t result){
+    uint16_t length = result & ~MODBUS_FRAME_CRC_OK;
+    const uint8_t* frame = (const uint8_t*)rxFrame.raw_data;
+    if (frame[0] != queue[queueStart].frame[0]){
+        //Frame of other device, keep waiting
+        return;
+    }
+    lineIdleTimestamp = frameEndTimestamp();
+    if (!(result & MODBUS_FRAME_CRC_OK) && !calculateCRC(rxFrame.raw_data, length - CRC_LEN, false)){
+        ++stats.crcErrors;
+        finishTransaction(NULL, 0, EX_GATEWAY_TARGET_FAILED);
+        return;
+    }
+    finishTransaction(frame, length - CRC_LEN, 0);
+}
+
+void ModbusGateway::communicationLoop(){
+    //Response with invalid CRC is dropped by frame assembler (with incremental CRC), only its counter changes
+    const SerialCtx* frameCtx = getFrameCtx();
+    uint16_t crcErrors = frameCtx != NULL ? frameCtx->crcErrors : 0;
+    uint16_t result = receiveFrame();
+    if (active && !txBusy){
+        unsigned long elapsed = micros() - requestTimestamp;
+        if (queue[queueStart].frame[0] == MODBUS_BROADCAST_ADDRESS){
+            //Slaves execute broadcast without response
+            if (elapsed >= MODBUS_GATEWAY_TURNAROUND_DELAY * 1000UL){
+                lineIdleTimestamp = micros();
+                finishTransaction(NULL, 0, 0);
+            }
+        }
+        else if (result != 0){
+            handleResponse(result);
+        }
+        else if (frameCtx != NULL && frameCtx->crcErrors != crcErrors){
+            //Slave answered, but response is corrupted (client is answered without waiting for timeout)
+            ++stats.crcErrors;
+            lineIdleTimestamp = frameEndTimestamp();
+            finishTransaction(NULL, 0, EX_GATEWAY_TARGET_FAILED);
+        }
+        else if (elapsed >= responseTimeout){
+            ++stats.timeouts;
+            lineIdleTimestamp = micros();
+            finishTransaction(NULL, 0, EX_GATEWAY_TARGET_FAILED);
+        }
+    }
+
+    if (upstream != NULL){
+        uint8_t frame[MODBUS_MAX_FRAME_LEN];
+        uint32_t token;
+        while ((result = upstream->takeRequest(frame, &token)) != 0){
+            handleClientRequest(frame, result, token);
+        }
+    }
+
+    //Next request follows the response immediately (after t3.5 silence)
+    if (!active && !txBusy){
+        if (queueLength == 0){
+            pollBlock();
+        }
+        sendNextRequest();
+    }
+}
+
+#endif
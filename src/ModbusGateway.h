@@ -0,0 +1,171 @@
+#ifndef MODBUS_GATEWAY_H
+#define MODBUS_GATEWAY_H
+
+#include "ModbusTcp.h"
+
+#if defined(__linux__)
+
+/*Caching Modbus TCP to RTU gateway. Requests of TCP clients (ModbusTcpServer) are forwarded to slaves on serial line,
+gateway is a ModbusPort acting as master of the line. Read Holding / Input Registers responses are kept in cache
+blocks, so reads covered by block, which is not older than max age, are answered without serial transaction.
+Missed reads of the same range (or range covered by queued read) wait for one serial transaction.
+Blocks read by clients recently are refreshed in the background (when the line is idle and block is older
+than 3/4 of max age), blocks added by addCacheBlock() are polled periodically. Writes and other function codes
+are forwarded immediately (in order of arrival), successful write of holding registers invalidates blocks it
+overlaps and reads queued after the write are never answered by response read before it.
+Slave which does not respond is reported by exception 0x0B, full queue by exception 0x0A. Broadcast (unit 0)
+writes are confirmed after turnaround delay, other broadcasts and unit IDs above 247 (0xFF addresses gateway itself,
+which has no registers) are answered by exception 0x0A without serial transaction.
+
+Example:
+    ModbusTcpServer tcp;
+    ModbusLinuxSerial serial;
+    ModbusGateway gateway;
+    tcp.begin(MODBUS_TCP_PORT);
+    serial.begin("/dev/ttyUSB0", 19200);
+    serial.setFrameLengthFunction(modbusResponseLength);
+    serial.attach(gateway);
+    gateway.setMaxAge(500);
+    gateway.startModbusGateway(&tcp, 19200);
+    while (true){
+        tcp.wait(1);
+        gateway.communicationLoop();
+    }
+*/
+
+//Adjust if necessary
+#define MODBUS_GATEWAY_CACHE_BLOCKS 32
+#define MODBUS_GATEWAY_QUEUE_LEN 16 //Serial transactions waiting for the line
+#define MODBUS_GATEWAY_WAITERS 8 //Client requests answered by one serial transaction
+#define MODBUS_GATEWAY_MAX_AGE 1000UL //Milliseconds
+#define MODBUS_GATEWAY_KEEP_ALIVE 10000UL //Blocks not read by clients for this long (milliseconds) are not refreshed
+#define MODBUS_GATEWAY_RESPONSE_TIMEOUT 100UL //Milliseconds
+#define MODBUS_GATEWAY_TURNAROUND_DELAY 100UL //Milliseconds after broadcast
+
+//Cache block, registers are stored as transmitted (big endian)
+typedef struct {
+    uint8_t slave;
+    uint8_t functionCode; //FC_READ_HOLDING_REGISTERS or FC_READ_INPUT_REGISTERS
+    uint16_t first;
+    uint16_t count; //0 if block is free
+    unsigned long period; //Poll period (milliseconds) of block added by addCacheBlock(), 0 for blocks read by clients
+    unsigned long updated; //Time of the last response (milliseconds)
+    unsigned long lastPoll; //Time of the last request (milliseconds)
+    unsigned long lastRead; //Time of the last read by client (milliseconds)
+    bool valid;
+    bool queued; //Read of block is queued or in progress
+    uint8_t data[2 * MAX_READ_REGISTER_COUNT];
+} ModbusGatewayBlock;
+
+//Client request waiting for serial transaction
+typedef struct {
+    uint32_t token; //See ModbusTcpServer::takeRequest()
+    uint16_t first;
+    uint16_t count;
+} ModbusGatewayWaiter;
+
+typedef struct {
+    uint8_t frame[MODBUS_MAX_FRAME_LEN]; //Request without CRC
+    uint16_t length;
+    int16_t block; //Cache block updated by response, -1 if response is not cached
+    bool joinable; //Reads of the same range may wait for response (no write of the slave was queued since)
+    uint8_t waiterCount;
+    ModbusGatewayWaiter waiters[MODBUS_GATEWAY_WAITERS];
+} ModbusGatewayTransaction;
+
+typedef struct {
+    uint32_t requests; //Requests of clients
+    uint32_t cacheHits; //Reads answered from cache
+    uint32_t coalesced; //Reads which waited for transaction queued by other read
+    uint32_t transactions; //Serial transactions (including background polls)
+    uint32_t polls; //Background polls
+    uint32_t timeouts; //Slave did not respond within response timeout
+    uint32_t crcErrors; //Responses with invalid CRC (noisy line)
+    uint32_t rejected; //Requests rejected because queue was full or unit can't be reached on serial line
+} ModbusGatewayStats;
+
+class ModbusGateway : public ModbusPort{
+
+    private:
+    ModbusTcpServer* upstream = NULL;
+    ModbusGatewayBlock blocks[MODBUS_GATEWAY_CACHE_BLOCKS];
+    ModbusGatewayTransaction queue[MODBUS_GATEWAY_QUEUE_LEN]; //Ring, the first transaction is in progress while active
+    uint8_t queueStart = 0;
+    uint8_t queueLength = 0;
+    bool active = false; //Request of the first transaction was sent
+    unsigned long requestTimestamp = 0; //Microseconds
+    unsigned long lineIdleTimestamp = 0; //End of the last response (microseconds)
+    unsigned long maxAge = MODBUS_GATEWAY_MAX_AGE;
+    unsigned long responseTimeout = MODBUS_GATEWAY_RESPONSE_TIMEOUT * 1000UL; //Microseconds
+    uint8_t nextPoll = 0; //Background polls continue from this block (round robin)
+    ModbusGatewayStats stats;
+
+    public:
+    ModbusGateway();
+
+    /**
+     * @brief Starts gateway
+     *
+     * @param tcp TCP server of clients (requests are taken by ModbusTcpServer::takeRequest())
+     * @param baudRate Communication baud rate (Serial is initialized, unless custom serial port was set)
+     */
+    void startModbusGateway(ModbusTcpServer* tcp, unsigned long baudRate);
+
+    /**
+     * @brief Sets how old cached registers may be returned to clients (0 disables cache, misses are still coalesced)
+     * @param age Max age in milliseconds
+     */
+    void setMaxAge(unsigned long age){maxAge = age;}
+
+    /**
+     * @brief Sets how long gateway waits for response of slave
+     * @param timeout Timeout in milliseconds
+     */
+    void setResponseTimeout(unsigned long timeout){responseTimeout = timeout * 1000UL;}
+
+    /**
+     * @brief Adds block of registers polled in the background regardless of client reads
+     *
+     * @param slave Slave address
+     * @param functionCode FC_READ_HOLDING_REGISTERS or FC_READ_INPUT_REGISTERS
+     * @param first First register
+     * @param count Number of registers (up to MAX_READ_REGISTER_COUNT)
+     * @param period Poll period in milliseconds
+     * @return Whether block was added (cache is not full)
+     */
+    bool addCacheBlock(uint8_t slave, uint8_t functionCode, uint16_t first, uint16_t count, unsigned long period);
+
+    /**
+     * @brief Drops all cached registers (i.e. when slave was restarted)
+     */
+    void invalidateCache();
+
+    /**
+     * @brief Main loop for communication. Takes requests of clients, answers them from cache or queues them,
+     * sends queued requests and handles responses. Call this function periodically.
+     */
+    void communicationLoop();
+
+    /**
+     * @brief Counters of gateway
+     */
+    const ModbusGatewayStats* getStats(){return &stats;}
+
+    private:
+    void handleClientRequest(uint8_t* frame, uint16_t length, uint32_t token);
+    bool answerFromCache(const uint8_t* frame, uint32_t token);
+    bool joinTransaction(const uint8_t* frame, uint32_t token);
+    ModbusGatewayTransaction* queueTransaction(const uint8_t* frame, uint16_t length);
+    int16_t findBlock(uint8_t slave, uint8_t functionCode, uint16_t first, uint16_t count, bool fresh);
+    int16_t allocateBlock();
+    void invalidateBlocks(uint8_t slave, uint16_t first, uint16_t count);
+    void pollBlock();
+    void sendNextRequest();
+    void handleResponse(uint16_t result);
+    void finishTransaction(const uint8_t* response, uint16_t length, uint8_t exception);
+    void respondException(uint32_t token, uint8_t slave, uint8_t functionCode, uint8_t exception);
+};
+
+#endif
+
+#endif
@@ -0,0 +1,377 @@
+#include "ModbusJournal.h"
+
+#if defined(__linux__)
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define MODBUS_JOURNAL_MAX_RECORDS 16383 //Sequence numbers of records in ring must differ by less than 32768
+#define MODBUS_JOURNAL_OFFSET_MASK 0x7FFF
+
+/**
+ * @brief Check of record. Torn write leaves new head and old tail of record in slot, CRC alone would accept
+ * such mix more often than at random, because records in the same slot differ in similar bits (CRC is linear).
+ * Product of fields is appended to make the check non-linear.
+ */
+static uint16_t recordCRC(const ModbusJournalRecord* record){
+    uint16_t mix = (uint16_t)(((uint32_t)(record->sequence ^ record->offset) * 0x9E3779B1UL ^ record->value) * 0x85EBCA6BUL >> 16);
+    uint8_t data[8] = {(uint8_t)(record->sequence >> 8), (uint8_t)record->sequence, (uint8_t)(record->offset >> 8),
+        (uint8_t)record->offset, (uint8_t)(record->value >> 8), (uint8_t)record->value, (uint8_t)(mix >> 8), (uint8_t)mix};
+    return modbusCRC16(data, sizeof(data));
+}
+
+//Slot distance from older to newer (ring of capacity slots)
+static inline uint16_t slotDistance(uint16_t older, uint16_t newer, uint16_t capacity){
+    return newer >= older ? newer - older : newer + capacity - older;
+}
+
+/**
+ * @brief Reads record and checks its CRC (erased or partially written record is invalid)
+ */
+bool ModbusJournalBase::readRecord(uint16_t slot, ModbusJournalRecord* record){
+    return storage->read((uint32_t)slot * MODBUS_JOURNAL_RECORD_LEN, record, MODBUS_JOURNAL_RECORD_LEN, storage->ctx) &&
+        record->crc == recordCRC(record);
+}
+
+int32_t ModbusJournalBase::begin(ModbusRTUBase& modbusServer, const ModbusStorage* nvStorage, uint16_t firstRegister){
+    uint32_t records = nvStorage->size / MODBUS_JOURNAL_RECORD_LEN;
+    if (records > MODBUS_JOURNAL_MAX_RECORDS){
+        records = MODBUS_JOURNAL_MAX_RECORDS;
+    }
+    if (count == 0 || count > MODBUS_JOURNAL_OFFSET_MASK || records < 2UL * count + 2){
+        return -1;
+    }
+    server = &modbusServer;
+    storage = nvStorage;
+    first = firstRegister;
+    capacity = records;
+    snapshotCount = 0;
+    snapshotNext = 0;
+    dirtyCount = 0;
+    memset(dirty, 0, (count + 7) / 8);
+
+    //Newest record (sequences of valid records in ring differ by less than 32768)
+    ModbusJournalRecord record;
+    bool found = false;
+    uint16_t reference = 0;
+    int16_t newestDistance = 0;
+    uint16_t newest = 0;
+    for (uint16_t slot = 0; slot < capacity; ++slot){
+        if (!readRecord(slot, &record)){
+            continue;
+        }
+        if (!found){
+            found = true;
+            reference = record.sequence;
+            newest = slot;
+        }
+        else if ((int16_t)(record.sequence - reference) > newestDistance){
+            newestDistance = record.sequence - reference;
+            newest = slot;
+        }
+    }
+    if (!found){
+        head = 0;
+        sequence = 0;
+        freeSlots = capacity;
+        server->setHoldingWrittenFunction(holdingWritten, this);
+        return 0;
+    }
+    uint16_t newestSequence = reference + newestDistance;
+
+    //Walks back while records are older (torn record is skipped) until complete snapshot is found, that is
+    //snapshot records of all registers in consecutive slots. Snapshot records after the last delta record
+    //belong to snapshot interrupted by reset, they are dropped and overwritten.
+    uint16_t oldest = newest;
+    uint16_t end = newest + 1 == capacity ? 0 : newest + 1; //Slot after the last replayed record
+    uint16_t previousSequence = newestSequence;
+    int32_t run = -1; //Offset of snapshot record in the following slot, -1 if the slot does not continue snapshot
+    bool delta = false;
+    bool snapshot = false;
+    for (uint16_t distance = 0; distance < capacity; ++distance){
+        uint16_t slot = newest >= distance ? newest - distance : newest + capacity - distance;
+        if (!readRecord(slot, &record)){
+            run = -1;
+            continue;
+        }
+        if (distance > 0 && (int16_t)(record.sequence - previousSequence) >= 0){
+            break;
+        }
+        previousSequence = record.sequence;
+        oldest = slot;
+        if (!(record.offset & MODBUS_JOURNAL_SNAPSHOT)){
+            if (!delta){
+                delta = true;
+                end = slot + 1 == capacity ? 0 : slot + 1;
+            }
+            run = -1;
+            continue;
+        }
+        uint16_t offset = record.offset & MODBUS_JOURNAL_OFFSET_MASK;
+        run = offset == count - 1 || offset + 1 == run ? offset : -1;
+        if (run == 0){
+            snapshot = true;
+            if (!delta){
+                end = (uint32_t)(slot + count) % capacity;
+            }
+            break;
+        }
+    }
+    if (!snapshot && !delta){
+        end = newest + 1 == capacity ? 0 : newest + 1;
+    }
+
+    //Replay (dirty flags count restored registers, they are cleared afterwards)
+    uint16_t restored = 0;
+    uint16_t replayed = 0;
+    for (uint16_t slot = oldest; slot != end; slot = slot + 1 == capacity ? 0 : slot + 1, ++replayed){
+        if (!readRecord(slot, &record) ||
+            ((record.offset & MODBUS_JOURNAL_SNAPSHOT) && (!snapshot || replayed >= count))){
+            continue;
+        }
+        uint16_t offset = record.offset & MODBUS_JOURNAL_OFFSET_MASK;
+        if (offset >= count){
+            continue;
+        }
+        server->copyToHoldingRegisters(&record.value, 1, first + offset);
+        if (!(dirty[offset >> 3] & (1 << (offset & 7)))){
+            dirty[offset >> 3] |= 1 << (offset & 7);
+            ++restored;
+        }
+    }
+    memset(dirty, 0, (count + 7) / 8);
+
+    head = end;
+    sequence = newestSequence + 1;
+    freeSlots = capacity - slotDistance(oldest, end, capacity);
+    if (!snapshot && freeSlots < count + 1){
+        //Long run of records without snapshot (i.e. count was changed), snapshot is written by the next flush
+        freeSlots = 0;
+    }
+    server->setHoldingWrittenFunction(holdingWritten, this);
+    return restored;
+}
+
+void ModbusJournalBase::holdingWritten(uint16_t firstRegister, uint16_t registerCount, void* ctx){
+    ((ModbusJournalBase*)ctx)->markWritten(firstRegister, registerCount);
+}
+
+void ModbusJournalBase::markWritten(uint16_t firstRegister, uint16_t registerCount){
+    uint32_t start = firstRegister > first ? firstRegister : first;
+    uint32_t stop = (uint32_t)firstRegister + registerCount;
+    if (stop > (uint32_t)first + count){
+        stop = (uint32_t)first + count;
+    }
+    if (storage == NULL || start >= stop){
+        return;
+    }
+    if (dirtyCount == 0){
+        pendingSince = millis();
+    }
+    for (uint16_t offset = start - first; offset < stop - first; ++offset){
+        if (!(dirty[offset >> 3] & (1 << (offset & 7)))){
+            dirty[offset >> 3] |= 1 << (offset & 7);
+            ++dirtyCount;
+        }
+    }
+}
+
+/**
+ * @brief Writes record to head of ring
+ */
+bool ModbusJournalBase::appendRecord(uint16_t offset, uint16_t value){
+    ModbusJournalRecord record;
+    record.sequence = sequence;
+    record.offset = offset;
+    record.value = value;
+    record.crc = recordCRC(&record);
+    if (!storage->write((uint32_t)head * MODBUS_JOURNAL_RECORD_LEN, &record, MODBUS_JOURNAL_RECORD_LEN, storage->ctx)){
+        return false;
+    }
+    ++sequence;
+    head = head + 1 == capacity ? 0 : head + 1;
+    return true;
+}
+
+/**
+ * @brief Continues snapshot (current values of all journaled registers). Snapshot is written to free slots only,
+ * so the previous snapshot stays valid until the new one is complete. No other records are written meanwhile,
+ * registers written after their snapshot record stay flagged.
+ *
+ * @param maxRecords Max number of records
+ * @return Number of records written
+ */
+uint16_t ModbusJournalBase::writeSnapshot(uint16_t maxRecords){
+    if (snapshotNext == 0){
+        snapshotStart = head;
+    }
+    uint16_t written = 0;
+    while (snapshotNext < count && written < maxRecords){
+        uint16_t offset = snapshotNext;
+        uint16_t value = 0;
+        server->copyFromHoldingRegisters(&value, 1, first + offset);
+        if (!appendRecord(offset | MODBUS_JOURNAL_SNAPSHOT, value)){
+            //Incomplete snapshot is overwritten by the next one, its registers are written again
+            head = snapshotStart;
+            snapshotNext = 0;
+            markWritten(first, offset);
+            return written;
+        }
+        if (dirty[offset >> 3] & (1 << (offset & 7))){
+            dirty[offset >> 3] &= ~(1 << (offset & 7));
+            --dirtyCount;
+        }
+        ++snapshotNext;
+        ++written;
+    }
+    if (snapshotNext == count){
+        freeSlots = capacity - count;
+        snapshotNext = 0;
+        ++snapshotCount;
+    }
+    return written;
+}
+
+/**
+ * @brief Writes flagged registers (current values) as records
+ *
+ * @param maxRecords Max number of records (snapshot records included)
+ * @return Number of records written
+ */
+uint16_t ModbusJournalBase::writeDirty(uint16_t maxRecords){
+    uint16_t written = 0;
+    if (snapshotNext > 0){
+        written = writeSnapshot(maxRecords);
+        if (snapshotNext > 0){
+            return written;
+        }
+    }
+    for (uint16_t offset = 0; offset < count && dirtyCount > 0 && written < maxRecords; ++offset){
+        if (dirty[offset >> 3] == 0){
+            offset |= 7;
+            continue;
+        }
+        if (!(dirty[offset >> 3] & (1 << (offset & 7)))){
+            continue;
+        }
+        //Space for the next snapshot must stay free
+        if (freeSlots < count + 1){
+            return written + writeSnapshot(maxRecords - written);
+        }
+        uint16_t value = 0;
+        server->copyFromHoldingRegisters(&value, 1, first + offset);
+        if (!appendRecord(offset, value)){
+            break;
+        }
+        --freeSlots;
+        dirty[offset >> 3] &= ~(1 << (offset & 7));
+        --dirtyCount;
+        ++written;
+    }
+    return written;
+}
+
+uint16_t ModbusJournalBase::flush(){
+    //Snapshot in progress is continued without delay
+    if (snapshotNext == 0 && (dirtyCount == 0 || millis() - pendingSince < MODBUS_JOURNAL_DELAY_MS)){
+        return 0;
+    }
+    uint16_t written = writeDirty(MODBUS_JOURNAL_BATCH);
+    if (written > 0 && storage->commit != NULL){
+        storage->commit(storage->ctx);
+    }
+    return written;
+}
+
+void ModbusJournalBase::sync(){
+    uint16_t written = 0;
+    while (dirtyCount > 0 || snapshotNext > 0){
+        uint16_t batch = writeDirty(count);
+        if (batch == 0){
+            break; //Storage error
+        }
+        written += batch;
+    }
+    if (written > 0 && storage->commit != NULL){
+        storage->commit(storage->ctx);
+    }
+}
+
+#if defined(__linux__)
+
+ModbusFileStorage::ModbusFileStorage(){
+    storage.size = 0;
+    storage.read = fileRead;
+    storage.write = fileWrite;
+    storage.commit = fileCommit;
+    storage.ctx = this;
+}
+
+bool ModbusFileStorage::open(const char* path, uint32_t size){
+    close();
+    fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0){
+        return false;
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0 || ((uint64_t)status.st_size < size && ftruncate(fd, size) != 0)){
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    void* mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED){
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    data = (uint8_t*)mapped;
+    if ((uint64_t)status.st_size < size){
+        memset(data + status.st_size, 0xFF, size - status.st_size);
+    }
+    storage.size = size;
+    return true;
+}
+
+void ModbusFileStorage::close(){
+    if (data != NULL){
+        msync(data, storage.size, MS_SYNC);
+        munmap(data, storage.size);
+        data = NULL;
+        storage.size = 0;
+    }
+    if (fd >= 0){
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+bool ModbusFileStorage::fileRead(uint32_t address, void* buffer, uint16_t length, void* ctx){
+    ModbusFileStorage* file = (ModbusFileStorage*)ctx;
+    if (file->data == NULL || (uint64_t)address + length > file->storage.size){
+        return false;
+    }
+    memcpy(buffer, file->data + address, length);
+    return true;
+}
+
+bool ModbusFileStorage::fileWrite(uint32_t address, const void* buffer, uint16_t length, void* ctx){
+    ModbusFileStorage* file = (ModbusFileStorage*)ctx;
+    if (file->data == NULL || (uint64_t)address + length > file->storage.size){
+        return false;
+    }
+    memcpy(file->data + address, buffer, length);
+    return true;
+}
+
+void ModbusFileStorage::fileCommit(void* ctx){
+    ModbusFileStorage* file = (ModbusFileStorage*)ctx;
+    if (file->data != NULL){
+        msync(file->data, file->storage.size, MS_ASYNC);
+    }
+}
+
+#endif
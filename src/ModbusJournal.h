@@ -0,0 +1,185 @@
+#ifndef MODBUS_JOURNAL_H
+#define MODBUS_JOURNAL_H
+
+#include "ModbusRTU.h"
+
+/*Write-behind persistence of holding registers. Writes by requests only flag registers in RAM (bitmap),
+so response is not delayed. flush() called from the main loop later writes flagged registers (their current
+values, several writes of one register are written once) into non-volatile storage in batches.
+Storage is a ring of records (register, value), written sequentially over the whole area, so every cell
+is written once per pass (wear levelling). Ring also holds complete snapshot of journaled registers, which
+is rewritten when free space runs out, so the latest value of each register is always in the ring.
+Snapshot is written in batches too (previous snapshot stays valid until the new one is complete).
+begin() reads the ring once and restores registers from the last complete snapshot and records written
+after it. Interrupted write (power loss) leaves record with invalid CRC, which is ignored.
+Storage must have room for at least 2 * Count + 2 records (MODBUS_JOURNAL_RECORD_LEN bytes each).
+
+Example (EEPROM of AVR, registers 10-25 are persisted):
+    static bool eepromRead(uint32_t address, void* data, uint16_t length, void* ctx){
+        eeprom_read_block(data, (const void*)address, length); return true;}
+    static bool eepromWrite(uint32_t address, const void* data, uint16_t length, void* ctx){
+        eeprom_update_block(data, (void*)address, length); return true;}
+    ModbusStorage eeprom = {1024, eepromRead, eepromWrite, NULL, NULL};
+    ModbusJournal<16> journal;
+
+    setup(): journal.begin(modbus, &eeprom, 10); modbus.startModbusServer(1, 19200);
+    loop(): modbus.communicationLoop(); journal.flush();
+*/
+
+//Adjust if necessary
+#define MODBUS_JOURNAL_DELAY_MS 1000 //Flagged registers are written this long after the first write (writes are batched)
+#define MODBUS_JOURNAL_BATCH 8 //Max number of records written by one flush() call
+
+#define MODBUS_JOURNAL_RECORD_LEN 8
+#define MODBUS_JOURNAL_SNAPSHOT 0x8000 //Flag of register field, which marks records of snapshot
+
+//Non-volatile storage (EEPROM, flash with byte writes, memory-mapped file)
+typedef struct {
+    uint32_t size; //Size in bytes
+    bool (*read)(uint32_t address, void* data, uint16_t length, void* ctx);
+    bool (*write)(uint32_t address, const void* data, uint16_t length, void* ctx);
+    void (*commit)(void* ctx); //Called after batch of writes (i.e. EEPROM.commit() of ESP), may be NULL
+    void* ctx;
+} ModbusStorage;
+
+typedef struct {
+    uint16_t sequence; //Incremented by each record (wraps around)
+    uint16_t offset; //Register (offset in journaled block), MODBUS_JOURNAL_SNAPSHOT flag
+    uint16_t value;
+    uint16_t crc; //CRC of previous fields
+} ModbusJournalRecord;
+
+//Journal logic shared by all sizes (flags of registers are provided by ModbusJournal template)
+class ModbusJournalBase{
+
+    private:
+    ModbusRTUBase* server = NULL;
+    const ModbusStorage* storage = NULL;
+    uint8_t* dirty;
+    uint16_t count;
+    uint16_t first = 0; //Bank address of first journaled register
+    uint16_t dirtyCount = 0;
+    unsigned long pendingSince = 0; //Time of the first write, which is not flushed yet
+    uint16_t capacity = 0; //Number of records in storage
+    uint16_t head = 0; //Slot of next record
+    uint16_t freeSlots = 0; //Slots, which may be overwritten (older than the last complete snapshot)
+    uint16_t sequence = 0; //Sequence number of next record
+    uint16_t snapshotCount = 0;
+    uint16_t snapshotNext = 0; //Register of next record of snapshot in progress, 0 if none is in progress
+    uint16_t snapshotStart = 0; //Slot of the first record of snapshot in progress
+
+    protected:
+    ModbusJournalBase(uint8_t* dirtyFlags, uint16_t registerCount) : dirty(dirtyFlags), count(registerCount){}
+
+    public:
+    /**
+     * @brief Restores journaled registers from storage and starts journaling writes of server
+     * (holding written function of server is used). Call before startModbusServer().
+     *
+     * @param modbusServer Server
+     * @param nvStorage Storage (must exist as long as the journal)
+     * @param firstRegister Bank address of first journaled holding register
+     * @return Number of restored registers, -1 if storage is too small
+     */
+    int32_t begin(ModbusRTUBase& modbusServer, const ModbusStorage* nvStorage, uint16_t firstRegister = 0);
+
+    /**
+     * @brief Writes flagged registers (at most MODBUS_JOURNAL_BATCH records), once MODBUS_JOURNAL_DELAY_MS
+     * elapsed since the first write. Call from the main loop.
+     *
+     * @return Number of records written
+     */
+    uint16_t flush();
+
+    /**
+     * @brief Writes all flagged registers (and finishes snapshot in progress) immediately (i.e. before planned reset)
+     */
+    void sync();
+
+    /**
+     * @brief Flags registers changed by application (writes of requests are flagged automatically)
+     *
+     * @param firstRegister Bank address of first register
+     * @param registerCount Number of registers
+     */
+    void markWritten(uint16_t firstRegister, uint16_t registerCount);
+
+    /**
+     * @brief Number of flagged registers, which were not written yet
+     */
+    uint16_t pendingCount(){return dirtyCount;}
+
+    /**
+     * @brief Number of snapshots written since begin() (each rewrites all journaled registers)
+     */
+    uint16_t getSnapshotCount(){return snapshotCount;}
+
+    private:
+    static void holdingWritten(uint16_t firstRegister, uint16_t registerCount, void* ctx);
+    bool readRecord(uint16_t slot, ModbusJournalRecord* record);
+    bool appendRecord(uint16_t offset, uint16_t value);
+    uint16_t writeSnapshot(uint16_t maxRecords);
+    uint16_t writeDirty(uint16_t maxRecords);
+};
+
+/**
+ * @brief Journal of Count holding registers (one bit of RAM per register)
+ */
+template<uint16_t Count>
+class ModbusJournal : public ModbusJournalBase{
+
+    private:
+    uint8_t dirtyFlags[(Count + 7) / 8] = {};
+
+    public:
+    ModbusJournal() : ModbusJournalBase(dirtyFlags, Count){}
+    ModbusJournal(const ModbusJournal&) = delete;
+    ModbusJournal& operator=(const ModbusJournal&) = delete;
+};
+
+#if defined(__linux__)
+
+/*Storage in memory-mapped file for Linux builds. New file is filled by 0xFF (as erased flash).
+Writes go to page cache, commit starts asynchronous write-back, close() waits until data are on disk.
+*/
+class ModbusFileStorage{
+
+    private:
+    ModbusStorage storage;
+    uint8_t* data = NULL;
+    int fd = -1;
+
+    public:
+    ModbusFileStorage();
+    ~ModbusFileStorage(){close();}
+    ModbusFileStorage(const ModbusFileStorage&) = delete;
+    ModbusFileStorage& operator=(const ModbusFileStorage&) = delete;
+
+    /**
+     * @brief Opens (or creates) file of given size and maps it
+     *
+     * @param path Path of file
+     * @param size Size in bytes
+     * @return Whether file was mapped (errno is set otherwise)
+     */
+    bool open(const char* path, uint32_t size);
+
+    /**
+     * @brief Writes mapped data to disk and unmaps file
+     */
+    void close();
+
+    /**
+     * @brief Storage for ModbusJournal::begin()
+     */
+    const ModbusStorage* getStorage(){return &storage;}
+
+    private:
+    static bool fileRead(uint32_t address, void* buffer, uint16_t length, void* ctx);
+    static bool fileWrite(uint32_t address, const void* buffer, uint16_t length, void* ctx);
+    static void fileCommit(void* ctx);
+};
+
+#endif
+
+#endif
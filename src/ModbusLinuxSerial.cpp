@@ -0,0 +1,231 @@
+#include "ModbusLinuxSerial.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+#define LINUX_SERIAL_WRITE_TIMEOUT 1000 //Milliseconds
+
+/**
+ * @brief Finds termios constant of baud rate
+ * 
+ * @param baudRate Baud rate
+ * @return speed_t Termios constant, B0 if baud rate is not standard
+ */
+static speed_t linuxBaudConstant(unsigned long baudRate){
+    static const struct {
+        unsigned long baudRate;
+        speed_t constant;
+    } rates[] = {
+        {1200, B1200}, {2400, B2400}, {4800, B4800}, {9600, B9600}, {19200, B19200}, {38400, B38400},
+        {57600, B57600}, {115200, B115200}, {230400, B230400}, {460800, B460800}, {921600, B921600}
+    };
+    for (uint8_t i = 0; i < sizeof(rates) / sizeof(rates[0]); ++i){
+        if (rates[i].baudRate == baudRate){
+            return rates[i].constant;
+        }
+    }
+    return B0;
+}
+
+ModbusLinuxSerial::ModbusLinuxSerial(){
+    initSerialCtx(&frame, NULL, 0);
+    frame.frameLength = modbusRequestLength;
+    frame.addressFilter = NULL;
+    frame.trafficHook = NULL;
+}
+
+bool ModbusLinuxSerial::begin(const char* device, unsigned long baudRate, uint8_t parity){
+    end();
+    if (linuxBaudConstant(baudRate) == B0){
+        errno = EINVAL;
+        return false;
+    }
+    int descriptor = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (descriptor < 0){
+        return false;
+    }
+    return begin(descriptor, baudRate, parity);
+}
+
+bool ModbusLinuxSerial::begin(int descriptor, unsigned long baudRate, uint8_t parity){
+    end();
+    fd = descriptor;
+    speed_t speed = linuxBaudConstant(baudRate);
+    if (speed == B0 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0){
+        end();
+        errno = EINVAL;
+        return false;
+    }
+
+    struct termios options;
+    if (tcgetattr(fd, &options) != 0){
+        end();
+        return false;
+    }
+    cfmakeraw(&options);
+    options.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
+    options.c_cflag |= CS8 | CREAD | CLOCAL;
+    if (parity == MODBUS_PARITY_NONE){
+        options.c_cflag |= CSTOPB;
+    }
+    else {
+        options.c_cflag |= PARENB | (parity == MODBUS_PARITY_ODD ? PARODD : 0);
+    }
+    options.c_iflag &= ~(IXON | IXOFF | IXANY | INPCK);
+    //Reads never block, silent intervals are measured by timestamps of reads
+    options.c_cc[VMIN] = 0;
+    options.c_cc[VTIME] = 0;
+    cfsetispeed(&options, speed);
+    cfsetospeed(&options, speed);
+    if (tcsetattr(fd, TCSANOW, &options) != 0){
+        end();
+        return false;
+    }
+
+    //Kernel delivers received bytes immediately (not supported by all drivers, i.e. pseudo-terminals)
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) == 0){
+        serial.flags |= ASYNC_LOW_LATENCY;
+        ioctl(fd, TIOCSSERIAL, &serial);
+    }
+    tcflush(fd, TCIOFLUSH);
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epollFd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0){
+        end();
+        return false;
+    }
+
+    uint16_t (*frameLength)(const uint8_t*, uint16_t) = frame.frameLength;
+    initSerialCtx(&frame, NULL, baudRate);
+    frame.frameLength = frameLength;
+    chunkLength = 0;
+    chunkPosition = 0;
+    return true;
+}
+
+void ModbusLinuxSerial::end(){
+    if (epollFd >= 0){
+        close(epollFd);
+        epollFd = -1;
+    }
+    if (fd >= 0){
+        close(fd);
+        fd = -1;
+    }
+}
+
+int ModbusLinuxSerial::wait(int timeout){
+    if (chunkPosition < chunkLength){
+        //Rest of previous read is waiting
+        return 1;
+    }
+    if (frame.state != FRAME_IDLE){
+        //Wake up when t3.5 elapses, so the frame is finished without delay
+        unsigned long silence = micros() - frame.lastTimestamp;
+        int remaining = silence >= frame.interFrameTimeout ? 0 : (int)((frame.interFrameTimeout - silence + 999) / 1000);
+        if (timeout < 0 || remaining < timeout){
+            timeout = remaining;
+        }
+    }
+
+    struct epoll_event event;
+    int result;
+    do {
+        result = epoll_wait(epollFd, &event, 1, timeout);
+    } while (result < 0 && errno == EINTR);
+    return result;
+}
+
+/**
+ * @brief Serial read function of Linux tty
+ * Bytes delivered by one read are appended to frame with the same timestamp. Silence between reads
+ * (less transmission time of the chunk) longer than t3.5 finishes the frame, silence longer than t1.5
+ * before single byte makes it invalid.
+ * @param buffer Buffer where data will be stored (preserved between calls)
+ * @param ctx ModbusLinuxSerial object
+ * @return uint16_t Length of received frame, 0 if none is complete
+ */
+uint16_t ModbusLinuxSerial::linuxSerialReadFunction(char* buffer, void* ctx){
+    ModbusLinuxSerial* port = (ModbusLinuxSerial*)ctx;
+    SerialCtx* frame = &port->frame;
+
+    if (port->chunkPosition == port->chunkLength){
+        ssize_t count = read(port->fd, port->chunk, sizeof(port->chunk));
+        unsigned long currentTimestamp = micros();
+        if (count <= 0){
+            if (frame->state != FRAME_IDLE && currentTimestamp - frame->lastTimestamp >= frame->interFrameTimeout){
+                return modbusFrameEnd(frame);
+            }
+            return 0;
+        }
+        port->chunkLength = (uint16_t)count;
+        port->chunkPosition = 0;
+        modbusObserveTraffic(frame->trafficHook, MODBUS_TRAFFIC_RX, currentTimestamp, port->chunk, port->chunkLength);
+
+        if (frame->state != FRAME_IDLE){
+            //Read happens after the last byte of chunk arrived, time of its other bytes is not silence
+            //(UART FIFO and USB adapters deliver continuous frame in several chunks)
+            unsigned long silence = currentTimestamp - frame->lastTimestamp;
+            unsigned long transmission = (unsigned long)(count - 1) * frame->charTime;
+            silence = silence > transmission ? silence - transmission : 0;
+            if (silence >= frame->interFrameTimeout){
+                //Chunk starts next frame, it is appended by next call
+                frame->lastTimestamp = currentTimestamp;
+                return modbusFrameEnd(frame);
+            }
+            //Arrival of bytes inside chunk is not known, t1.5 is checked only for single bytes
+            if (count == 1 && silence >= frame->interCharTimeout && frame->state != FRAME_SKIPPING){
+                frame->state = FRAME_DISCARDING;
+            }
+        }
+        frame->lastTimestamp = currentTimestamp;
+    }
+
+    while (port->chunkPosition < port->chunkLength){
+        uint16_t result = modbusFrameAppendByte(frame, buffer, port->chunk[port->chunkPosition++]);
+        if (result != 0){
+            return result;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Serial write function of Linux tty, blocks until the whole frame is queued
+ * @param buffer Buffer which holds data to be sent
+ * @param length Length of data to be sent
+ * @param ctx ModbusLinuxSerial object
+ */
+void ModbusLinuxSerial::linuxSerialWriteFunction(const char* buffer, uint16_t length, void* ctx){
+    ModbusLinuxSerial* port = (ModbusLinuxSerial*)ctx;
+    while (length > 0){
+        ssize_t written = write(port->fd, buffer, length);
+        if (written < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            struct pollfd output = {port->fd, POLLOUT, 0};
+            if (errno != EAGAIN || poll(&output, 1, LINUX_SERIAL_WRITE_TIMEOUT) <= 0){
+                return;
+            }
+            continue;
+        }
+        buffer += written;
+        length -= (uint16_t)written;
+    }
+}
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef MODBUS_LINUX_SERIAL_H
+#define MODBUS_LINUX_SERIAL_H
+
+#include "ModbusRTU.h"
+
+#if defined(__linux__)
+
+/*Native serial port backend for Linux (gateways, SBCs). Tty is configured by termios (raw, 8E1 by default)
+and read without blocking, bytes delivered by kernel in one read are timestamped together, so silent
+intervals (t1.5, t3.5) are measured from arrival of bytes. wait() sleeps in epoll until bytes arrive
+or until pending frame is finished by t3.5 silence, so loop
+    while (true){
+        serial.wait(-1);
+        modbus.communicationLoop();
+    }
+reads every chunk as soon as kernel delivers it and uses no CPU while the line is idle.
+VMIN and VTIME are 0, as VTIME (1/10 s) is too coarse for silent intervals. Low latency mode of UART
+driver is requested (for USB adapters, latency_timer of FTDI driver may need to be lowered too).
+
+Example:
+    ModbusLinuxSerial serial;
+    if (!serial.begin("/dev/ttyUSB0", 19200)){
+        perror("/dev/ttyUSB0");
+    }
+    serial.attach(modbus);
+    modbus.startModbusServer(1, 0);
+*/
+
+//Parity of line (argument of begin())
+#define MODBUS_PARITY_NONE 0 //Two stop bits are used instead (as required by standard)
+#define MODBUS_PARITY_EVEN 1
+#define MODBUS_PARITY_ODD 2
+
+class ModbusLinuxSerial{
+
+    private:
+    int fd = -1;
+    int epollFd = -1;
+    SerialCtx frame; //Frame assembler state, timing and counters of dropped frames
+    //Bytes of the last read, which were not appended yet (frame was completed in the middle of chunk)
+    uint8_t chunk[MODBUS_MAX_FRAME_LEN];
+    uint16_t chunkLength = 0;
+    uint16_t chunkPosition = 0;
+
+    public:
+    ModbusLinuxSerial();
+    ~ModbusLinuxSerial(){end();}
+    ModbusLinuxSerial(const ModbusLinuxSerial&) = delete;
+    ModbusLinuxSerial& operator=(const ModbusLinuxSerial&) = delete;
+
+    /**
+     * @brief Opens and configures tty
+     *
+     * @param device Path of tty (i.e. /dev/ttyUSB0, or slave side of pseudo-terminal)
+     * @param baudRate Communication baud rate (standard rates only)
+     * @param parity MODBUS_PARITY_EVEN, MODBUS_PARITY_ODD or MODBUS_PARITY_NONE
+     * @return Whether port was opened (errno is set otherwise)
+     */
+    bool begin(const char* device, unsigned long baudRate, uint8_t parity = MODBUS_PARITY_EVEN);
+
+    /**
+     * @brief Configures already opened tty (i.e. master side of pseudo-terminal), descriptor is closed by end()
+     *
+     * @param descriptor File descriptor of tty (switched to non-blocking mode)
+     * @param baudRate Communication baud rate (standard rates only)
+     * @param parity MODBUS_PARITY_EVEN, MODBUS_PARITY_ODD or MODBUS_PARITY_NONE
+     * @return Whether port was configured (errno is set otherwise)
+     */
+    bool begin(int descriptor, unsigned long baudRate, uint8_t parity = MODBUS_PARITY_EVEN);
+
+    /**
+     * @brief Closes tty
+     */
+    void end();
+
+    /**
+     * @brief Sets read and write functions of server or port (ModbusRTUBase, ModbusPort, ModbusMaster).
+     * Frames of devices not served by server are skipped (see ModbusAddressFilter).
+     * Master must also set modbusResponseLength by setFrameLengthFunction().
+     */
+    template<typename Port>
+    void attach(Port& port){
+        frame.addressFilter = port.getAddressFilter();
+        frame.trafficHook = port.getTrafficHook();
+        port.setSerialReadFunction(linuxSerialReadFunction, this);
+        port.setSerialWriteFunction(linuxSerialWriteFunction, this);
+        port.setFrameCtx(&frame);
+    }
+
+    /**
+     * @brief Waits until bytes are received, or until pending frame is finished by t3.5 silence
+     *
+     * @param timeout Timeout in milliseconds, -1 to wait forever
+     * @return int Positive if bytes were received, 0 on timeout (or end of frame), -1 on error
+     */
+    int wait(int timeout);
+
+    /**
+     * @brief Sets function predicting length of frame from its header (modbusRequestLength by default)
+     */
+    void setFrameLengthFunction(uint16_t (*frameLength)(const uint8_t* frame, uint16_t length)){frame.frameLength = frameLength;}
+
+    /**
+     * @brief File descriptor of tty (i.e. to be added to epoll set of application), -1 if not opened
+     */
+    int getFd(){return fd;}
+
+    /**
+     * @brief Frame assembler state (timing and counters of dropped frames, see SerialCtx)
+     */
+    const SerialCtx* getSerialCtx(){return &frame;}
+
+    static uint16_t linuxSerialReadFunction(char* buffer, void* ctx);
+    static void linuxSerialWriteFunction(const char* buffer, uint16_t length, void* ctx);
+};
+
+#endif
+
+#endif
@@ -0,0 +1,230 @@
+#include "ModbusMaster.h"
+
+
+ModbusMaster::ModbusMaster(){
+    //Frame assembler accepts responses as soon as their last byte arrives
+    defaultSerialCtx.frameLength = modbusResponseLength;
+}
+
+void ModbusMaster::startModbusMaster(unsigned long baudRate){
+    if (defaultSerialCtx.serial == NULL){
+        defaultSerialCtx.serial = &Serial;
+        Serial.begin(baudRate, SERIAL_8E1);
+    }
+    begin(baudRate);
+}
+
+void ModbusMaster::setPolls(ModbusPoll* pollList, uint8_t count){
+    polls = pollList;
+    pollCount = count;
+    nextPoll = 0;
+    activePoll = -1;
+    unsigned long now = millis();
+    for (uint8_t i = 0; i < count; ++i){
+        ModbusPoll* poll = &polls[i];
+        poll->status = POLL_PENDING;
+        poll->exception = 0;
+        poll->noMerge = false;
+        //All polls are due immediately
+        poll->lastRequest = now - poll->period;
+        poll->lastUpdate = 0;
+        poll->cycleTime = 0;
+        poll->responseTime = 0;
+        poll->updates = 0;
+        poll->errors = 0;
+    }
+    planRequests();
+}
+
+/**
+ * @brief Sorts polls and merges polls of the same slave and function code into requests
+ */
+void ModbusMaster::planRequests(){
+    //Insertion sort (by slave, function code and address), list is short and mostly sorted
+    for (uint8_t i = 1; i < pollCount; ++i){
+        ModbusPoll poll = polls[i];
+        uint32_t key = ((uint32_t)poll.slave << 24) | ((uint32_t)poll.functionCode << 16) | poll.first;
+        uint8_t j = i;
+        while (j > 0 && (((uint32_t)polls[j - 1].slave << 24) | ((uint32_t)polls[j - 1].functionCode << 16) |
+            polls[j - 1].first) > key){
+            polls[j] = polls[j - 1];
+            --j;
+        }
+        polls[j] = poll;
+    }
+
+    uint8_t i = 0;
+    while (i < pollCount){
+        ModbusPoll* leader = &polls[i];
+        uint32_t end = (uint32_t)leader->first + leader->count;
+        unsigned long period = leader->period;
+        uint8_t merged = 1;
+        while (i + merged < pollCount && !leader->noMerge){
+            ModbusPoll* poll = &polls[i + merged];
+            uint32_t pollEnd = (uint32_t)poll->first + poll->count;
+            uint32_t blockEnd = pollEnd > end ? pollEnd : end;
+            if (poll->noMerge || poll->slave != leader->slave || poll->functionCode != leader->functionCode ||
+                poll->first > end + mergeGap || blockEnd - leader->first > MAX_READ_REGISTER_COUNT){
+                break;
+            }
+            end = blockEnd;
+            if (poll->period < period){
+                period = poll->period;
+            }
+            poll->blockPolls = 0;
+            ++merged;
+        }
+        leader->blockPolls = merged;
+        leader->blockCount = end - leader->first;
+        leader->blockPeriod = period;
+        i += merged;
+    }
+}
+
+/**
+ * @brief Sends request of the first due poll (round robin), bus must be idle
+ *
+ * @return Whether request was sent
+ */
+bool ModbusMaster::sendNextRequest(){
+    //Request must be preceded by t3.5 silence
+    unsigned long lastByteTimestamp = rxRing != NULL ? rxRing->lastByteTimestamp : defaultSerialCtx.lastTimestamp;
+    if (pollCount == 0 || micros() - lastByteTimestamp < defaultSerialCtx.interFrameTimeout){
+        return false;
+    }
+
+    unsigned long now = millis();
+    for (uint8_t i = 0; i < pollCount; ++i){
+        uint8_t index = (uint8_t)(((uint16_t)nextPoll + i) % pollCount);
+        ModbusPoll* poll = &polls[index];
+        if (poll->blockPolls == 0 || now - poll->lastRequest < poll->blockPeriod){
+            continue;
+        }
+
+        //Request is built in frame buffer (response is received to the same buffer)
+        rxFrame.address = poll->slave;
+        rxFrame.function_code = poll->functionCode;
+        rxFrame.first_register = endianity_swap_16bit(poll->first);
+        rxFrame.register_count = endianity_swap_16bit(poll->blockCount);
+        poll->lastRequest = now;
+        activePoll = index;
+        nextPoll = (uint8_t)(((uint16_t)index + 1) % pollCount);
+        requestTimestamp = micros();
+        sendFrame(MODBUS_REQUEST_BASE_LENGTH);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Finishes active request with error
+ *
+ * @param status Status of polls read by request
+ * @param exception Exception code (POLL_EXCEPTION only)
+ */
+void ModbusMaster::finishRequest(uint8_t status, uint8_t exception){
+    ModbusPoll* poll = &polls[activePoll];
+    for (uint8_t i = 0; i < poll->blockPolls; ++i){
+        poll[i].status = status;
+        poll[i].exception = exception;
+        ++poll[i].errors;
+    }
+    activePoll = -1;
+}
+
+/**
+ * @brief Handles frame received while waiting for response
+ *
+ * @param result Result of read function (length | MODBUS_FRAME_CRC_OK)
+ * @return int16_t Index of the first updated poll, -1 if none
+ */
+int16_t ModbusMaster::handleResponse(uint16_t result){
+    uint16_t length = result & ~MODBUS_FRAME_CRC_OK;
+    ModbusPoll* poll = &polls[activePoll];
+    const uint8_t* frame = (const uint8_t*)rxFrame.raw_data;
+
+    if (frame[0] != poll->slave){
+        //Frame of other device, keep waiting
+        return -1;
+    }
+    if (!(result & MODBUS_FRAME_CRC_OK) && !calculateCRC(rxFrame.raw_data, length - CRC_LEN, false)){
+        finishRequest(POLL_INVALID_RESPONSE, 0);
+        return -1;
+    }
+    if (frame[1] == (poll->functionCode | 0x80) && length == MODBUS_RESPONSE_BASE_LEN + CRC_LEN){
+        if (frame[2] == EX_ILLEGAL_ADDRESS && poll->blockPolls > 1){
+            //Merged block is not mapped on slave as a whole, polls are read separately from now on
+            //(all of them immediately, the leader must not wait a period for the failed merged request)
+            unsigned long now = millis();
+            for (uint8_t i = 0; i < poll->blockPolls; ++i){
+                poll[i].noMerge = true;
+                poll[i].lastRequest = now - poll[i].period;
+            }
+            activePoll = -1;
+            planRequests();
+            return -1;
+        }
+        finishRequest(POLL_EXCEPTION, frame[2]);
+        return -1;
+    }
+    if (frame[1] != poll->functionCode || frame[2] != poll->blockCount * 2 ||
+        length != MODBUS_RESPONSE_BASE_LEN + frame[2] + CRC_LEN){
+        finishRequest(POLL_INVALID_RESPONSE, 0);
+        return -1;
+    }
+
+    unsigned long now = micros();
+    for (uint8_t i = 0; i < poll->blockPolls; ++i){
+        ModbusPoll* member = &poll[i];
+        const uint8_t* data = frame + MODBUS_RESPONSE_BASE_LEN + 2 * (member->first - poll->first);
+        if (member->destination != NULL){
+            for (uint16_t r = 0; r < member->count; ++r){
+                member->destination[r] = ((uint16_t)data[2 * r] << 8) | data[2 * r + 1];
+            }
+        }
+        if (member->updates > 0){
+            member->cycleTime = now - member->lastUpdate;
+        }
+        member->lastUpdate = now;
+        member->responseTime = now - requestTimestamp;
+        member->status = POLL_OK;
+        member->exception = 0;
+        ++member->updates;
+    }
+    int16_t updated = activePoll;
+    activePoll = -1;
+    return updated;
+}
+
+/**
+ * @brief Main communication loop. Call this function periodically.
+ *
+ * @return int16_t Index of the first poll updated by received response, -1 if none
+ */
+int16_t ModbusMaster::communicationLoop(){
+    int16_t updated = -1;
+    uint16_t result = receiveFrame();
+    if (activePoll != -1){
+        if (result != 0){
+            updated = handleResponse(result);
+        }
+        else if (!txBusy && micros() - requestTimestamp >= responseTimeout){
+            finishRequest(POLL_TIMEOUT, 0);
+        }
+    }
+    //Next request follows the response immediately (after t3.5 silence)
+    if (activePoll == -1 && !txBusy){
+        sendNextRequest();
+    }
+    return updated;
+}
+
+unsigned long ModbusMaster::getSlaveCycleTime(uint8_t slave){
+    unsigned long cycleTime = 0;
+    for (uint8_t i = 0; i < pollCount; ++i){
+        if (polls[i].slave == slave && polls[i].cycleTime > cycleTime){
+            cycleTime = polls[i].cycleTime;
+        }
+    }
+    return cycleTime;
+}
@@ -0,0 +1,121 @@
+#ifndef MODBUS_MASTER_H
+#define MODBUS_MASTER_H
+
+#include "ModbusRTU.h"
+
+/*Modbus RTU master (client). Registers of slaves are read periodically by poll scheduler, which is driven
+by communicationLoop() and never blocks. Polls of the same slave and function code, which are adjacent
+or separated by at most merge gap registers, are read by single request (up to MAX_READ_REGISTER_COUNT
+registers). If slave rejects merged request with illegal address exception (gap is not mapped on slave),
+its polls are read separately from then on. Next request is sent as soon as previous response completes
+and t3.5 silence elapses. Master is a ModbusPort, so serial port is configured in the same way as ports of server.
+
+Example (two polls of slave 3 are merged into one request of registers 0-19):
+    ModbusPoll polls[] = {
+        {3, FC_READ_HOLDING_REGISTERS, 0, 10, values, 100},
+        {3, FC_READ_HOLDING_REGISTERS, 12, 8, values + 10, 100},
+        {7, FC_READ_INPUT_REGISTERS, 100, 4, meter, 1000},
+    };
+    master.setPolls(polls, 3);
+    master.startModbusMaster(19200);
+*/
+
+//Adjust if necessary
+#define MODBUS_MASTER_RESPONSE_TIMEOUT 100UL //Milliseconds
+//Max number of unrequested registers read to merge two polls. Gap of 8 registers costs less line time than
+//separate request up to 38400 baud (master_bench), at 115200 baud fixed t3.5 makes larger gaps pay off.
+#define MODBUS_MASTER_MERGE_GAP 8
+
+//Status of poll
+#define POLL_PENDING 0 //Not read yet
+#define POLL_OK 1
+#define POLL_TIMEOUT 2
+#define POLL_EXCEPTION 3 //Exception code is in exception field
+#define POLL_INVALID_RESPONSE 4
+
+typedef struct {
+    //Set by user
+    uint8_t slave;
+    uint8_t functionCode; //FC_READ_HOLDING_REGISTERS or FC_READ_INPUT_REGISTERS
+    uint16_t first;
+    uint16_t count;
+    uint16_t* destination; //Read registers are stored here (in host byte order)
+    unsigned long period; //Milliseconds
+
+    //Set by master
+    uint8_t status;
+    uint8_t exception;
+    bool noMerge; //Poll is always read by its own request
+    uint8_t blockPolls; //Number of polls read by request of this poll (0 if read by request of previous poll)
+    uint16_t blockCount; //Number of registers read by request of this poll
+    unsigned long blockPeriod; //Shortest period of polls read by request of this poll
+    unsigned long lastRequest; //Time of last request (milliseconds)
+    unsigned long lastUpdate; //Time of last successful read (microseconds)
+    unsigned long cycleTime; //Time between two last successful reads (microseconds)
+    unsigned long responseTime; //Time from request to the end of response (microseconds)
+    uint32_t updates;
+    uint16_t errors;
+} ModbusPoll;
+
+class ModbusMaster : public ModbusPort{
+
+    private:
+    ModbusPoll* polls = NULL;
+    uint8_t pollCount = 0;
+    uint8_t nextPoll = 0; //Scheduling continues from this poll (round robin)
+    int16_t activePoll = -1; //Poll waiting for response, -1 if bus is idle
+    unsigned long requestTimestamp = 0; //Microseconds
+    unsigned long responseTimeout = MODBUS_MASTER_RESPONSE_TIMEOUT * 1000UL; //Microseconds
+    uint8_t mergeGap = MODBUS_MASTER_MERGE_GAP;
+
+    public:
+    ModbusMaster();
+
+    /**
+     * @brief Sets polls read by scheduler. Polls are sorted (by slave, function code and address)
+     * and merged into requests, array must exist as long as the master.
+     * @param pollList Array of polls
+     * @param count Number of polls
+     */
+    void setPolls(ModbusPoll* pollList, uint8_t count);
+
+    /**
+     * @brief Sets how long master waits for response before slave is considered not responding
+     * @param timeout Timeout in milliseconds
+     */
+    void setResponseTimeout(unsigned long timeout){responseTimeout = timeout * 1000UL;}
+
+    /**
+     * @brief Sets max number of unrequested registers read to merge two polls (0 merges only adjacent polls).
+     * Must be called before setPolls().
+     */
+    void setMergeGap(uint8_t gap){mergeGap = gap;}
+
+    /**
+     * @brief Sets master communication parameters
+     *
+     * @param baudRate Communication baud rate (Serial is initialized, unless custom serial port was set)
+     */
+    void startModbusMaster(unsigned long baudRate);
+
+    /**
+     * @brief Main loop for communication. Call this function periodically.
+     * @return int16_t Index of the first poll updated by received response, -1 if none
+     */
+    int16_t communicationLoop();
+
+    /**
+     * @brief Achieved poll cycle time of slave (the longest cycle time of its polls)
+     * @param slave Slave address
+     * @return unsigned long Cycle time in microseconds, 0 if slave was not read twice yet
+     */
+    unsigned long getSlaveCycleTime(uint8_t slave);
+
+    private:
+    void planRequests();
+    bool sendNextRequest();
+    int16_t handleResponse(uint16_t result);
+    void finishRequest(uint8_t status, uint8_t exception);
+};
+
+#endif
@@ -1,6 +1,78 @@
 #include "ModbusRTU.h"
 
 
+//Sequence lock (see ModbusRegisterSequence), sequence is NULL if bank is not protected
+static inline modbus_sequence_t sequenceReadBegin(volatile modbus_sequence_t* sequence){
+    modbus_sequence_t value = 0;
+    if (sequence != NULL){
+        //Odd value means that writer is in progress (in other thread)
+        while ((value = __atomic_load_n(sequence, __ATOMIC_ACQUIRE)) & 1);
+    }
+    return value;
+}
+
+static inline bool sequenceReadRetry(volatile modbus_sequence_t* sequence, modbus_sequence_t start){
+    if (sequence == NULL){
+        return false;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(sequence, __ATOMIC_RELAXED) != start;
+}
+
+static inline void sequenceWriteBegin(volatile modbus_sequence_t* sequence){
+    if (sequence != NULL){
+        __atomic_store_n(sequence, (modbus_sequence_t)(__atomic_load_n(sequence, __ATOMIC_RELAXED) + 1), __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+}
+
+static inline void sequenceWriteEnd(volatile modbus_sequence_t* sequence){
+    if (sequence != NULL){
+        __atomic_store_n(sequence, (modbus_sequence_t)(__atomic_load_n(sequence, __ATOMIC_RELAXED) + 1), __ATOMIC_RELEASE);
+    }
+}
+
+/*Packed bits are copied through 16-bit window (two adjacent bytes), so each byte takes one shift
+regardless of alignment of the first bit.
+*/
+//Copies count bits starting at bit first of source to destination starting at bit 0 (unused bits of the last byte are cleared)
+static void extractBits(uint8_t* destination, const uint8_t* source, uint16_t first, uint16_t count){
+    const uint8_t* from = source + (first >> 3);
+    uint8_t shift = first & 7;
+    uint16_t bytes = (count + 7) >> 3;
+    if (shift == 0){
+        memcpy(destination, from, bytes);
+    }
+    else {
+        //Byte after the last requested bit is never read (it may be outside of table)
+        uint16_t last = (shift + count - 1) >> 3;
+        for (uint16_t i = 0; i < bytes; ++i){
+            uint16_t window = from[i] | (i < last ? (uint16_t)from[i + 1] << 8 : 0);
+            destination[i] = (uint8_t)(window >> shift);
+        }
+    }
+    if (count & 7){
+        destination[bytes - 1] &= (1 << (count & 7)) - 1;
+    }
+}
+
+//Copies count bits starting at bit 0 of source to destination starting at bit first (other bits are preserved)
+static void insertBits(uint8_t* destination, uint16_t first, const uint8_t* source, uint16_t count){
+    uint8_t* to = destination + (first >> 3);
+    uint8_t shift = first & 7;
+    for (uint16_t i = 0; count > 0; ++i){
+        uint8_t bits = count < 8 ? count : 8;
+        uint16_t mask = ((1 << bits) - 1) << shift;
+        uint16_t window = ((uint16_t)source[i] << shift) & mask;
+        to[i] = (uint8_t)((to[i] & ~mask) | window);
+        if (mask >> 8){
+            to[i + 1] = (uint8_t)((to[i + 1] & ~(mask >> 8)) | (window >> 8));
+        }
+        count -= bits;
+    }
+}
+
+
 /**
  * @brief Calculates CRC for MODBUS message.
  * 
@@ -10,17 +82,9 @@
  * If true, CRC is calculated and stored at the end of message (return value is true).
  * @return Whether the CRCs match
  */
-bool ModbusRTU::calculateCRC(volatile uint8_t* packet_data, uint16_t length, bool response)
+bool ModbusPort::calculateCRC(volatile uint8_t* packet_data, uint16_t length, bool response)
 {
-	uint8_t xor0 = 0;
-	uint16_t crc = 0xFFFF;
-
-	for (uint16_t i = 0; i < length; ++i)
-	{
-		xor0 = packet_data[i] ^ crc;
-		crc >>= 8;
-		crc ^= crc_table[xor0];
-	}
+	uint16_t crc = modbusCRC16((const uint8_t*)packet_data, length);
 
 	if (response){
         //Stores at the end of packet
@@ -36,231 +100,1438 @@ bool ModbusRTU::calculateCRC(volatile uint8_t* packet_data, uint16_t length, boo
 
 //Response senders
 /**
- * @brief Sends response to received packet
+ * @brief Sends frame (response or request) from frame buffer, CRC is appended
  * 
- * @param packet_data Modbus packet in form of raw data
- * @param length Length of packet (in bytes, excluding CRC)
+ * @param length Length of frame in frame buffer (in bytes, excluding CRC)
  */
-void ModbusRTU::sendResponse(volatile uint8_t* packet_data, uint16_t length){
+void ModbusPort::sendFrame(uint16_t length){
+    volatile uint8_t* packet_data = rxFrame.raw_data;
     calculateCRC(packet_data, length, true);
+    modbusObserveTraffic(&trafficHook, MODBUS_TRAFFIC_TX, micros(), (const uint8_t*)packet_data, length + CRC_LEN);
+    if (driverEnablePin != -1){
+        digitalWrite(driverEnablePin, HIGH);
+    }
+
+    if (serialWriteSomeFunction != NULL){
+        //Asynchronous mode, the rest is sent from communicationLoop() or interrupt
+        txData = packet_data;
+        txRemaining = length + CRC_LEN;
+        txCompleteSignaled = false;
+        txBusy = true;
+        continueTransmit();
+        return;
+    }
+
     serialWriteFunction((const char*)packet_data, length + CRC_LEN, serialWriteCtx);
+    if (driverEnablePin != -1){
+        //Driver must stay enabled until the last bit leaves the line
+        if (serialTransmitDoneFunction != NULL){
+            while (!serialTransmitDoneFunction(serialWriteCtx));
+        }
+        digitalWrite(driverEnablePin, LOW);
+    }
+}
+
+/**
+ * @brief Feeds remaining bytes of response to serial port and finishes transmission
+ * when the last byte is sent
+ */
+void ModbusPort::continueTransmit(){
+    if (txRemaining > 0){
+        uint16_t written = serialWriteSomeFunction((const char*)txData, txRemaining, serialWriteCtx);
+        txData += written;
+        txRemaining -= written;
+        if (txRemaining > 0){
+            return;
+        }
+    }
+
+    if (txCompleteSignaled || 
+        (serialTransmitDoneFunction != NULL && serialTransmitDoneFunction(serialWriteCtx))){
+        if (driverEnablePin != -1){
+            digitalWrite(driverEnablePin, LOW);
+        }
+        txBusy = false;
+    }
+}
+
+void ModbusPort::transmitCompleteISR(){
+    if (txRemaining > 0){
+        //Transmit buffer ran empty between refills, frame is not finished
+        return;
+    }
+    if (txBusy){
+        if (driverEnablePin != -1){
+            digitalWrite(driverEnablePin, LOW);
+        }
+        txBusy = false;
+    }
+    txCompleteSignaled = true;
+}
+
+void ModbusPort::setDriverEnablePin(int16_t pin){
+    if (driverEnablePin != -1 && pin != driverEnablePin){
+        digitalWrite(driverEnablePin, LOW);
+    }
+    driverEnablePin = pin;
+    if (pin != -1){
+        pinMode(pin, OUTPUT);
+        digitalWrite(pin, LOW);
+    }
 }
 
 /**
- * @brief Sends error response when exception occured
+ * @brief Builds error response in place of request when exception occured
  * 
  * @param packet Modbus packet
  * @param error_code Code of exception
+ * @return uint16_t Length of response (in bytes, excluding CRC)
  */
-void ModbusRTU::sendErrorResponse(volatile request_packet* packet, uint8_t error_code){
-    uint8_t mb_response[MODBUS_RESPONSE_BASE_LEN + CRC_LEN] = {packet->address, (uint8_t)(packet->function_code | 0b10000000), error_code};
-    sendResponse(mb_response, MODBUS_RESPONSE_BASE_LEN);
+uint16_t ModbusRTUBase::buildErrorResponse(volatile request_packet* packet, uint8_t error_code){
+    packet->function_code |= 0b10000000;
+    packet->raw_data[2] = error_code;
+    return MODBUS_RESPONSE_BASE_LEN;
 }
 
 
 
 //Request handlers
 /**
- * @brief Handles Read Registers request and sends response
+ * @brief Handles Read Registers request. Response is built in place of request
+ * (header + one contiguous block of register data), so no other buffer is needed.
  * @param packet Modbus packet
+ * @param event Read event (may be NULL)
+ * @return uint16_t Length of response (in bytes, excluding CRC)
  */
-void ModbusRTU::readRegistersHandler(volatile request_packet* packet){
-    packet->first_register = endianity_swap_16bit(packet->first_register);
-    packet->register_count = endianity_swap_16bit(packet->register_count);
+uint16_t ModbusRTUBase::readRegistersHandler(volatile request_packet* packet, const ModbusEvent* event){
+    //Fields are overwritten by response
+    uint16_t firstRegister = endianity_swap_16bit(packet->first_register);
+    uint16_t registerCount = endianity_swap_16bit(packet->register_count);
 
     uint16_t* registers;
-    uint16_t registerNum;
-    void(*event) (uint8_t* buffer, uint16_t bufferLen, void* ctx);
-    void* eventCtx;
-
-    if (packet->function_code == FC_READ_INPUT_REGISTERS){
-        registers = inputRegisters;
-        registerNum = INPUT_REGISTER_NUM;
-        event = readInputRegistersEvent;
-        eventCtx = readInputRegistersEventCtx;
+    volatile modbus_sequence_t* sequence;
+    ModbusProvider* providers;
+    bool input = packet->function_code == FC_READ_INPUT_REGISTERS;
+    if (input){
+        registers = resolveInputRegisters(firstRegister, registerCount);
+        sequence = inputSequence();
+        providers = inputProviders;
     }
     else {
-        registers = holdingRegisters;
-        registerNum = HOLDING_REGISTER_NUM;
-        event = readHoldingRegistersEvent;
-        eventCtx = readHoldingRegistersEventCtx;
+        registers = resolveHoldingRegisters(firstRegister, registerCount);
+        sequence = holdingSequence();
+        providers = holdingProviders;
     }
 
 
-    if (packet->first_register + packet->register_count > registerNum || 
-        packet->register_count > MAX_READ_REGISTER_COUNT){
-        sendErrorResponse(packet, EX_ILLEGAL_ADDRESS);
+    if (registers == NULL || registerCount > MAX_READ_REGISTER_COUNT){
+        return buildErrorResponse(packet, EX_ILLEGAL_ADDRESS);
     }
-
-    uint8_t mb_response[MODBUS_RESPONSE_BASE_LEN + (packet->register_count * 2) + CRC_LEN] = {0};
-    mb_response[0] = packet->address;
-    mb_response[1] = packet->function_code;
-    mb_response[2] = packet->register_count * 2; //Number of bytes to follow
-    //Serial.print(inputRegisters[0], 10);
-    //Serial.flush();
-    //delay(10);
-
-    for (uint16_t i = 0; i < packet->register_count; ++i){
-        put_16bit_into_byte_buffer(mb_response, MODBUS_RESPONSE_BASE_LEN + (2 * i), endianity_swap_16bit(registers[packet->first_register + i]));
+    if (providers != NULL){
+        uint16_t bankFirst = firstRegister;
+        if (activeUnit != NULL){
+            bankFirst += input ? activeUnit->inputOffset : activeUnit->holdingOffset;
+        }
+        provideRegisters(providers, input, bankFirst, registerCount);
     }
 
+    uint8_t* response = (uint8_t*)packet->raw_data;
+    response[2] = registerCount * 2; //Number of bytes to follow
+    modbus_sequence_t start;
+    do {
+        start = sequenceReadBegin(sequence);
+        #if REGISTERS_IN_WIRE_ORDER
+            memcpy(response + MODBUS_RESPONSE_BASE_LEN, registers, registerCount * 2);
+        #else
+            for (uint16_t i = 0; i < registerCount; ++i){
+                put_16bit_into_byte_buffer(response, MODBUS_RESPONSE_BASE_LEN + (2 * i), endianity_swap_16bit(registers[i]));
+            }
+        #endif
+    } while (sequenceReadRetry(sequence, start));
 
-    if (event != NULL){
-        event(mb_response, MODBUS_RESPONSE_BASE_LEN + (packet->register_count * 2), eventCtx);
+    if (event != NULL && event->function != NULL){
+        event->function(response, MODBUS_RESPONSE_BASE_LEN + (registerCount * 2), event->ctx);
     }
 
-    sendResponse(mb_response, MODBUS_RESPONSE_BASE_LEN + (packet->register_count * 2));
+    return MODBUS_RESPONSE_BASE_LEN + (registerCount * 2);
 }
     
 
 /**
- * @brief Handles Write_Single_Register request and sends response.
+ * @brief Handles Write_Single_Register request. Response (echo of request) stays in place.
  * 
  * @param packet Modbus packet
- * @return int16_t Written value, -1 if error occured
+ * @param writtenValue Written value
+ * @param event Write event (may be NULL)
+ * @return uint16_t Length of response (in bytes, excluding CRC)
  */
-int16_t ModbusRTU::writeRegisterHandler(volatile request_packet* packet){
+uint16_t ModbusRTUBase::writeRegisterHandler(volatile request_packet* packet, int16_t* writtenValue, const ModbusEvent* event){
     packet->first_register = endianity_swap_16bit(packet->first_register);
     packet->single_register_data = endianity_swap_16bit(packet->single_register_data);
 
-    if (packet->first_register + 1 > HOLDING_REGISTER_NUM){
-        sendErrorResponse(packet, EX_ILLEGAL_ADDRESS);
-        return -1;
+    uint16_t* holdingRegister = resolveHoldingRegisters(packet->first_register, 1);
+    if (holdingRegister == NULL){
+        return buildErrorResponse(packet, EX_ILLEGAL_ADDRESS);
     }
 
-    if (writeHoldingRegisterEvent != NULL){
-        writeHoldingRegisterEvent((uint8_t*)packet, MODBUS_REQUEST_BASE_LENGTH, writeHoldingRegisterEventCtx);
+    if (event != NULL && event->function != NULL){
+        event->function((uint8_t*)packet, MODBUS_REQUEST_BASE_LENGTH, event->ctx);
     }
-    int16_t value = holdingRegisters[packet->first_register] = packet->single_register_data;
+    *writtenValue = packet->single_register_data;
+    sequenceWriteBegin(holdingSequence());
+    *holdingRegister = register_from_host(packet->single_register_data);
+    sequenceWriteEnd(holdingSequence());
+    notifyHoldingWrite(packet->first_register, 1);
 
     packet->first_register = endianity_swap_16bit(packet->first_register);
     packet->single_register_data = endianity_swap_16bit(packet->single_register_data);
-    sendResponse(packet->raw_data, MODBUS_REQUEST_BASE_LENGTH);
+    return MODBUS_REQUEST_BASE_LENGTH;
+}
 
-    return value;
+/**
+ * @brief Writes block of holding registers (common part of Write_Multiple_Registers and
+ * Read/Write_Multiple_Registers requests). Write event is called once for the whole block.
+ * 
+ * @param packet Modbus packet
+ * @param length Length of packet (in bytes, including CRC)
+ * @param fieldsOffset Offset of write start address in packet (byte count and data follow the count)
+ * @param writtenValue First written value
+ * @param event Write event (may be NULL)
+ * @return uint8_t Exception code, 0 if registers were written
+ */
+uint8_t ModbusRTUBase::writeMultipleRegistersHandler(volatile request_packet* packet, uint16_t length, uint8_t fieldsOffset,
+    int16_t* writtenValue, const ModbusEvent* event){
+    uint16_t firstRegister = endianity_swap_16bit(get_16bit_from_byte_buffer(packet->raw_data, fieldsOffset));
+    uint16_t registerCount = endianity_swap_16bit(get_16bit_from_byte_buffer(packet->raw_data, fieldsOffset + 2));
+    uint8_t byteCount = packet->raw_data[fieldsOffset + 4];
+    uint8_t dataOffset = fieldsOffset + 5;
+    uint16_t maxCount = packet->function_code == FC_WRITE_MULTIPLE_REGISTERS ? 
+        MAX_WRITE_REGISTER_COUNT : MAX_READ_WRITE_REGISTER_COUNT;
+
+    if (registerCount == 0 || registerCount > maxCount || byteCount != registerCount * 2 ||
+        length != dataOffset + byteCount + CRC_LEN){
+        return EX_ILLEGAL_VALUE;
+    }
+    uint16_t* registers = resolveHoldingRegisters(firstRegister, registerCount);
+    if (registers == NULL){
+        return EX_ILLEGAL_ADDRESS;
+    }
+
+    if (event != NULL && event->function != NULL){
+        //Fields describing written block are passed in host byte order (same as for single register)
+        put_16bit_into_byte_buffer(packet->raw_data, fieldsOffset, firstRegister);
+        put_16bit_into_byte_buffer(packet->raw_data, fieldsOffset + 2, registerCount);
+        event->function((uint8_t*)packet, dataOffset + byteCount, event->ctx);
+        put_16bit_into_byte_buffer(packet->raw_data, fieldsOffset, endianity_swap_16bit(firstRegister));
+        put_16bit_into_byte_buffer(packet->raw_data, fieldsOffset + 2, endianity_swap_16bit(registerCount));
+    }
+
+    sequenceWriteBegin(holdingSequence());
+    #if REGISTERS_IN_WIRE_ORDER
+        memcpy(registers, (uint8_t*)packet->raw_data + dataOffset, byteCount);
+    #else
+        for (uint16_t i = 0; i < registerCount; ++i){
+            registers[i] = endianity_swap_16bit(get_16bit_from_byte_buffer(packet->raw_data, dataOffset + (2 * i)));
+        }
+    #endif
+    sequenceWriteEnd(holdingSequence());
+    *writtenValue = register_to_host(registers[0]);
+    notifyHoldingWrite(firstRegister, registerCount);
+    return 0;
+}
+
+/**
+ * @brief Passes written block of holding registers (translated to bank addresses) to write hook and written function
+ * 
+ * @param first Address of first written register (as requested)
+ * @param count Number of written registers
+ */
+void ModbusRTUBase::notifyHoldingWrite(uint16_t first, uint16_t count){
+    uint16_t bankFirst = activeUnit != NULL ? first + activeUnit->holdingOffset : first;
+    if (holdingWriteHook != NULL){
+        holdingWriteHook(this, bankFirst, count, activeUnit != NULL ? activeUnit->address : (uint8_t)deviceAddress);
+    }
+    if (holdingWrittenFunction != NULL){
+        holdingWrittenFunction(bankFirst, count, holdingWrittenCtx);
+    }
 }
 
 /**
- * @brief Handles incoming Modbus request
+ * @brief Handles Read_Holding_Registers and Read_Input_Registers request
  * 
  * @param packet Modbus packet
- * @return int16_t Return value depends on request type:
- * For Read Registers -1
- * For Write Single Register - written value
+ * @param length Length of packet (in bytes, including CRC)
+ * @param event Read event (may be NULL)
+ * @return uint16_t Length of response (in bytes, excluding CRC)
  */
-int16_t ModbusRTU::handleRequest(request_packet* packet){
-    int16_t returnValue = -1;
-    
-    switch (packet->function_code){
-        case FC_READ_HOLDING_REGISTERS:
-        case FC_READ_INPUT_REGISTERS:
-            readRegistersHandler(packet);
+uint16_t ModbusRTUBase::readRegistersRequest(request_packet* packet, uint16_t length, const ModbusEvent* event){
+    if (length != MODBUS_REQUEST_BASE_LENGTH + CRC_LEN){
+        return buildErrorResponse(packet, EX_ILLEGAL_VALUE);
+    }
+    return readRegistersHandler(packet, event);
+}
+
+/**
+ * @brief Handles Write_Single_Register request
+ * 
+ * @param packet Modbus packet
+ * @param length Length of packet (in bytes, including CRC)
+ * @param writtenValue Written value
+ * @param event Write event (may be NULL)
+ * @return uint16_t Length of response (in bytes, excluding CRC)
+ */
+uint16_t ModbusRTUBase::writeSingleRegisterRequest(request_packet* packet, uint16_t length, int16_t* writtenValue, const ModbusEvent* event){
+    if (length != MODBUS_REQUEST_BASE_LENGTH + CRC_LEN){
+        return buildErrorResponse(packet, EX_ILLEGAL_VALUE);
+    }
+    return writeRegisterHandler(packet, writtenValue, event);
+}
+
+/**
+ * @brief Handles Write_Multiple_Registers request
+ * 
+ * @param packet Modbus packet
+ * @param length Length of packet (in bytes, including CRC)
+ * @param writtenValue First written value
+ * @param event Write event (may be NULL)
+ * @return uint16_t Length of response (in bytes, excluding CRC)
+ */
+uint16_t ModbusRTUBase::writeMultipleRegistersRequest(request_packet* packet, uint16_t length, int16_t* writtenValue, const ModbusEvent* event){
+    if (length < MODBUS_REQUEST_BASE_LENGTH + 1 + CRC_LEN){
+        return buildErrorResponse(packet, EX_ILLEGAL_VALUE);
+    }
+    uint8_t exception = writeMultipleRegistersHandler(packet, length, 2, writtenValue, event);
+    if (exception != 0){
+        return buildErrorResponse(packet, exception);
+    }
+    //Response echoes address, function code, first register and register count
+    return MODBUS_REQUEST_BASE_LENGTH;
+}
+
+/**
+ * @brief Handles Read/Write_Multiple_Registers request (registers are written first)
+ * 
+ * @param packet Modbus packet
+ * @param length Length of packet (in bytes, including CRC)
+ * @param writtenValue First written value
+ * @param readEvent Read event (may be NULL)
+ * @param writeEvent Write event (may be NULL)
+ * @return uint16_t Length of response (in bytes, excluding CRC)
+ */
+uint16_t ModbusRTUBase::readWriteMultipleRegistersRequest(request_packet* packet, uint16_t length, int16_t* writtenValue,
+    const ModbusEvent* readEvent, const ModbusEvent* writeEvent){
+    if (length < MODBUS_REQUEST_BASE_LENGTH + 5 + CRC_LEN){
+        return buildErrorResponse(packet, EX_ILLEGAL_VALUE);
+    }
+    //Read part is validated first, so nothing is written if request fails
+    uint16_t readCount = endianity_swap_16bit(packet->register_count);
+    if (readCount == 0 || readCount > MAX_READ_REGISTER_COUNT){
+        return buildErrorResponse(packet, EX_ILLEGAL_VALUE);
+    }
+    if (resolveHoldingRegisters(endianity_swap_16bit(packet->first_register), readCount) == NULL){
+        return buildErrorResponse(packet, EX_ILLEGAL_ADDRESS);
+    }
+    uint8_t exception = writeMultipleRegistersHandler(packet, length, 6, writtenValue, writeEvent);
+    if (exception != 0){
+        return buildErrorResponse(packet, exception);
+    }
+    //Read part has the same layout as Read_Holding_Registers request
+    return readRegistersHandler(packet, readEvent);
+}
+
+/**
+ * @brief Handles Read_Coils and Read_Discrete_Inputs request. Response is built in place of request.
+ * 
+ * @param packet Modbus packet
+ * @param length Length of packet (in bytes, including CRC)
+ * @return uint16_t Length of response (in bytes, excluding CRC)
+ */
+uint16_t ModbusRTUBase::readBitsRequest(request_packet* packet, uint16_t length){
+    if (length != MODBUS_REQUEST_BASE_LENGTH + CRC_LEN){
+        return buildErrorResponse(packet, EX_ILLEGAL_VALUE);
+    }
+    uint16_t first = endianity_swap_16bit(packet->first_register);
+    uint16_t count = endianity_swap_16bit(packet->register_count);
+    if (count == 0 || count > MAX_READ_BIT_COUNT){
+        return buildErrorResponse(packet, EX_ILLEGAL_VALUE);
+    }
+    const ModbusBitTable* table = resolveBits(packet->function_code == FC_READ_COILS, &first, count);
+    if (table == NULL){
+        return buildErrorResponse(packet, EX_ILLEGAL_ADDRESS);
+    }
+
+    uint8_t byteCount = (count + 7) >> 3;
+    packet->raw_data[2] = byteCount;
+    extractBits(packet->raw_data + MODBUS_RESPONSE_BASE_LEN, table->bits, first, count);
+    return MODBUS_RESPONSE_BASE_LEN + byteCount;
+}
+
+/**
+ * @brief Handles Write_Single_Coil request. Response (echo of request) stays in place.
+ * 
+ * @param packet Modbus packet
+ * @param length Length of packet (in bytes, including CRC)
+ * @param writtenValue New state of coil (0 or 1)
+ * @param event Write event (may be NULL)
+ * @return uint16_t Length of response (in bytes, excluding CRC)
+ */
+uint16_t ModbusRTUBase::writeSingleCoilRequest(request_packet* packet, uint16_t length, int16_t* writtenValue, const ModbusEvent* event){
+    if (length != MODBUS_REQUEST_BASE_LENGTH + CRC_LEN){
+        return buildErrorResponse(packet, EX_ILLEGAL_VALUE);
+    }
+    uint16_t address = endianity_swap_16bit(packet->first_register);
+    uint16_t value = endianity_swap_16bit(packet->single_register_data);
+    if (value != COIL_ON && value != 0){
+        return buildErrorResponse(packet, EX_ILLEGAL_VALUE);
+    }
+    uint16_t bankAddress = address;
+    ModbusBitTable* table = (ModbusBitTable*)resolveBits(true, &bankAddress, 1);
+    if (table == NULL){
+        return buildErrorResponse(packet, EX_ILLEGAL_ADDRESS);
+    }
+
+    if (event != NULL && event->function != NULL){
+        packet->first_register = address;
+        packet->single_register_data = value;
+        event->function(packet->raw_data, MODBUS_REQUEST_BASE_LENGTH, event->ctx);
+        packet->first_register = endianity_swap_16bit(address);
+        packet->single_register_data = endianity_swap_16bit(value);
+    }
+    uint8_t bit = value == COIL_ON;
+    insertBits(table->bits, bankAddress, &bit, 1);
+    *writtenValue = bit;
+    return MODBUS_REQUEST_BASE_LENGTH;
+}
+
+/**
+ * @brief Handles Write_Multiple_Coils request. Response echoes address, function code, first coil and count.
+ * 
+ * @param packet Modbus packet
+ * @param length Length of packet (in bytes, including CRC)
+ * @param writtenValue New state of first coil (0 or 1)
+ * @param event Write event (may be NULL)
+ * @return uint16_t Length of response (in bytes, excluding CRC)
+ */
+uint16_t ModbusRTUBase::writeMultipleCoilsRequest(request_packet* packet, uint16_t length, int16_t* writtenValue, const ModbusEvent* event){
+    if (length < MODBUS_REQUEST_BASE_LENGTH + 1 + CRC_LEN){
+        return buildErrorResponse(packet, EX_ILLEGAL_VALUE);
+    }
+    uint16_t first = endianity_swap_16bit(packet->first_register);
+    uint16_t count = endianity_swap_16bit(packet->register_count);
+    uint8_t byteCount = packet->raw_data[MODBUS_REQUEST_BASE_LENGTH];
+    uint8_t* data = packet->raw_data + MODBUS_REQUEST_BASE_LENGTH + 1;
+    if (count == 0 || count > MAX_WRITE_BIT_COUNT || byteCount != (count + 7) >> 3 ||
+        length != MODBUS_REQUEST_BASE_LENGTH + 1 + byteCount + CRC_LEN){
+        return buildErrorResponse(packet, EX_ILLEGAL_VALUE);
+    }
+    uint16_t bankFirst = first;
+    ModbusBitTable* table = (ModbusBitTable*)resolveBits(true, &bankFirst, count);
+    if (table == NULL){
+        return buildErrorResponse(packet, EX_ILLEGAL_ADDRESS);
+    }
+
+    if (event != NULL && event->function != NULL){
+        packet->first_register = first;
+        packet->register_count = count;
+        event->function(packet->raw_data, MODBUS_REQUEST_BASE_LENGTH + 1 + byteCount, event->ctx);
+        packet->first_register = endianity_swap_16bit(first);
+        packet->register_count = endianity_swap_16bit(count);
+    }
+    insertBits(table->bits, bankFirst, data, count);
+    *writtenValue = data[0] & 1;
+    return MODBUS_REQUEST_BASE_LENGTH;
+}
+
+/**
+ * @brief Handles Diagnostics request (counter sub-functions, Return_Query_Data and clearing of counters).
+ * Response echoes request, data field holds requested counter.
+ * 
+ * @param packet Modbus packet
+ * @param length Length of packet (in bytes, including CRC)
+ * @return uint16_t Length of response (in bytes, excluding CRC)
+ */
+uint16_t ModbusRTUBase::diagnosticsRequest(ModbusDiagnostics* diagnostics, request_packet* packet, uint16_t length){
+    if (length != MODBUS_REQUEST_BASE_LENGTH + CRC_LEN){
+        return buildErrorResponse(packet, EX_ILLEGAL_VALUE);
+    }
+    uint16_t subFunction = endianity_swap_16bit(packet->first_register);
+    if (subFunction == DIAG_RETURN_QUERY_DATA){
+        return MODBUS_REQUEST_BASE_LENGTH;
+    }
+    if (packet->single_register_data != 0){
+        return buildErrorResponse(packet, EX_ILLEGAL_VALUE);
+    }
+    if (subFunction == DIAG_CLEAR_COUNTERS || subFunction == DIAG_CLEAR_OVERRUN_COUNTER){
+        clearDiagnostics(diagnostics, subFunction == DIAG_CLEAR_OVERRUN_COUNTER);
+        if (subFunction == DIAG_CLEAR_COUNTERS){
+            //Clearing request is counted as the first message (it is counted as served after response)
+            diagnostics->busMessages = 1;
+        }
+        return MODBUS_REQUEST_BASE_LENGTH;
+    }
+
+    ModbusDiagnostics counters;
+    collectDiagnostics(diagnostics, &counters);
+    uint16_t value;
+    switch (subFunction){
+        case DIAG_BUS_MESSAGE_COUNT:
+            value = counters.busMessages;
             break;
-        case FC_WRITE_SINGLE_REGISTER:
-            returnValue = writeRegisterHandler(packet);
+        case DIAG_BUS_COMMUNICATION_ERROR_COUNT:
+            value = counters.busCommunicationErrors;
+            break;
+        case DIAG_BUS_EXCEPTION_ERROR_COUNT:
+            value = counters.busExceptionErrors;
+            break;
+        case DIAG_SERVER_MESSAGE_COUNT:
+            value = counters.serverMessages;
+            break;
+        case DIAG_SERVER_NO_RESPONSE_COUNT:
+            value = counters.serverNoResponses;
+            break;
+        case DIAG_SERVER_NAK_COUNT:
+        case DIAG_SERVER_BUSY_COUNT:
+            //Requests are never refused
+            value = 0;
+            break;
+        case DIAG_BUS_CHARACTER_OVERRUN_COUNT:
+            value = counters.characterOverruns;
+            break;
+        case DIAG_DISCARDED_FRAME_COUNT:
+            value = counters.discardedFrames;
             break;
         default:
-            sendErrorResponse(packet, EX_ILLEGAL_FUNCTION);
+            if (subFunction >= DIAG_LATENCY_BUCKET && subFunction < DIAG_LATENCY_BUCKET + MODBUS_LATENCY_BUCKETS){
+                value = counters.latency[subFunction - DIAG_LATENCY_BUCKET];
+                break;
+            }
+            return buildErrorResponse(packet, EX_ILLEGAL_FUNCTION);
+    }
+    packet->single_register_data = endianity_swap_16bit(value);
+    return MODBUS_REQUEST_BASE_LENGTH;
+}
+
+/**
+ * @brief Handles Get_Comm_Event_Counter request (status word and number of successfully completed requests)
+ * 
+ * @param packet Modbus packet
+ * @param length Length of packet (in bytes, including CRC)
+ * @return uint16_t Length of response (in bytes, excluding CRC)
+ */
+uint16_t ModbusRTUBase::commEventCounterRequest(const ModbusDiagnostics* diagnostics, request_packet* packet, uint16_t length){
+    if (length != MODBUS_MIN_FRAME_LEN){
+        return buildErrorResponse(packet, EX_ILLEGAL_VALUE);
+    }
+    //No program command is ever in progress
+    packet->first_register = 0;
+    packet->single_register_data = endianity_swap_16bit(diagnostics->commEvents);
+    return MODBUS_REQUEST_BASE_LENGTH;
+}
+
+/**
+ * @brief Reads diagnostics of server and adds frames dropped by frame assemblers of all ports
+ * 
+ * @param result Diagnostics
+ */
+void ModbusRTUBase::collectDiagnostics(const ModbusDiagnostics* diagnostics, ModbusDiagnostics* result){
+    *result = *diagnostics;
+    for (ModbusPort* port = &primaryPort; port != NULL; port = port->nextPort){
+        for (uint8_t i = 0; i < 2; ++i){
+            const SerialCtx* ctx = i == 0 ? &port->defaultSerialCtx : (port->rxRing != NULL ? &port->rxRing->frame : NULL);
+            if (ctx != NULL){
+                //Dropped and skipped frames never reach the server
+                result->busMessages += ctx->crcErrors + ctx->discardedFrames + ctx->skippedFrames;
+                result->busCommunicationErrors += ctx->crcErrors;
+                result->discardedFrames += ctx->discardedFrames;
+                result->characterOverruns += ctx->overruns;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Clears diagnostics of server and counters of all ports
+ * 
+ * @param overrunsOnly Clear only overrun counters (Clear_Overrun_Counter sub-function)
+ */
+void ModbusRTUBase::clearDiagnostics(ModbusDiagnostics* diagnostics, bool overrunsOnly){
+    if (overrunsOnly){
+        diagnostics->characterOverruns = 0;
+    }
+    else {
+        memset(diagnostics, 0, sizeof(ModbusDiagnostics));
+    }
+    for (ModbusPort* port = &primaryPort; port != NULL; port = port->nextPort){
+        for (uint8_t i = 0; i < 2; ++i){
+            SerialCtx* ctx = i == 0 ? &port->defaultSerialCtx : (port->rxRing != NULL ? &port->rxRing->frame : NULL);
+            if (ctx != NULL){
+                ctx->overruns = 0;
+                if (!overrunsOnly){
+                    ctx->crcErrors = 0;
+                    ctx->discardedFrames = 0;
+                    ctx->skippedFrames = 0;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Counts event of served frame (diagnostics hook of ModbusServer). Answered request is counted
+ * together with its latency (time from the end of request to the start of response).
+ * 
+ * @param diagnostics Diagnostics of server
+ * @param event MODBUS_DIAG_* event
+ * @param port Port, which received request
+ * @param packet Response (MODBUS_DIAG_NO_RESPONSE and MODBUS_DIAG_RESPONSE)
+ */
+void ModbusRTUBase::recordDiagnostics(ModbusDiagnostics* diagnostics, uint8_t event, ModbusPort* port,
+    const request_packet* packet){
+    switch (event){
+        case MODBUS_DIAG_FRAME:
+            ++diagnostics->busMessages;
+            return;
+        case MODBUS_DIAG_CRC_ERROR:
+            ++diagnostics->busCommunicationErrors;
+            return;
+        case MODBUS_DIAG_NO_RESPONSE:
+            ++diagnostics->serverMessages;
+            ++diagnostics->serverNoResponses;
+            if (!(packet->function_code & 0x80)){
+                ++diagnostics->commEvents;
+            }
+            return;
+    }
+
+    ++diagnostics->serverMessages;
+    if (packet->function_code & 0x80){
+        ++diagnostics->busExceptionErrors;
+    }
+    else if (packet->function_code != FC_GET_COMM_EVENT_COUNTER){
+        //Reading of event counter does not change it
+        ++diagnostics->commEvents;
+    }
+
+    unsigned long latency = micros() - port->frameEndTimestamp();
+    unsigned long bound = MODBUS_LATENCY_BUCKET_US;
+    uint8_t bucket = 0;
+    while (bucket < MODBUS_LATENCY_BUCKETS - 1 && latency >= bound){
+        bound <<= 1;
+        ++bucket;
     }
-    return returnValue;
+    ++diagnostics->latency[bucket];
 }
 
-void ModbusRTU::startModbusServer(uint16_t address, unsigned long baudRate){
+void ModbusRTUBase::startModbusServer(uint16_t address, unsigned long baudRate){
         this->deviceAddress = address;
-        if (defaultSerialCtx.serial == NULL){
-            defaultSerialCtx.serial = &Serial;
+        if (primaryPort.defaultSerialCtx.serial == NULL){
+            primaryPort.defaultSerialCtx.serial = &Serial;
             Serial.begin(baudRate, SERIAL_8E1);
         }
-        //Calculate timeout based on baud rate in microseconds
-        defaultSerialCtx.timeout = ((int)ceil(1000000 / baudRate)) * MODBUS_REQUEST_BASE_LENGTH * (1 + 8 + 1 + 1); //1 start bit + 8 data bits + parity + 1 stop bit
-        defaultSerialCtx.lastTimestamp = micros();
+        primaryPort.begin(baudRate);
+    }
+
+void ModbusRTUBase::addPort(ModbusPort* port){
+    ModbusPort* last = &primaryPort;
+    while (last->nextPort != NULL){
+        last = last->nextPort;
     }
+    port->nextPort = NULL;
+    port->addressFilter.function = acceptsAddress;
+    port->addressFilter.ctx = this;
+    last->nextPort = port;
+}
+
+void ModbusRTUBase::addUnit(ModbusUnit* unit){
+    unit->next = units;
+    units = unit;
+}
+
+void ModbusRTUBase::addProvider(ModbusProvider** list, ModbusProvider* provider){
+    provider->valid = false;
+    provider->next = *list;
+    *list = provider;
+}
 
 /**
- * @brief Main communication loop. Call this function periodically.
+ * @brief Computes registers of providers, which overlap requested block (cached blocks only if they expired).
+ * Function computes values into local buffer, so the bank is locked only while they are copied in.
+ * 
+ * @param providers Providers of the bank
+ * @param input True for input registers, false for holding registers
+ * @param first Bank address of first requested register
+ * @param count Number of requested registers
+ */
+void ModbusRTUBase::provideRegisters(ModbusProvider* providers, bool input, uint16_t first, uint16_t count){
+    uint32_t end = (uint32_t)first + count;
+    unsigned long now = millis();
+    for (ModbusProvider* provider = providers; provider != NULL; provider = provider->next){
+        uint32_t providerEnd = (uint32_t)provider->first + provider->count;
+        if (provider->first >= end || providerEnd <= first){
+            continue;
+        }
+        uint16_t start = provider->first;
+        uint16_t length = provider->count;
+        if (provider->maxAge != 0){
+            if (provider->valid && now - provider->updated < provider->maxAge){
+                continue;
+            }
+        }
+        else {
+            start = first > provider->first ? first : provider->first;
+            length = (end < providerEnd ? end : providerEnd) - start;
+        }
+        if (length > MAX_READ_REGISTER_COUNT ||
+            (input ? resolveInputBank(start, length) : resolveHoldingBank(start, length)) == NULL){
+            continue;
+        }
+        uint16_t values[MAX_READ_REGISTER_COUNT];
+        provider->function(values, start, length, provider->ctx);
+        if (input){
+            copyToInputRegisters(values, length, start);
+        }
+        else {
+            copyToHoldingRegisters(values, length, start);
+        }
+        if (provider->maxAge != 0){
+            provider->valid = true;
+            provider->updated = now;
+        }
+    }
+}
+
+void ModbusPort::begin(unsigned long baudRate){
+    initSerialCtx(&defaultSerialCtx, defaultSerialCtx.serial, baudRate);
+    if (rxRing != NULL){
+        initSerialCtx(&rxRing->frame, NULL, baudRate);
+    }
+}
+
+void ModbusPort::setInterruptReceive(RxRingCtx* ring){
+    setSerialReadFunction(ringSerialReadFunction, ring);
+    ring->head = 0;
+    ring->tail = 0;
+    ring->pending = false;
+    ring->overflow = false;
+    ring->lastByteTimestamp = micros();
+    //Timing is taken from default serial port (updated by begin())
+    ring->frame = defaultSerialCtx;
+    ring->frame.serial = NULL;
+    ring->frame.length = 0;
+    ring->frame.crc = MODBUS_CRC_INIT;
+    ring->frame.state = FRAME_IDLE;
+    ring->frame.crcErrors = 0;
+    ring->frame.discardedFrames = 0;
+    ring->frame.overruns = 0;
+    ring->frame.skippedFrames = 0;
+    ring->frame.skippedRequest = 0;
+    rxRing = ring;
+}
+
+/**
+ * @brief Finishes pending transmission and reads received frame
  * 
+ * @return uint16_t Result of read function (length | MODBUS_FRAME_CRC_OK), 0 if no frame is ready
+ */
+uint16_t ModbusPort::receiveFrame(){
+    if (txBusy){
+        continueTransmit();
+        if (txBusy){
+            return 0;
+        }
+    }
+    //With interrupt receive, idle loop checks only this flag
+    if (rxRing != NULL && !rxRing->pending){
+        return 0;
+    }
+
+    uint16_t result = serialReadFunction((char*)rxFrame.raw_data, serialReadCtx);
+    if ((result & ~MODBUS_FRAME_CRC_OK) < MODBUS_MIN_FRAME_LEN){
+        return 0;
+    }
+    return result;
+}
+
+/**
+ * @brief Time when the last byte of received frame was detected. With interrupt receive, bytes of next
+ * frame may be already received. Custom read functions do not report it, current time is returned.
+ * 
+ * @return unsigned long Timestamp in microseconds
+ */
+unsigned long ModbusPort::frameEndTimestamp(){
+    if (rxRing != NULL){
+        return rxRing->lastByteTimestamp;
+    }
+    if (serialReadCtx == &defaultSerialCtx){
+        return defaultSerialCtx.lastTimestamp;
+    }
+    return micros();
+}
+
+/**
+ * @brief Selects register view for request
+ * 
+ * @param address Address of request
+ * @return Whether server answers for the address
+ */
+bool ModbusRTUBase::selectUnit(uint8_t address){
+    if (address == deviceAddress){
+        activeUnit = NULL;
+        return true;
+    }
+    for (ModbusUnit* unit = units; unit != NULL; unit = unit->next){
+        if (unit->address == address){
+            activeUnit = unit;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Address filter of ports (see ModbusAddressFilter)
+ * 
+ * @param address Address of frame
+ * @param ctx Server
+ * @return Whether frame is handled by server (device address, unit ID or broadcast)
+ */
+bool ModbusRTUBase::acceptsAddress(uint8_t address, void* ctx){
+    ModbusRTUBase* server = (ModbusRTUBase*)ctx;
+    if (address == server->deviceAddress || address == MODBUS_BROADCAST_ADDRESS){
+        return true;
+    }
+    for (const ModbusUnit* unit = server->units; unit != NULL; unit = unit->next){
+        if (unit->address == address){
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Handles request received on port (if any)
+ * 
+ * @param port Serial port
  * @return int16_t New data, -1 if none has arrived
  */
-int16_t ModbusRTU::communicationLoop(){
-    
-    request_packet received_packet = {0};
-    if (serialReadFunction((char*)received_packet.raw_data, serialReadCtx) == false){
+int16_t ModbusRTUBase::servePort(ModbusPort* port){
+    uint16_t result = port->receiveFrame();
+    uint16_t length = result & ~MODBUS_FRAME_CRC_OK;
+    if (length == 0){
         return -1;
     }
 
-    if (received_packet.address == deviceAddress &&
-        calculateCRC(received_packet.raw_data, MODBUS_REQUEST_BASE_LENGTH, false) == true){
+    if (diagnosticsHook != NULL){
+        diagnosticsHook(this, MODBUS_DIAG_FRAME, port, NULL);
+    }
+
+    int16_t writtenValue = -1;
+    request_packet* packet = &port->rxFrame;
+    //Broadcast writes are executed on device registers (not on unit views), serial ports only
+    bool broadcast = !port->tcpPort && packet->address == MODBUS_BROADCAST_ADDRESS && deviceAddress != MODBUS_BROADCAST_ADDRESS;
+    bool unknownUnit = false;
+    if (broadcast){
+        if (!isBroadcastFunction(packet->function_code)){
+            return -1;
+        }
+        activeUnit = NULL;
+    }
+    else if (port->tcpPort && (packet->address == MODBUS_BROADCAST_ADDRESS || packet->address == MODBUS_TCP_DEVICE_UNIT)){
+        //Unit IDs 0 and 0xFF address TCP device itself
+        activeUnit = NULL;
+    }
+    else if (!selectUnit(packet->address)){
+        if (!port->tcpPort){
+            return -1;
+        }
+        //TCP client would wait for its timeout, unit is reported as not responding
+        unknownUnit = true;
+    }
+    if (!(result & MODBUS_FRAME_CRC_OK) && ModbusPort::calculateCRC(packet->raw_data, length - CRC_LEN, false) == false){
+        if (diagnosticsHook != NULL){
+            diagnosticsHook(this, MODBUS_DIAG_CRC_ERROR, port, NULL);
+        }
+        return -1;
+    }
 
-        return handleRequest(&received_packet);
+    //Response is built in the same buffer
+    uint16_t responseLength = unknownUnit ? buildErrorResponse(packet, EX_GATEWAY_TARGET_FAILED) :
+        requestDispatcher(this, packet, length, &writtenValue);
+    //Application accesses bank addresses
+    activeUnit = NULL;
+    if (broadcast){
+        //Response is not sent (response of every device would collide)
+        if (diagnosticsHook != NULL){
+            diagnosticsHook(this, MODBUS_DIAG_NO_RESPONSE, port, packet);
+        }
+        return writtenValue;
+    }
+    if (diagnosticsHook != NULL){
+        diagnosticsHook(this, MODBUS_DIAG_RESPONSE, port, packet);
     }
-    return -1;
+    port->sendFrame(responseLength);
+    return writtenValue;
 }
 
-void ModbusRTU::copyToInputRegisters(uint16_t* data, uint16_t length, uint16_t startAddress){
-        if (startAddress + length <= INPUT_REGISTER_NUM){
-            for (uint16_t i = 0; i < length; i++){
-                inputRegisters[startAddress + i] = data[i];
-            }
+/**
+ * @brief Main communication loop. Call this function periodically.
+ * 
+ * @return int16_t New data, -1 if none has arrived
+ */
+int16_t ModbusRTUBase::communicationLoop(){
+    int16_t writtenValue = -1;
+    for (ModbusPort* port = &primaryPort; port != NULL; port = port->nextPort){
+        int16_t value = servePort(port);
+        if (value != -1){
+            writtenValue = value;
         }
     }
+    return writtenValue;
+}
+
+/**
+ * @brief Finds bit table holding block of coils or discrete inputs
+ * 
+ * @param coilTable Coils if true, discrete inputs otherwise
+ * @param first Address of first bit (as requested), translated to table address
+ * @param count Number of bits
+ * @return const ModbusBitTable* Table, NULL if block is not mapped as a whole
+ */
+const ModbusBitTable* ModbusRTUBase::resolveBits(bool coilTable, uint16_t* first, uint16_t count){
+    const ModbusBitTable* table = coilTable ? &coils : &discreteInputs;
+    uint32_t start = *first;
+    if (activeUnit != NULL){
+        if (start + count > (coilTable ? activeUnit->coilCount : activeUnit->discreteInputCount)){
+            return NULL;
+        }
+        start += coilTable ? activeUnit->coilOffset : activeUnit->discreteInputOffset;
+    }
+    if (table->bits == NULL || start + count > table->count){
+        return NULL;
+    }
+    *first = (uint16_t)start;
+    return table;
+}
+
+void ModbusRTUBase::copyToBits(ModbusBitTable* table, const uint8_t* data, uint16_t count, uint16_t startAddress){
+    if (table->bits != NULL && (uint32_t)startAddress + count <= table->count && count > 0){
+        insertBits(table->bits, startAddress, data, count);
+    }
+}
+
+void ModbusRTUBase::copyFromBits(const ModbusBitTable* table, uint8_t* data, uint16_t count, uint16_t startAddress){
+    if (table->bits != NULL && (uint32_t)startAddress + count <= table->count && count > 0){
+        extractBits(data, table->bits, startAddress, count);
+    }
+}
+
+/**
+ * @brief Finds storage of block of input registers
+ * 
+ * @param first Address of first register
+ * @param count Number of registers
+ * @return uint16_t* Pointer to the first register, NULL if block is not mapped as a whole
+ */
+uint16_t* ModbusRTUBase::resolveInputRegisters(uint16_t first, uint16_t count){
+    if (activeUnit != NULL){
+        if ((uint32_t)first + count > activeUnit->inputCount ||
+            (uint32_t)activeUnit->inputOffset + first + count > 0x10000UL){
+            return NULL;
+        }
+        first += activeUnit->inputOffset;
+    }
+    return resolveInputBank(first, count);
+}
+
+/**
+ * @brief Finds storage of block of holding registers
+ * 
+ * @param first Address of first register
+ * @param count Number of registers
+ * @return uint16_t* Pointer to the first register, NULL if block is not mapped as a whole
+ */
+uint16_t* ModbusRTUBase::resolveHoldingRegisters(uint16_t first, uint16_t count){
+    if (activeUnit != NULL){
+        if ((uint32_t)first + count > activeUnit->holdingCount ||
+            (uint32_t)activeUnit->holdingOffset + first + count > 0x10000UL){
+            return NULL;
+        }
+        first += activeUnit->holdingOffset;
+    }
+    return resolveHoldingBank(first, count);
+}
 
-void ModbusRTU::copyToHoldingRegisters(uint16_t* data, uint16_t length, uint16_t startAddress){
-        if (startAddress + length <= HOLDING_REGISTER_NUM){
+void ModbusRTUBase::copyToInputRegisters(uint16_t* data, uint16_t length, uint16_t startAddress){
+        uint16_t* registers = resolveInputBank(startAddress, length);
+        if (registers != NULL){
+            sequenceWriteBegin(inputSequence());
             for (uint16_t i = 0; i < length; i++){
-                holdingRegisters[startAddress + i] = data[i];
+                registers[i] = register_from_host(data[i]);
             }
+            sequenceWriteEnd(inputSequence());
         }
     }
 
-void ModbusRTU::copyFromHoldingRegisters(uint16_t* data, uint16_t length, uint16_t startAddress){
-        if (startAddress + length <= HOLDING_REGISTER_NUM){
+void ModbusRTUBase::copyToHoldingRegisters(uint16_t* data, uint16_t length, uint16_t startAddress){
+        uint16_t* registers = resolveHoldingBank(startAddress, length);
+        if (registers != NULL){
+            sequenceWriteBegin(holdingSequence());
             for (uint16_t i = 0; i < length; i++){
-                data[i] = holdingRegisters[startAddress + i];
+                registers[i] = register_from_host(data[i]);
             }
+            sequenceWriteEnd(holdingSequence());
+        }
+    }
+
+void ModbusRTUBase::copyFromHoldingRegisters(uint16_t* data, uint16_t length, uint16_t startAddress){
+        uint16_t* registers = resolveHoldingBank(startAddress, length);
+        if (registers != NULL){
+            modbus_sequence_t start;
+            do {
+                start = sequenceReadBegin(holdingSequence());
+                for (uint16_t i = 0; i < length; i++){
+                    data[i] = register_to_host(registers[i]);
+                }
+            } while (sequenceReadRetry(holdingSequence(), start));
         }
     }
 
+/**
+ * @brief Predicts length of request frame from its header
+ * 
+ * @param frame Received part of frame
+ * @param length Number of bytes received so far
+ * @return uint16_t Total length of frame (including CRC), 0 if it cannot be determined (yet)
+ */
+uint16_t modbusRequestLength(const uint8_t* frame, uint16_t length){
+    if (length < 2){
+        return 0;
+    }
+    switch (frame[1]){
+        case FC_READ_COILS:
+        case FC_READ_DISCRETE_INPUTS:
+        case FC_READ_HOLDING_REGISTERS:
+        case FC_READ_INPUT_REGISTERS:
+        case FC_WRITE_SINGLE_COIL:
+        case FC_WRITE_SINGLE_REGISTER:
+        case FC_DIAGNOSTICS:
+            return MODBUS_REQUEST_BASE_LENGTH + CRC_LEN;
+        case 7: //Read Exception Status
+        case FC_GET_COMM_EVENT_COUNTER:
+        case 12: //Get Comm Event Log
+        case 17: //Report Server ID
+            return MODBUS_MIN_FRAME_LEN;
+        case FC_WRITE_MULTIPLE_COILS:
+        case FC_WRITE_MULTIPLE_REGISTERS:
+            //Address, function code, first register, count, byte count, data, CRC
+            return length > 6 ? 7 + frame[6] + CRC_LEN : 0;
+        case FC_READ_WRITE_MULTIPLE_REGISTERS:
+            return length > 10 ? 11 + frame[10] + CRC_LEN : 0;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief Predicts length of response frame from its header
+ * 
+ * @param frame Received part of frame
+ * @param length Number of bytes received so far
+ * @return uint16_t Total length of frame (including CRC), 0 if it cannot be determined (yet)
+ */
+uint16_t modbusResponseLength(const uint8_t* frame, uint16_t length){
+    if (length < 2){
+        return 0;
+    }
+    if (frame[1] & 0x80){
+        //Exception response (address, function code, exception code, CRC)
+        return MODBUS_RESPONSE_BASE_LEN + CRC_LEN;
+    }
+    switch (frame[1]){
+        case FC_READ_COILS:
+        case FC_READ_DISCRETE_INPUTS:
+        case FC_READ_HOLDING_REGISTERS:
+        case FC_READ_INPUT_REGISTERS:
+        case 12: //Get Comm Event Log
+        case 17: //Report Server ID
+        case FC_READ_WRITE_MULTIPLE_REGISTERS:
+            //Address, function code, byte count, data, CRC
+            return length > 2 ? MODBUS_RESPONSE_BASE_LEN + frame[2] + CRC_LEN : 0;
+        case FC_WRITE_SINGLE_COIL:
+        case FC_WRITE_SINGLE_REGISTER:
+        case FC_DIAGNOSTICS:
+        case FC_GET_COMM_EVENT_COUNTER:
+        case FC_WRITE_MULTIPLE_COILS:
+        case FC_WRITE_MULTIPLE_REGISTERS:
+            return MODBUS_REQUEST_BASE_LENGTH + CRC_LEN;
+        case 7: //Read Exception Status
+            return MODBUS_RESPONSE_BASE_LEN + CRC_LEN;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief Initializes serial context (frame assembler state and timing) for given baud rate
+ * 
+ * @param ctx Serial context
+ * @param serial Serial port object
+ * @param baudRate Communication baud rate (0 if unknown, fixed intervals are used)
+ */
+void initSerialCtx(SerialCtx* ctx, void* serial, unsigned long baudRate){
+    ctx->serial = serial;
+    //Calculate silent intervals based on baud rate in microseconds
+    ctx->charTime = baudRate == 0 ? 0 : (MODBUS_CHAR_BITS * 1000000UL + baudRate - 1) / baudRate;
+    if (baudRate > MODBUS_FIXED_TIMING_BAUD || baudRate == 0){
+        ctx->interCharTimeout = MODBUS_FIXED_T15;
+        ctx->interFrameTimeout = MODBUS_FIXED_T35;
+    }
+    else {
+        ctx->interCharTimeout = (ctx->charTime * 3 + 1) / 2;
+        ctx->interFrameTimeout = (ctx->charTime * 7 + 1) / 2;
+    }
+    ctx->txEndTimestamp = micros();
+    ctx->lastTimestamp = micros();
+    ctx->length = 0;
+    ctx->crc = MODBUS_CRC_INIT;
+    ctx->state = FRAME_IDLE;
+    ctx->crcErrors = 0;
+    ctx->discardedFrames = 0;
+    ctx->overruns = 0;
+    ctx->skippedFrames = 0;
+    ctx->skipLength = 0;
+    ctx->skippedRequest = 0;
+    ctx->skippingResponse = false;
+}
+
+/**
+ * @brief Predicts length of skipped frame. Frame expected to be response, which has implausible byte count
+ * (i.e. retry of request by master), is predicted as request.
+ * 
+ * @param ctx Serial context
+ * @param frame Received part of frame
+ * @param length Number of bytes received so far
+ * @return uint16_t Total length of frame (including CRC), 0 if it cannot be determined (yet)
+ */
+static uint16_t skippedFrameLength(SerialCtx* ctx, const uint8_t* frame, uint16_t length){
+    if (ctx->skippingResponse){
+        uint16_t predicted = modbusResponseLength(frame, length);
+        uint8_t functionCode = frame[1];
+        if (predicted == 0 || (functionCode > FC_READ_INPUT_REGISTERS && functionCode != FC_READ_WRITE_MULTIPLE_REGISTERS)){
+            return predicted;
+        }
+        //Read response carries at most 125 registers or 2000 coils, registers take even number of bytes
+        uint8_t byteCount = frame[2];
+        bool registers = functionCode != FC_READ_COILS && functionCode != FC_READ_DISCRETE_INPUTS;
+        if (byteCount != 0 && byteCount <= MAX_READ_REGISTER_COUNT * 2 && (!registers || byteCount % 2 == 0)){
+            return predicted;
+        }
+        ctx->skippingResponse = false;
+    }
+    return ctx->frameLength != NULL ? ctx->frameLength(frame, length) : 0;
+}
+
+/**
+ * @brief Counts byte of frame of other device. Only header is stored (to predict length), CRC is not calculated.
+ * Response of device follows its request, so its length is predicted by modbusResponseLength().
+ * 
+ * @param ctx Serial context
+ * @param buffer Frame buffer
+ * @param value Received byte
+ */
+static void skipByte(SerialCtx* ctx, char* buffer, uint8_t value){
+    if (ctx->skipLength == 0){
+        if (ctx->length < MODBUS_MAX_FRAME_LEN){
+            buffer[ctx->length] = (char)value;
+        }
+        ++ctx->length;
+        ctx->skipLength = skippedFrameLength(ctx, (const uint8_t*)buffer, ctx->length);
+    }
+    else {
+        ++ctx->length;
+    }
+    //Without prediction, frame is finished by t3.5 silence
+    if (ctx->length == ctx->skipLength){
+        ctx->length = 0;
+        ctx->skipLength = 0;
+        ctx->state = FRAME_IDLE;
+        ++ctx->skippedFrames;
+    }
+}
+
+/**
+ * @brief Appends received byte to assembled frame
+ * 
+ * @param ctx Serial context
+ * @param buffer Frame buffer
+ * @param value Received byte
+ * @return uint16_t Length of frame if this byte completed it (see setSerialReadFunction), 0 otherwise
+ */
+uint16_t modbusFrameAppendByte(SerialCtx* ctx, char* buffer, uint8_t value){
+    if (ctx->state == FRAME_DISCARDING){
+        return 0;
+    }
+    if (ctx->state == FRAME_SKIPPING){
+        skipByte(ctx, buffer, value);
+        return 0;
+    }
+    if (ctx->state == FRAME_IDLE){
+        //The first byte is address, frames of other devices are skipped
+        bool response = ctx->skippedRequest != 0 && value == ctx->skippedRequest;
+        ctx->skippedRequest = 0;
+        if (ctx->addressFilter != NULL && ctx->addressFilter->function != NULL &&
+            !ctx->addressFilter->function(value, ctx->addressFilter->ctx)){
+            ctx->state = FRAME_SKIPPING;
+            ctx->skippingResponse = response;
+            //Response of device is expected next
+            ctx->skippedRequest = response ? 0 : value;
+            skipByte(ctx, buffer, value);
+            return 0;
+        }
+    }
+    if (ctx->length >= MODBUS_MAX_FRAME_LEN){
+        ctx->state = FRAME_DISCARDING;
+        return 0;
+    }
+
+    buffer[ctx->length++] = (char)value;
+    ctx->state = FRAME_RECEIVING;
+    #if MODBUS_INCREMENTAL_CRC
+        ctx->crc = modbusCRC16Update(ctx->crc, value);
+    #endif
+
+    //Accept frame immediately, so it is not merged with the following one
+    if (ctx->frameLength != NULL && ctx->length == ctx->frameLength((const uint8_t*)buffer, ctx->length)){
+        #if MODBUS_INCREMENTAL_CRC
+            //Wrong prediction (i.e. response of other device), wait for the end of frame
+            if (ctx->crc != 0){
+                return 0;
+            }
+            ctx->crc = MODBUS_CRC_INIT;
+        #endif
+        uint16_t length = ctx->length;
+        ctx->length = 0;
+        ctx->state = FRAME_IDLE;
+        #if MODBUS_INCREMENTAL_CRC
+            return length | MODBUS_FRAME_CRC_OK;
+        #else
+            return length;
+        #endif
+    }
+    return 0;
+}
+
+/**
+ * @brief Finishes assembled frame after t3.5 silence
+ * 
+ * @param ctx Serial context
+ * @return uint16_t Length of frame (see setSerialReadFunction), 0 if frame is invalid
+ */
+uint16_t modbusFrameEnd(SerialCtx* ctx){
+    if (ctx->state == FRAME_SKIPPING){
+        //Length of frame of other device was not predicted
+        ctx->length = 0;
+        ctx->skipLength = 0;
+        ctx->state = FRAME_IDLE;
+        ++ctx->skippedFrames;
+        return 0;
+    }
+    uint16_t length = ctx->length;
+    bool valid = ctx->state != FRAME_DISCARDING;
+    ctx->length = 0;
+    ctx->state = FRAME_IDLE;
+    if (!valid){
+        ++ctx->discardedFrames;
+    }
+    #if MODBUS_INCREMENTAL_CRC
+        if (valid && ctx->crc != 0){
+            ++ctx->crcErrors;
+            valid = false;
+        }
+        ctx->crc = MODBUS_CRC_INIT;
+        return valid ? length | MODBUS_FRAME_CRC_OK : 0;
+    #else
+        return valid ? length : 0;
+    #endif
+}
+
 /**
  * @brief Default serial read function
- * @param buffer Buffer where data will be stored
+ * Assembles frame byte by byte. Frame is complete when its predicted length is reached,
+ * or when the line is silent for t3.5. Frame containing silence longer than t1.5 is discarded.
+ * Silence is measured from the moment new bytes were detected, so it is never overestimated.
+ * @param buffer Buffer where data will be stored (preserved between calls)
  * @param ctx Serial port context
- * @return true If data was read successfully, false otherwise
+ * @return uint16_t Length of received frame, 0 if none is complete
  */
-bool defaultSerialReadFunction(char* buffer, void* ctx){
+uint16_t defaultSerialReadFunction(char* buffer, void* ctx){
     SerialCtx* currentCtx = (SerialCtx*)ctx;
     HardwareSerial* serialPort = (HardwareSerial*)currentCtx->serial;
+    unsigned long currentTimestamp = micros();
 
-    if (serialPort->available() == MODBUS_REQUEST_BASE_LENGTH + CRC_LEN){
-        serialPort->readBytes(buffer, MODBUS_REQUEST_BASE_LENGTH + CRC_LEN);
-        //digitalWrite(7, toggle2);
-        currentCtx->lastTimestamp = micros();
-        currentCtx->newDataDetected = false;
-        return true;
+    if (serialPort->available() == 0){
+        if (currentCtx->state == FRAME_IDLE){
+            return 0;
+        }
+
+        //Unsigned subtraction handles overflow of timer
+        unsigned long silence = currentTimestamp - currentCtx->lastTimestamp;
+        if (silence >= currentCtx->interFrameTimeout){
+            return modbusFrameEnd(currentCtx);
+        }
+        if (silence >= currentCtx->interCharTimeout && currentCtx->state == FRAME_RECEIVING){
+            currentCtx->state = FRAME_GAP;
+        }
+        return 0;
     }
 
-    if (serialPort->available() == 0){
-        currentCtx->lastTimestamp = micros();
-        return false;
+    if (currentCtx->state == FRAME_GAP){
+        //Characters separated by more than t1.5 (frame is incomplete)
+        currentCtx->state = FRAME_DISCARDING;
+    }
+    currentCtx->lastTimestamp = currentTimestamp;
+
+    int value;
+    while ((value = serialPort->read()) != -1){
+        uint8_t received = value;
+        modbusObserveTraffic(currentCtx->trafficHook, MODBUS_TRAFFIC_RX, currentTimestamp, &received, 1);
+        uint16_t result = modbusFrameAppendByte(currentCtx, buffer, (uint8_t)value);
+        if (result != 0){
+            return result;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Appends received byte to receive ring. Call from UART RX interrupt (or equivalent callback).
+ * Time between bytes is measured here, so frame boundaries (t3.5) and gaps inside frame (t1.5)
+ * are detected exactly, regardless of how often communicationLoop() is called.
+ * 
+ * @param ring Receive ring
+ * @param value Received byte
+ */
+void modbusRingPush(RxRingCtx* ring, uint8_t value){
+    unsigned long currentTimestamp = micros();
+    unsigned long gap = currentTimestamp - ring->lastByteTimestamp;
+    uint16_t entry = value;
+    if (gap >= ring->frame.interFrameTimeout){
+        entry |= RING_FRAME_START;
+    }
+    else if (gap >= ring->frame.interCharTimeout){
+        entry |= RING_CHAR_GAP;
     }
+    ring->lastByteTimestamp = currentTimestamp;
 
-    unsigned long long currentTimestamp = micros();
-    if (currentTimestamp < currentCtx->lastTimestamp){
-        //Overflow occurred
-        currentTimestamp += UINT32_MAX;
+    uint8_t head = ring->head;
+    uint8_t next = (head + 1) & (MODBUS_RX_RING_SIZE - 1);
+    if (next == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)){
+        ring->overflow = true;
+        return;
     }
+    ring->data[head] = entry;
+    #if MODBUS_RX_RING_TIMESTAMPS
+        ring->timestamps[head] = currentTimestamp;
+    #endif
+    __atomic_store_n(&ring->head, next, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->pending, true, __ATOMIC_RELEASE);
+}
 
-    //If buffer is not empty and timeout has passed, clear buffer
-    if (currentCtx->newDataDetected == true && 
-        currentTimestamp - currentCtx->lastTimestamp >= currentCtx->timeout){
-        while(serialPort->read() != -1); //Clear buffer
-        currentCtx->newDataDetected = false;
+/**
+ * @brief Serial read function for interrupt driven receive
+ * Drains bytes stored by modbusRingPush() into the frame buffer. Traffic hook gets runs of bytes without
+ * silence longer than t1.5, stamped with arrival time of their last byte (gaps are kept in capture).
+ * @param buffer Buffer where data will be stored (preserved between calls)
+ * @param ctx Receive ring
+ * @return uint16_t Length of received frame, 0 if none is complete
+ */
+uint16_t ringSerialReadFunction(char* buffer, void* ctx){
+    RxRingCtx* ring = (RxRingCtx*)ctx;
+    SerialCtx* frame = &ring->frame;
+    uint16_t result = 0;
+
+    if (!__atomic_load_n(&ring->pending, __ATOMIC_ACQUIRE)){
+        return 0;
     }
-    else {
-        currentCtx->newDataDetected = true;
+    if (ring->overflow){
+        ring->overflow = false;
+        ++frame->overruns;
+        if (frame->state != FRAME_IDLE){
+            frame->state = FRAME_DISCARDING;
+        }
     }
 
-    currentCtx->lastTimestamp = micros();
-    return false;
+    uint8_t run[MODBUS_RX_RING_SIZE]; //Observed bytes
+    uint8_t runLength = 0;
+    unsigned long runTimestamp = 0;
+    uint8_t tail = ring->tail;
+    while (result == 0 && tail != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)){
+        uint16_t entry = ring->data[tail];
+        if (frame->state != FRAME_IDLE){
+            if (entry & RING_FRAME_START){
+                //Byte starts next frame, so the previous one is complete (byte stays in ring)
+                result = modbusFrameEnd(frame);
+                continue;
+            }
+            if ((entry & RING_CHAR_GAP) && frame->state != FRAME_SKIPPING){
+                frame->state = FRAME_DISCARDING;
+            }
+        }
+        if (frame->trafficHook != NULL){
+            if (runLength == sizeof(run) || (runLength > 0 && (entry & (RING_FRAME_START | RING_CHAR_GAP)))){
+                modbusObserveTraffic(frame->trafficHook, MODBUS_TRAFFIC_RX, runTimestamp, run, runLength);
+                runLength = 0;
+            }
+            run[runLength++] = (uint8_t)entry;
+            #if MODBUS_RX_RING_TIMESTAMPS
+                runTimestamp = ring->timestamps[tail];
+            #else
+                runTimestamp = micros();
+            #endif
+        }
+        tail = (tail + 1) & (MODBUS_RX_RING_SIZE - 1);
+        result = modbusFrameAppendByte(frame, buffer, (uint8_t)entry);
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    if (runLength > 0){
+        modbusObserveTraffic(frame->trafficHook, MODBUS_TRAFFIC_RX, runTimestamp, run, runLength);
+    }
+    if (result != 0){
+        return result;
+    }
+
+    //Ring is empty, check silence after the last byte (timestamp is read twice, as it may be updated meanwhile)
+    if (frame->state != FRAME_IDLE){
+        unsigned long lastTimestamp;
+        do {
+            lastTimestamp = ring->lastByteTimestamp;
+        } while (lastTimestamp != ring->lastByteTimestamp);
+        if (micros() - lastTimestamp >= frame->interFrameTimeout){
+            result = modbusFrameEnd(frame);
+        }
+    }
+    if (frame->state == FRAME_IDLE){
+        __atomic_store_n(&ring->pending, false, __ATOMIC_RELEASE);
+        //Byte could arrive right before the flag was cleared
+        if (tail != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)){
+            __atomic_store_n(&ring->pending, true, __ATOMIC_RELEASE);
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Updates estimated end of transmission after bytes were queued
+ * Line is busy until all previously queued bytes and the new ones are shifted out.
+ * @param ctx Serial port context
+ * @param length Number of queued bytes
+ */
+static void updateTransmitEstimate(SerialCtx* ctx, uint16_t length){
+    unsigned long currentTimestamp = micros();
+    if ((long)(currentTimestamp - ctx->txEndTimestamp) > 0){
+        ctx->txEndTimestamp = currentTimestamp;
+    }
+    ctx->txEndTimestamp += ctx->charTime * length;
 }
 
 /**
@@ -270,6 +1541,51 @@ bool defaultSerialReadFunction(char* buffer, void* ctx){
  * @param ctx Serial port context
  */
 void defaultSerialWriteFunction(const char* buffer, uint16_t length, void* ctx){
-    HardwareSerial* serialPort = (HardwareSerial*)((SerialCtx*)ctx)->serial;
+    SerialCtx* currentCtx = (SerialCtx*)ctx;
+    HardwareSerial* serialPort = (HardwareSerial*)currentCtx->serial;
+    updateTransmitEstimate(currentCtx, length);
+    //Blocks until everything is queued
     serialPort->write((const uint8_t*)buffer, length);
 }
+
+/**
+ * @brief Default non-blocking serial write function
+ * Queues only as many bytes, as fits into transmit buffer of serial port.
+ * @param buffer Buffer which holds data to be sent
+ * @param length Length of data to be sent
+ * @param ctx Serial port context
+ * @return uint16_t Number of queued bytes
+ */
+uint16_t defaultSerialWriteSomeFunction(const char* buffer, uint16_t length, void* ctx){
+    SerialCtx* currentCtx = (SerialCtx*)ctx;
+    HardwareSerial* serialPort = (HardwareSerial*)currentCtx->serial;
+
+    int space = serialPort->availableForWrite();
+    if (space <= 0){
+        return 0;
+    }
+    if (length > (uint16_t)space){
+        length = space;
+    }
+    length = serialPort->write((const uint8_t*)buffer, length);
+    updateTransmitEstimate(currentCtx, length);
+    return length;
+}
+
+/**
+ * @brief Default transmit done function
+ * On AVR, Serial uses TX complete flag of USART, otherwise end of transmission is estimated
+ * from the number of queued bytes and baud rate.
+ * @param ctx Serial port context
+ * @return true If the last byte has left the line
+ */
+bool defaultSerialTransmitDoneFunction(void* ctx){
+    SerialCtx* currentCtx = (SerialCtx*)ctx;
+    #if defined(UCSR0A) && defined(TXC0) && defined(SERIAL_TX_BUFFER_SIZE)
+        HardwareSerial* serialPort = (HardwareSerial*)currentCtx->serial;
+        if (serialPort == &Serial){
+            return serialPort->availableForWrite() == SERIAL_TX_BUFFER_SIZE - 1 && (UCSR0A & _BV(TXC0));
+        }
+    #endif
+    return (long)(micros() - currentCtx->txEndTimestamp) >= 0;
+}
@@ -1,33 +1,115 @@
+#ifndef MODBUS_RTU_H
+#define MODBUS_RTU_H
+
 #include <Arduino.h>
+#include "ModbusCRC.h"
 
 /*Modbus is implemented as non-inverted UART with even parity and 1 stop bit (according to standard). 
-Only ReadInputRegisters, ReadHoldingRegisters and WriteSingleRegister functions are implemented, so the
-standard request packet should consist of 6 bytes + CRC (2 bytes). This can be utilized in various cases,
-like DMA reading, etc. Protocol data, such as are transmitted in big endian.
+Implemented functions are ReadHoldingRegisters, ReadInputRegisters, WriteSingleRegister, WriteMultipleRegisters
+and ReadWriteMultipleRegisters, optionally ReadCoils, ReadDiscreteInputs, WriteSingleCoil, WriteMultipleCoils
+(bit tables), Diagnostics (counter sub-functions) and GetCommEventCounter. Protocol data, such as are transmitted in big endian.
+Frames are assembled byte by byte and delimited by silent interval (t3.5) on the line, so frames of any
+length (up to 256 bytes) are accepted. If the length of frame can be determined from its header, frame is
+accepted as soon as its last byte arrives, so back-to-back frames are not merged. Frames of other devices are
+recognized by the first byte and skipped without buffering and CRC calculation (request of other device is
+expected to be followed by its response, whose length is predicted accordingly). Write requests to broadcast
+address 0 are executed without response.
+ModbusServer<InputN, HoldingN, Functions, Storage> template allows several servers with different register
+layouts and sets of function codes in one firmware, ModbusRTU is the server configured by macros below.
 */
 
-//Adjust if necessary
+//Adjust if necessary (layout of ModbusRTU class, use ModbusServer template for other layouts)
 #define INPUT_REGISTER_NUM 100
 #define HOLDING_REGISTER_NUM 100
 #define USE_EXTERNALL_INPUT_REGISTER_BUFFER false
 #define USE_EXTERNALL_HOLDING_REGISTER_BUFFER false
+#define TRACK_HOLDING_REGISTER_WRITES false //Written holding registers are flagged (see getChangedHoldingRegister())
+#define CONSISTENT_REGISTER_BLOCKS false //Blocks of registers are read and written consistently (sequence lock)
+#define DIAGNOSTICS_COUNTERS false //Error counters and latency histogram, Diagnostics (FC8) and Get_Comm_Event_Counter (FC11)
+#define COIL_NUM 0 //Coils and discrete inputs are stored packed (8 per byte), bit functions are enabled if any exist
+#define DISCRETE_INPUT_NUM 0
+//Registers are stored in big endian (as transmitted), so read responses are built by copying one contiguous
+//block without per-register conversion. Conversion is done by copy functions on the application side
+//(external buffers must be kept in big endian too).
+#define REGISTERS_IN_WIRE_ORDER false
 
 
 //ModbusRTU defines (do not change)
 #define MODBUS_REQUEST_BASE_LENGTH 6
 #define MODBUS_RESPONSE_BASE_LEN 3
 #define CRC_LEN 2
+#define MODBUS_MIN_FRAME_LEN 4 //Address + function code + CRC
+#define MODBUS_MAX_FRAME_LEN 256
+#define MODBUS_FRAME_CRC_OK 0x8000 //Flag returned by read function together with length, if CRC was already verified
+#define MODBUS_BROADCAST_ADDRESS 0 //Write requests to this address are executed by all devices without response
+#define MODBUS_TCP_DEVICE_UNIT 0xFF //Unit ID of device itself on Modbus TCP (as well as 0, there is no broadcast)
+#define MODBUS_MAX_SLAVE_ADDRESS 247 //Addresses above are reserved on serial line
+
+//Silent intervals (in microseconds) for baud rates above 19200, otherwise 1.5 and 3.5 character times
+#define MODBUS_FIXED_T15 750UL
+#define MODBUS_FIXED_T35 1750UL
+#define MODBUS_FIXED_TIMING_BAUD 19200UL
+#define MODBUS_CHAR_BITS 11 //1 start bit + 8 data bits + parity + 1 stop bit
 
+#define FC_READ_COILS 1
+#define FC_READ_DISCRETE_INPUTS 2
 #define FC_READ_HOLDING_REGISTERS 3
 #define FC_READ_INPUT_REGISTERS 4
+#define FC_WRITE_SINGLE_COIL 5
 #define FC_WRITE_SINGLE_REGISTER 6
-//#define FC_WRITE_MULTIPLE_REGISTERS 16
+#define FC_DIAGNOSTICS 8
+#define FC_GET_COMM_EVENT_COUNTER 11
+#define FC_WRITE_MULTIPLE_COILS 15
+#define FC_WRITE_MULTIPLE_REGISTERS 16
+#define FC_READ_WRITE_MULTIPLE_REGISTERS 23
 
 #define EX_ILLEGAL_FUNCTION 1
 #define EX_ILLEGAL_ADDRESS 2
+#define EX_ILLEGAL_VALUE 3
 //#define EX_SERVER_BUSY 6
+#define EX_GATEWAY_PATH_UNAVAILABLE 10
+#define EX_GATEWAY_TARGET_FAILED 11
 #define MAX_READ_REGISTER_COUNT 125
 #define MAX_WRITE_REGISTER_COUNT 123
+#define MAX_READ_WRITE_REGISTER_COUNT 121
+#define MAX_READ_BIT_COUNT 2000
+#define MAX_WRITE_BIT_COUNT 1968
+#define COIL_ON 0xFF00 //Value of Write_Single_Coil, which sets the coil (0 clears it)
+
+//Function codes, which may be broadcast (writes only, reads would require response)
+static inline bool isBroadcastFunction(uint8_t functionCode){
+    switch (functionCode){
+        case FC_WRITE_SINGLE_COIL:
+        case FC_WRITE_SINGLE_REGISTER:
+        case FC_WRITE_MULTIPLE_COILS:
+        case FC_WRITE_MULTIPLE_REGISTERS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+//Sub-functions of Diagnostics (FC8)
+#define DIAG_RETURN_QUERY_DATA 0x00
+#define DIAG_CLEAR_COUNTERS 0x0A
+#define DIAG_BUS_MESSAGE_COUNT 0x0B
+#define DIAG_BUS_COMMUNICATION_ERROR_COUNT 0x0C
+#define DIAG_BUS_EXCEPTION_ERROR_COUNT 0x0D
+#define DIAG_SERVER_MESSAGE_COUNT 0x0E
+#define DIAG_SERVER_NO_RESPONSE_COUNT 0x0F
+#define DIAG_SERVER_NAK_COUNT 0x10
+#define DIAG_SERVER_BUSY_COUNT 0x11
+#define DIAG_BUS_CHARACTER_OVERRUN_COUNT 0x12
+#define DIAG_CLEAR_OVERRUN_COUNTER 0x14
+//Library specific sub-functions (not defined by standard)
+#define DIAG_DISCARDED_FRAME_COUNT 0x20
+#define DIAG_LATENCY_BUCKET 0x30 //Bucket n of latency histogram is read by sub-function DIAG_LATENCY_BUCKET + n
+
+//Events of served frames passed to diagnostics hook of server
+#define MODBUS_DIAG_FRAME 0 //Frame received (any address)
+#define MODBUS_DIAG_CRC_ERROR 1 //Frame handled by server has invalid CRC
+#define MODBUS_DIAG_NO_RESPONSE 2 //Broadcast executed without response
+#define MODBUS_DIAG_RESPONSE 3 //Response is going to be sent
 
 //Used to put 16-bit value into buffer of bytes
 #define put_16bit_into_byte_buffer(buffer, offset, value) {(buffer)[(offset) + 1] = ((value) & 0xff00) >> 8; (buffer)[(offset)] = (value) & 0xff;}
@@ -38,9 +120,18 @@ like DMA reading, etc. Protocol data, such as are transmitted in big endian.
 //Used to swap endianity
 #define endianity_swap_16bit(value) ((uint16_t)(((value) & 0xff) << 8) | (((value) & 0xff00) >> 8))
 
-//Packet struct
+//Used to convert between register storage and host byte order
+#if REGISTERS_IN_WIRE_ORDER
+    #define register_from_host(value) endianity_swap_16bit(value)
+    #define register_to_host(value) endianity_swap_16bit(value)
+#else
+    #define register_from_host(value) (value)
+    #define register_to_host(value) (value)
+#endif
+
+//Packet struct (request is received and response is built in the same buffer)
 typedef union {
-    uint8_t raw_data[MODBUS_REQUEST_BASE_LENGTH + CRC_LEN + 1];
+    uint8_t raw_data[MODBUS_MAX_FRAME_LEN];
     struct {
         uint8_t address;
         uint8_t function_code;
@@ -54,87 +145,192 @@ typedef union {
     };
 } request_packet; 
 
+//States of frame assembler
+#define FRAME_IDLE 0
+#define FRAME_RECEIVING 1
+#define FRAME_GAP 2 //Silence longer than t1.5 was detected inside frame
+#define FRAME_DISCARDING 3 //Frame is invalid, waiting for t3.5 silence
+#define FRAME_SKIPPING 4 //Frame of other device, bytes are counted until its predicted end (or t3.5 silence)
+
+//Slave addresses accepted by server. Frame assembler checks the first byte of frame, frames of other devices
+//are skipped without buffering and CRC calculation (function is NULL for master, which accepts everything).
+typedef struct {
+    bool (*function)(uint8_t address, void* ctx);
+    void* ctx;
+} ModbusAddressFilter;
+
+//Direction of observed traffic (ModbusTrafficHook)
+#define MODBUS_TRAFFIC_RX 0
+#define MODBUS_TRAFFIC_TX 1
+
+//Observer of raw traffic of port (i.e. ModbusCapture). Function gets bytes delivered to frame assembler
+//and frames sent by port, with time (micros()) when they were received or sent.
+typedef struct {
+    void (*function)(uint8_t direction, unsigned long timestamp, const uint8_t* data, uint16_t length, void* ctx);
+    void* ctx;
+} ModbusTrafficHook;
+
+static inline void modbusObserveTraffic(const ModbusTrafficHook* hook, uint8_t direction, unsigned long timestamp,
+    const uint8_t* data, uint16_t length){
+    if (hook != NULL && hook->function != NULL){
+        hook->function(direction, timestamp, data, length, hook->ctx);
+    }
+}
+
 typedef struct {
     void* serial;
-    unsigned long timeout;
-    unsigned long lastTimestamp;
-    bool newDataDetected;
+    unsigned long interCharTimeout; //t1.5 in microseconds
+    unsigned long interFrameTimeout; //t3.5 in microseconds
+    unsigned long charTime; //Time of one character in microseconds
+    unsigned long lastTimestamp; //Time when last received byte was detected
+    unsigned long txEndTimestamp; //Estimated time when the last queued byte leaves the line
+    uint16_t length; //Number of bytes of currently assembled frame
+    uint16_t crc; //CRC of received bytes (incremental CRC only)
+    uint8_t state;
+    uint16_t (*frameLength)(const uint8_t* frame, uint16_t length); //Predicts length of frame from its header
+    //Frames dropped by frame assembler (counters wrap around)
+    uint16_t crcErrors;
+    uint16_t discardedFrames; //Frames containing silence longer than t1.5, or longer than MODBUS_MAX_FRAME_LEN
+    uint16_t overruns; //Receive ring overflows (bytes were lost)
+    uint16_t skippedFrames; //Frames of other devices
+    const ModbusAddressFilter* addressFilter; //Set by port (NULL if frames are not filtered)
+    uint16_t skipLength; //Predicted length of skipped frame, 0 if unknown (yet)
+    uint8_t skippedRequest; //Address of device, whose request was skipped last (its response follows), 0 if none
+    bool skippingResponse; //Skipped frame is response of other device
+    const ModbusTrafficHook* trafficHook; //Set by port (NULL if traffic is not observed)
 } SerialCtx;
 
 
-//CRC table
-static const uint16_t crc_table[256] = {
-	0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
-	0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
-	0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
-	0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
-	0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
-	0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
-	0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
-	0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
-	0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
-	0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
-	0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
-	0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
-	0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
-	0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
-	0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
-	0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
-	0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
-	0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
-	0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
-	0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
-	0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
-	0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
-	0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
-	0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
-	0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
-	0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
-	0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
-	0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
-	0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
-	0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
-	0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
-	0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040 };
-
-extern bool defaultSerialReadFunction(char* buffer, void* ctx);
+extern uint16_t modbusRequestLength(const uint8_t* frame, uint16_t length);
+extern uint16_t modbusResponseLength(const uint8_t* frame, uint16_t length);
+//Receive ring for interrupt driven receive (size must be power of 2)
+#define MODBUS_RX_RING_SIZE 64
+#define RING_FRAME_START 0x100 //Byte was preceded by silence longer than t3.5
+#define RING_CHAR_GAP 0x200 //Byte was preceded by silence longer than t1.5
+//Interrupt stores arrival time of every byte (4 bytes of RAM per entry), so traffic hook (capture) gets exact
+//times. Otherwise bytes are stamped with the time they are taken from the ring.
+#ifndef MODBUS_RX_RING_TIMESTAMPS
+    #define MODBUS_RX_RING_TIMESTAMPS true
+#endif
+
+typedef struct {
+    uint16_t data[MODBUS_RX_RING_SIZE]; //Received byte + flags
+    #if MODBUS_RX_RING_TIMESTAMPS
+        unsigned long timestamps[MODBUS_RX_RING_SIZE]; //Arrival time of each byte
+    #endif
+    volatile uint8_t head; //Written by interrupt
+    volatile uint8_t tail; //Written by communicationLoop()
+    volatile bool pending; //Set when byte is received, cleared when ring is drained and no frame is in progress
+    volatile bool overflow;
+    volatile unsigned long lastByteTimestamp;
+    SerialCtx frame; //Frame assembler state
+} RxRingCtx;
+
+extern void initSerialCtx(SerialCtx* ctx, void* serial, unsigned long baudRate);
+//Frame assembler shared by read functions (see defaultSerialReadFunction() for usage)
+extern uint16_t modbusFrameAppendByte(SerialCtx* ctx, char* buffer, uint8_t value);
+extern uint16_t modbusFrameEnd(SerialCtx* ctx);
+extern void modbusRingPush(RxRingCtx* ring, uint8_t value);
+extern uint16_t ringSerialReadFunction(char* buffer, void* ctx);
+extern uint16_t defaultSerialReadFunction(char* buffer, void* ctx);
 extern void defaultSerialWriteFunction(const char* buffer, uint16_t length, void* ctx);
+extern uint16_t defaultSerialWriteSomeFunction(const char* buffer, uint16_t length, void* ctx);
+extern bool defaultSerialTransmitDoneFunction(void* ctx);
 
-class ModbusRTU{
+//Mask of enabled function codes (template parameter of ModbusServer)
+#define MODBUS_FC_MASK(fc) (1UL << (fc))
+#define MODBUS_FUNCTIONS_ALL (MODBUS_FC_MASK(FC_READ_HOLDING_REGISTERS) | MODBUS_FC_MASK(FC_READ_INPUT_REGISTERS) | \
+    MODBUS_FC_MASK(FC_WRITE_SINGLE_REGISTER) | MODBUS_FC_MASK(FC_WRITE_MULTIPLE_REGISTERS) | \
+    MODBUS_FC_MASK(FC_READ_WRITE_MULTIPLE_REGISTERS))
+#define MODBUS_FUNCTIONS_DIAGNOSTICS (MODBUS_FC_MASK(FC_DIAGNOSTICS) | MODBUS_FC_MASK(FC_GET_COMM_EVENT_COUNTER))
+#define MODBUS_FUNCTIONS_BITS (MODBUS_FC_MASK(FC_READ_COILS) | MODBUS_FC_MASK(FC_READ_DISCRETE_INPUTS) | \
+    MODBUS_FC_MASK(FC_WRITE_SINGLE_COIL) | MODBUS_FC_MASK(FC_WRITE_MULTIPLE_COILS))
 
-    private:
-    uint16_t deviceAddress;
+//Storage policy flags (template parameter of ModbusServer), registers are owned by server by default
+#define MODBUS_EXTERNAL_INPUT_REGISTERS 0x01 //Input registers are in user buffer (setInputRegistersBuffer())
+#define MODBUS_EXTERNAL_HOLDING_REGISTERS 0x02 //Holding registers are in user buffer (setHoldingRegistersBuffer())
+#define MODBUS_TRACK_HOLDING_WRITES 0x04 //Written holding registers are flagged in bitmap (with unit ID of writer)
+#define MODBUS_CONSISTENT_REGISTERS 0x08 //Register banks are protected by sequence lock (see ModbusRegisterSequence)
+#define MODBUS_DIAGNOSTICS 0x10 //Server collects diagnostics (required by FC8 and FC11, see ModbusDiagnostics)
+
+//Sequence counter must be read by single instruction (8 bits on AVR)
+#ifdef __AVR__
+    typedef uint8_t modbus_sequence_t;
+#else
+    typedef uint32_t modbus_sequence_t;
+#endif
+
+/*Sequence lock of register banks. Writer makes counter odd before it modifies registers and even
+after it is done, reader repeats copy of block until counter was even and unchanged during the copy.
+Producer (i.e. ADC interrupt or other thread) thus never waits and every Modbus read returns block
+written by one copy function call. There must be only one writer of bank at a time (Modbus requests write
+holding registers from communicationLoop()) and reader must not interrupt writer (readers must not run
+in interrupt).
+*/
+typedef struct {
+    volatile modbus_sequence_t input;
+    volatile modbus_sequence_t holding;
+} ModbusRegisterSequence;
+
+//Latency histogram, bucket n counts responses started less than MODBUS_LATENCY_BUCKET_US << n after
+//the end of request (the last bucket counts all slower responses)
+#define MODBUS_LATENCY_BUCKETS 8
+#define MODBUS_LATENCY_BUCKET_US 250UL
+
+/*Diagnostics of server (all ports together). Counters are 16-bit and wrap around, as defined by standard
+for FC8 counters. Frames dropped by frame assembler of default and ring read functions are counted per port
+(see SerialCtx) and added when diagnostics are read.
+*/
+typedef struct {
+    uint16_t busMessages; //Frames detected on the line (including invalid frames and frames of other devices)
+    uint16_t busCommunicationErrors; //Frames with CRC error (frames of other devices are not checked)
+    uint16_t busExceptionErrors; //Exception responses sent
+    uint16_t serverMessages; //Requests addressed to server (device address, unit ID or broadcast)
+    uint16_t serverNoResponses; //Requests, which were not answered (broadcast)
+    uint16_t characterOverruns; //Receive ring overflows
+    uint16_t discardedFrames; //Frames broken by silence longer than t1.5 or longer than MODBUS_MAX_FRAME_LEN
+    uint16_t commEvents; //Successfully completed requests (event counter of Get_Comm_Event_Counter)
+    uint16_t latency[MODBUS_LATENCY_BUCKETS]; //Time from the end of request to the start of response
+} ModbusDiagnostics;
+
+typedef struct {
+    void(*function) (uint8_t* buffer, uint16_t bufferLen, void* ctx);
+    void* ctx;
+} ModbusEvent;
+
+/*Serial port served by Modbus server or master (frame buffer, frame assembly and transmit state).
+Server has one built-in port, additional ports are attached by addPort(), so one register bank
+is shared by several RS-485 segments. Each port has its own read/write functions and timing.
+*/
+class ModbusPort{
+    friend class ModbusRTUBase;
 
-    unsigned long timeout = 0; //Milliseconds
-    unsigned long lastTimestamp = 0;
-    SerialCtx defaultSerialCtx{NULL, 0, 0, false};
+    protected:
+    SerialCtx defaultSerialCtx{NULL, MODBUS_FIXED_T15, MODBUS_FIXED_T35, 0, 0, 0, 0, MODBUS_CRC_INIT, FRAME_IDLE, modbusRequestLength,
+        0, 0, 0, 0, &addressFilter, 0, 0, false, &trafficHook};
+    ModbusAddressFilter addressFilter = {NULL, NULL}; //Set by server
+    ModbusTrafficHook trafficHook = {NULL, NULL};
+    request_packet rxFrame;
 
     void* serialReadCtx = &defaultSerialCtx;
     void* serialWriteCtx = &defaultSerialCtx;
-    bool (*serialReadFunction)(char* buffer, void* ctx) = defaultSerialReadFunction;
+    uint16_t (*serialReadFunction)(char* buffer, void* ctx) = defaultSerialReadFunction;
     void (*serialWriteFunction)(const char* buffer, uint16_t length, void* ctx) = defaultSerialWriteFunction;
+    bool (*serialTransmitDoneFunction)(void* ctx) = defaultSerialTransmitDoneFunction;
 
-    # if !USE_EXTERNALL_INPUT_REGISTER_BUFFER
-        uint16_t inputRegisters[INPUT_REGISTER_NUM] = {0};
-    # else
-        uint16_t* inputRegisters = NULL;
-    # endif
+    RxRingCtx* rxRing = NULL;
 
+    //Asynchronous transmit (response is sent from frame buffer, so no frame is received meanwhile)
+    uint16_t (*serialWriteSomeFunction)(const char* buffer, uint16_t length, void* ctx) = NULL;
+    const volatile uint8_t* txData = NULL;
+    volatile uint16_t txRemaining = 0;
+    volatile bool txBusy = false;
+    volatile bool txCompleteSignaled = false;
+    int16_t driverEnablePin = -1;
 
-    void(*readInputRegistersEvent) (uint8_t* buffer, uint16_t bufferLen, void* ctx) = NULL;
-    void* readInputRegistersEventCtx = NULL;
-    
-    # if !USE_EXTERNALL_HOLDING_REGISTER_BUFFER
-        uint16_t holdingRegisters[HOLDING_REGISTER_NUM] = {0};
-    # else
-        uint16_t* holdingRegisters = NULL;
-    # endif
-
-    void(*readHoldingRegistersEvent) (uint8_t* buffer, uint16_t bufferLen, void* ctx) = NULL;
-    void* readHoldingRegistersEventCtx = NULL;
-    void(*writeHoldingRegisterEvent) (uint8_t* buffer, uint16_t bufferLen, void* ctx) = NULL;
-    void* writeHoldingRegisterEventCtx = NULL;
-
+    ModbusPort* nextPort = NULL; //Next port served by the same server
+    const SerialCtx* customFrameCtx = NULL; //Frame assembler of custom read function (set by setFrameCtx())
+    bool tcpPort = false; //Requests come from TCP clients, which wait for response to every request
 
     public:
     /**
@@ -148,75 +344,389 @@ class ModbusRTU{
      * @brief Sets custom serial read function
      * This function must accept two parameters: pointer to buffer, where data will be stored
      * and pointer to context (serial port object, or any other user-defined data)
-     * Function must return true if data was read successfully, false otherwise
+     * Buffer is MODBUS_MAX_FRAME_LEN bytes long and its content is preserved between calls until
+     * complete frame is returned, so frame can be assembled incrementally.
+     * Function must return length of complete frame (including CRC), 0 if no frame is ready.
+     * If function already verified CRC of the frame, it may return length | MODBUS_FRAME_CRC_OK.
      * @param readFunction Function pointer to custom read function
      * @param readCtx User-defined context, which will be passed to read function
      */
-    void setSerialReadFunction(bool (*readFunction)(char* buffer, void* ctx), void* readCtx){
+    void setSerialReadFunction(uint16_t (*readFunction)(char* buffer, void* ctx), void* readCtx){
         serialReadFunction = readFunction;
         serialReadCtx = readCtx;
+        rxRing = NULL;
+        customFrameCtx = NULL;
     }
 
+    /**
+     * @brief Sets frame assembler of custom read function (which uses modbusFrameAppendByte()), so its
+     * error counters are visible to the port (frames dropped by assembler never reach communicationLoop()).
+     * Call after setSerialReadFunction().
+     */
+    void setFrameCtx(const SerialCtx* ctx){customFrameCtx = ctx;}
+
     /**
      * @brief Sets custom serial write function
      * This function must accept three parameters: pointer to buffer, which holds data to be sent,
      * length of data to be sent and pointer to context (serial port object, or any other user-defined data)
+     * Buffered write function returns before the last byte has left the line, driver enable pin
+     * (see setDriverEnablePin()) is released only after done function returns true.
      * @param writeFunction Function pointer to custom write function
-     * @param writeCtx User-defined context, which will be passed to write function
+     * @param writeCtx User-defined context, which will be passed to both functions
+     * @param doneFunction Function pointer to transmit done function (true once the last byte has physically
+     * left the line), NULL if write function returns only then
      */
-    void setSerialWriteFunction(void (*writeFunction)(const char* buffer, uint16_t length,  void* ctx), void* writeCtx){
+    void setSerialWriteFunction(void (*writeFunction)(const char* buffer, uint16_t length,  void* ctx), void* writeCtx,
+        bool (*doneFunction)(void* ctx) = NULL){
         serialWriteFunction = writeFunction;
         serialWriteCtx = writeCtx;
+        serialWriteSomeFunction = NULL;
+        serialTransmitDoneFunction = doneFunction;
     }
 
     /**
-     * @brief Sets custom serial read function
-     * This function must accept two parameters: pointer to buffer, where data will be stored
-     * and pointer to context (serial port object, or any other user-defined data)
+     * @brief Enables interrupt driven receive. Received bytes are appended to the ring by receiveByteISR()
+     * (called from UART RX interrupt or equivalent callback), so idle communicationLoop() only checks one flag.
+     * @param ring Receive ring (must exist as long as the server)
      */
+    void setInterruptReceive(RxRingCtx* ring);
 
     /**
-     * @brief Sets custom buffer for input registers
-     * @param inputs Input registers
+     * @brief Stores received byte, call from UART RX interrupt (interrupt receive must be enabled)
      */
-    #if USE_EXTERNALL_INPUT_REGISTER_BUFFER
-        void setInputRegistersBuffer(uint16_t* inputs){inputRegisters = inputs;}
-    #endif
+    void receiveByteISR(uint8_t value){modbusRingPush(rxRing, value);}
 
     /**
-     * @brief Sets event, which will be called when input registers are read (right before response is sent)
-     * @param event Function pointer to event handler
-     * @param ctx User-defined context, which will be passed to event handler
+     * @brief Enables asynchronous (non-blocking) transmit on serial port set by setCustomSerialPort() (Serial by default).
+     * communicationLoop() queues the response and returns immediately, remaining bytes are fed
+     * to the serial port from subsequent calls as space in its transmit buffer becomes available.
      */
-    void setReadInputRegistersEvent(void(*event) (uint8_t* buffer, uint16_t bufferLen, void* ctx), void* ctx){
-        readInputRegistersEvent = event; readInputRegistersEventCtx = ctx;}
+    void useAsyncTransmit(){
+        serialWriteSomeFunction = defaultSerialWriteSomeFunction;
+        serialTransmitDoneFunction = defaultSerialTransmitDoneFunction;
+        serialWriteCtx = &defaultSerialCtx;
+    }
 
+    /**
+     * @brief Sets custom asynchronous serial write functions
+     * Write function must accept as many bytes as possible without blocking and return their number
+     * (DMA driver may start transfer of the whole buffer and return its length).
+     * Done function must return true once the last byte has physically left the line. It may be NULL,
+     * then transmitCompleteISR() must be called from TX complete interrupt (or DMA completion callback).
+     * @param writeFunction Function pointer to non-blocking write function
+     * @param doneFunction Function pointer to transmit done function (may be NULL)
+     * @param writeCtx User-defined context, which will be passed to both functions
+     */
+    void setAsyncSerialWriteFunction(uint16_t (*writeFunction)(const char* buffer, uint16_t length, void* ctx),
+        bool (*doneFunction)(void* ctx), void* writeCtx){
+        serialWriteSomeFunction = writeFunction;
+        serialTransmitDoneFunction = doneFunction;
+        serialWriteCtx = writeCtx;
+    }
 
     /**
-     * @brief Sets custom buffer for input registers
-     * @param inputs Input registers
-     * @param size Length of buffer
+     * @brief Sets RS-485 driver enable (DE) pin. Pin is driven HIGH while response is transmitted
+     * and released (LOW) at the end of frame. Set to -1 to disable.
+     * The end of frame is known from transmit done function (built-in one for default Serial, otherwise
+     * given to setSerialWriteFunction() or setAsyncSerialWriteFunction()), or from transmitCompleteISR()
+     * with asynchronous transmit. Without them pin is released as soon as write function returns.
      */
-    #if USE_EXTERNALL_HOLDING_REGISTER_BUFFER
-        void setHoldingRegistersBuffer(uint16_t* holding){holdingRegisters = holding;}
-    #endif
+    void setDriverEnablePin(int16_t pin);
 
     /**
-     * @brief Sets event, which will be called when holding registers are read (right before response is sent)
-     * @param event Function pointer to event handler
-     * @param ctx User-defined context, which will be passed to event handler
+     * @brief Signals that transmission is complete. Call from TX complete interrupt
+     * or from DMA completion callback. Driver enable pin is released immediately.
      */
-    void setReadHoldingRegistersEvent(void(*event) (uint8_t* buffer, uint16_t bufferLen, void* ctx), void* ctx){
-        readHoldingRegistersEvent = event; readHoldingRegistersEventCtx = ctx;}
+    void transmitCompleteISR();
 
     /**
-     * @brief Sets event, which will be called when holding register is written (right before data are written)
-     * @param event Function pointer to event handler
-     * @param ctx User-defined context, which will be passed to event handler
+     * @brief Whether response is being transmitted (application may schedule work around it)
      */
-    void setWriteHoldingRegisterEvent(void(*event) (uint8_t* buffer, uint16_t bufferLen, void* ctx), void* ctx){
-        writeHoldingRegisterEvent = event; writeHoldingRegisterEventCtx = ctx;}
+    bool isTransmitting(){return txBusy;}
+
+    /**
+     * @brief Initializes timing of port (silent intervals) for given baud rate.
+     * Serial port itself must be configured and initialized in user code.
+     */
+    void begin(unsigned long baudRate);
+
+    /**
+     * @brief Addresses accepted by server of this port, for frame assemblers of custom read functions
+     * (SerialCtx::addressFilter). Filter is filled once port is attached to server.
+     */
+    const ModbusAddressFilter* getAddressFilter(){return &addressFilter;}
+
+    /**
+     * @brief Sets observer of raw traffic (received bytes and sent frames), i.e. ModbusCapture.
+     * With interrupt receive, bytes are observed when communicationLoop() takes them from the ring.
+     * @param function Function pointer (NULL to disable)
+     * @param ctx User-defined context, which will be passed to function
+     */
+    void setTrafficHook(void (*function)(uint8_t direction, unsigned long timestamp, const uint8_t* data, uint16_t length,
+        void* ctx), void* ctx){
+        trafficHook.function = function; trafficHook.ctx = ctx;}
+
+    /**
+     * @brief Traffic observer of port, for custom read functions (SerialCtx::trafficHook)
+     */
+    const ModbusTrafficHook* getTrafficHook(){return &trafficHook;}
+
+    protected:
+    static bool calculateCRC(volatile uint8_t* data, uint16_t length, bool append_crc);
 
+    /**
+     * @brief Frame assembler of read function in use, NULL if unknown (custom read function without setFrameCtx())
+     */
+    const SerialCtx* getFrameCtx(){
+        return rxRing != NULL ? &rxRing->frame : (serialReadCtx == &defaultSerialCtx ? &defaultSerialCtx : customFrameCtx);}
+    uint16_t receiveFrame();
+    unsigned long frameEndTimestamp();
+    void sendFrame(uint16_t length);
+    void continueTransmit();
+};
+
+/*View of register bank for one unit ID (slave address). Register 0 of the unit is register
+inputOffset/holdingOffset of the bank and only first inputCount/holdingCount registers are visible.
+Bit tables are viewed the same way (unit sees no coils and discrete inputs if their counts are left 0).
+*/
+typedef struct ModbusUnit {
+    uint8_t address;
+    uint16_t inputOffset;
+    uint16_t inputCount;
+    uint16_t holdingOffset;
+    uint16_t holdingCount;
+    struct ModbusUnit* next; //Used by server
+    uint16_t coilOffset;
+    uint16_t coilCount;
+    uint16_t discreteInputOffset;
+    uint16_t discreteInputCount;
+} ModbusUnit;
+
+/*Block of registers computed on demand instead of being copied in ahead of time (i.e. averaged ADC value,
+statistics). Function is called when read request covers registers of the block, only for the requested part,
+and stores host order values into given buffer (addresses are bank addresses), which are then copied into the
+register bank. With maxAge the whole block (at most MAX_READ_REGISTER_COUNT registers) is computed at once and
+reused until it is older than maxAge milliseconds. Registers of the block must exist in the bank and must have
+no other producer (server writes them, see ModbusRegisterSequence). Provider is added by addInputProvider() /
+addHoldingProvider() and must exist as long as the server.
+*/
+typedef struct ModbusProvider {
+    uint16_t first;
+    uint16_t count;
+    void (*function)(uint16_t* values, uint16_t first, uint16_t count, void* ctx);
+    void* ctx;
+    unsigned long maxAge; //Milliseconds, 0 to call function on every read
+    struct ModbusProvider* next; //Used by server
+    unsigned long updated; //Used by server
+    bool valid; //Used by server, clear to recompute cached block by the next read
+} ModbusProvider;
+
+//Packed bit table (coils or discrete inputs), bit n is bit n % 8 of byte n / 8 (as transmitted)
+typedef struct {
+    uint8_t* bits;
+    uint16_t count;
+} ModbusBitTable;
+
+class ModbusRTUBase;
+//Routes request to handlers of enabled function codes (provided by ModbusServer)
+typedef uint16_t (*ModbusRequestDispatcher)(ModbusRTUBase* server, request_packet* packet, uint16_t length, int16_t* writtenValue);
+
+/*Protocol engine shared by all server layouts (serial ports, request handlers, unit IDs).
+Register storage, events and enabled function codes are provided by ModbusServer template,
+so handlers of disabled function codes are never referenced and are removed by linker.
+*/
+class ModbusRTUBase{
+
+    private:
+    uint16_t deviceAddress;
+    ModbusPort primaryPort;
+    ModbusUnit* units = NULL;
+    const ModbusUnit* activeUnit = NULL; //Unit of request being handled, NULL for device address
+    ModbusProvider* inputProviders = NULL;
+    ModbusProvider* holdingProviders = NULL;
+
+    ModbusRequestDispatcher requestDispatcher;
+    //Called after holding registers were written (bank addresses), set by ModbusServer if writes are tracked
+    void (*holdingWriteHook)(ModbusRTUBase* server, uint16_t first, uint16_t count, uint8_t unit) = NULL;
+    //Called after holding registers were written (bank addresses), set by application (i.e. ModbusJournal)
+    void (*holdingWrittenFunction)(uint16_t first, uint16_t count, void* ctx) = NULL;
+    void* holdingWrittenCtx = NULL;
+    ModbusRegisterSequence* registerSequence = NULL; //Set by ModbusServer if banks are consistent
+    //Counts served frames (MODBUS_DIAG_* events), set by ModbusServer if diagnostics are collected
+    void (*diagnosticsHook)(ModbusRTUBase* server, uint8_t event, ModbusPort* port, const request_packet* packet) = NULL;
+    ModbusBitTable coils = {NULL, 0}; //Set by ModbusServer
+    ModbusBitTable discreteInputs = {NULL, 0};
+
+    //Register maps (dense buffers of ModbusServer, or custom maps, i.e. SparseRegisterMap)
+    uint16_t* (*inputRegisterResolver)(uint16_t first, uint16_t count, void* ctx) = NULL;
+    void* inputRegisterResolverCtx = NULL;
+    uint16_t* (*holdingRegisterResolver)(uint16_t first, uint16_t count, void* ctx) = NULL;
+    void* holdingRegisterResolverCtx = NULL;
+
+    protected:
+    ModbusRTUBase(ModbusRequestDispatcher dispatcher) : requestDispatcher(dispatcher){
+        primaryPort.addressFilter.function = acceptsAddress;
+        primaryPort.addressFilter.ctx = this;
+    }
+    void setHoldingWriteHook(void (*hook)(ModbusRTUBase* server, uint16_t first, uint16_t count, uint8_t unit)){
+        holdingWriteHook = hook;}
+    void setRegisterSequence(ModbusRegisterSequence* sequence){registerSequence = sequence;}
+    void setDiagnosticsHook(void (*hook)(ModbusRTUBase* server, uint8_t event, ModbusPort* port, const request_packet* packet)){
+        diagnosticsHook = hook;}
+    void setBitTables(uint8_t* coilBits, uint16_t coilCount, uint8_t* discreteBits, uint16_t discreteCount){
+        coils.bits = coilBits; coils.count = coilCount;
+        discreteInputs.bits = discreteBits; discreteInputs.count = discreteCount;}
+
+    public:
+    /**
+     * @brief Sets custom serial port context to be used for communication (built-in port)
+     * Configuration and initialization of this port must be done in user code
+     * 
+     */
+    void setCustomSerialPort(void* customSerial){primaryPort.setCustomSerialPort(customSerial);}
+
+    /**
+     * @brief Sets custom serial read function of built-in port, see ModbusPort::setSerialReadFunction()
+     */
+    void setSerialReadFunction(uint16_t (*readFunction)(char* buffer, void* ctx), void* readCtx){
+        primaryPort.setSerialReadFunction(readFunction, readCtx);}
+
+    /**
+     * @brief Sets custom serial write function of built-in port, see ModbusPort::setSerialWriteFunction()
+     */
+    void setSerialWriteFunction(void (*writeFunction)(const char* buffer, uint16_t length,  void* ctx), void* writeCtx,
+        bool (*doneFunction)(void* ctx) = NULL){
+        primaryPort.setSerialWriteFunction(writeFunction, writeCtx, doneFunction);}
+
+    /**
+     * @brief Enables interrupt driven receive on built-in port, see ModbusPort::setInterruptReceive()
+     */
+    void setInterruptReceive(RxRingCtx* ring){primaryPort.setInterruptReceive(ring);}
+
+    /**
+     * @brief Stores received byte of built-in port, call from UART RX interrupt
+     */
+    void receiveByteISR(uint8_t value){primaryPort.receiveByteISR(value);}
+
+    /**
+     * @brief Enables asynchronous transmit on built-in port, see ModbusPort::useAsyncTransmit()
+     */
+    void useAsyncTransmit(){primaryPort.useAsyncTransmit();}
+
+    /**
+     * @brief Sets custom asynchronous serial write functions of built-in port,
+     * see ModbusPort::setAsyncSerialWriteFunction()
+     */
+    void setAsyncSerialWriteFunction(uint16_t (*writeFunction)(const char* buffer, uint16_t length, void* ctx),
+        bool (*doneFunction)(void* ctx), void* writeCtx){
+        primaryPort.setAsyncSerialWriteFunction(writeFunction, doneFunction, writeCtx);}
+
+    /**
+     * @brief Sets RS-485 driver enable pin of built-in port, see ModbusPort::setDriverEnablePin()
+     */
+    void setDriverEnablePin(int16_t pin){primaryPort.setDriverEnablePin(pin);}
+
+    /**
+     * @brief Signals that transmission on built-in port is complete, see ModbusPort::transmitCompleteISR()
+     */
+    void transmitCompleteISR(){primaryPort.transmitCompleteISR();}
+
+    /**
+     * @brief Whether response is being transmitted on built-in port
+     */
+    bool isTransmitting(){return primaryPort.isTransmitting();}
+
+    /**
+     * @brief Addresses accepted by server on built-in port, see ModbusPort::getAddressFilter()
+     */
+    const ModbusAddressFilter* getAddressFilter(){return primaryPort.getAddressFilter();}
+
+    /**
+     * @brief Sets observer of raw traffic of built-in port, see ModbusPort::setTrafficHook()
+     */
+    void setTrafficHook(void (*function)(uint8_t direction, unsigned long timestamp, const uint8_t* data, uint16_t length,
+        void* ctx), void* ctx){
+        primaryPort.setTrafficHook(function, ctx);}
+
+    /**
+     * @brief Traffic observer of built-in port, see ModbusPort::getTrafficHook()
+     */
+    const ModbusTrafficHook* getTrafficHook(){return primaryPort.getTrafficHook();}
+
+    /**
+     * @brief Sets frame assembler of custom read function of built-in port, see ModbusPort::setFrameCtx()
+     */
+    void setFrameCtx(const SerialCtx* ctx){primaryPort.setFrameCtx(ctx);}
+
+    /**
+     * @brief Sets function called after holding registers were written by request (also by broadcast).
+     * Addresses are bank addresses (unit views are translated). Function is called from communicationLoop().
+     * @param function Function pointer (NULL to disable)
+     * @param ctx User-defined context, which will be passed to function
+     */
+    void setHoldingWrittenFunction(void (*function)(uint16_t first, uint16_t count, void* ctx), void* ctx){
+        holdingWrittenFunction = function; holdingWrittenCtx = ctx;}
+
+    /**
+     * @brief Attaches additional serial port, requests received on it are served from the same registers.
+     * Port must be initialized by ModbusPort::begin() and must exist as long as the server.
+     */
+    void addPort(ModbusPort* port);
+
+    /**
+     * @brief Adds unit ID answered by server besides device address. Requests for the unit
+     * access its view of registers (address used in events is relative to the view).
+     * Unit must exist as long as the server.
+     */
+    void addUnit(ModbusUnit* unit);
+
+    /**
+     * @brief Adds block of input registers computed on demand, see ModbusProvider
+     */
+    void addInputProvider(ModbusProvider* provider){addProvider(&inputProviders, provider);}
+
+    /**
+     * @brief Adds block of holding registers computed on demand (read requests only), see ModbusProvider
+     */
+    void addHoldingProvider(ModbusProvider* provider){addProvider(&holdingProviders, provider);}
+
+    /**
+     * @brief Sets custom serial read function
+     * This function must accept two parameters: pointer to buffer, where data will be stored
+     * and pointer to context (serial port object, or any other user-defined data)
+     */
+
+    /**
+     * @brief Sets custom map of input registers, which replaces dense input register buffer
+     * (set InputN of ModbusServer to 0 to reclaim its memory).
+     * Resolver must return pointer to storage of the whole requested block, or NULL if any register
+     * of the block is not mapped (or the block spans several ranges), then exception is returned.
+     * @param resolver Function pointer to resolver
+     * @param ctx User-defined context, which will be passed to resolver
+     */
+    void setInputRegisterMap(uint16_t* (*resolver)(uint16_t first, uint16_t count, void* ctx), void* ctx){
+        inputRegisterResolver = resolver; inputRegisterResolverCtx = ctx;}
+
+    /**
+     * @brief Sets register map object (i.e. SparseRegisterMap) as map of input registers
+     */
+    template<typename Map>
+    void setInputRegisterMap(Map& map){setInputRegisterMap(Map::resolveRegisters, &map);}
+
+    /**
+     * @brief Sets custom map of holding registers, which replaces dense holding register buffer
+     * (set HoldingN of ModbusServer to 0 to reclaim its memory). See setInputRegisterMap().
+     * @param resolver Function pointer to resolver
+     * @param ctx User-defined context, which will be passed to resolver
+     */
+    void setHoldingRegisterMap(uint16_t* (*resolver)(uint16_t first, uint16_t count, void* ctx), void* ctx){
+        holdingRegisterResolver = resolver; holdingRegisterResolverCtx = ctx;}
+
+    /**
+     * @brief Sets register map object (i.e. SparseRegisterMap) as map of holding registers
+     */
+    template<typename Map>
+    void setHoldingRegisterMap(Map& map){setHoldingRegisterMap(Map::resolveRegisters, &map);}
 
     /**
      * @brief Sets ModbusRTU communication parameters
@@ -235,7 +745,9 @@ class ModbusRTU{
     int16_t communicationLoop();
 
     /**
-     * @brief Saves data to input registers buffer
+     * @brief Saves data to input registers buffer. With consistent registers (MODBUS_CONSISTENT_REGISTERS),
+     * Modbus reads never return partially written block and this function may be called from interrupt
+     * or other thread.
      * 
      * @param data Data to be saved
      * @param length Length of data
@@ -261,17 +773,500 @@ class ModbusRTU{
      */
     void copyFromHoldingRegisters(uint16_t* data, uint16_t length, uint16_t startAddress);
 
+    /**
+     * @brief Saves packed bits to coils (bit i of data, counted from bit 0 of data[0], goes to coil startAddress + i)
+     * 
+     * @param data Packed bits
+     * @param count Number of bits
+     * @param startAddress Address of first coil
+     */
+    void copyToCoils(const uint8_t* data, uint16_t count, uint16_t startAddress){
+        copyToBits(&coils, data, count, startAddress);}
+
+    /**
+     * @brief Reads coils as packed bits (unused bits of the last byte are cleared)
+     * 
+     * @param data Buffer where bits will be stored ((count + 7) / 8 bytes)
+     * @param count Number of bits
+     * @param startAddress Address of first coil
+     */
+    void copyFromCoils(uint8_t* data, uint16_t count, uint16_t startAddress){
+        copyFromBits(&coils, data, count, startAddress);}
+
+    /**
+     * @brief Saves packed bits to discrete inputs, see copyToCoils()
+     */
+    void copyToDiscreteInputs(const uint8_t* data, uint16_t count, uint16_t startAddress){
+        copyToBits(&discreteInputs, data, count, startAddress);}
+
+    /**
+     * @brief Sets or clears one coil
+     */
+    void setCoil(uint16_t address, bool value){
+        uint8_t bit = value; copyToBits(&coils, &bit, 1, address);}
+
+    /**
+     * @brief State of one coil (false if it does not exist)
+     */
+    bool getCoil(uint16_t address){
+        uint8_t bit = 0; copyFromBits(&coils, &bit, 1, address); return bit != 0;}
+
+    /**
+     * @brief Sets or clears one discrete input
+     */
+    void setDiscreteInput(uint16_t address, bool value){
+        uint8_t bit = value; copyToBits(&discreteInputs, &bit, 1, address);}
+
+    protected:
+    //Request handlers (called by dispatcher of ModbusServer), event is NULL if not available
+    uint16_t buildErrorResponse(volatile request_packet* packet, uint8_t error_code);
+    uint16_t readRegistersRequest(request_packet* packet, uint16_t length, const ModbusEvent* event);
+    uint16_t writeSingleRegisterRequest(request_packet* packet, uint16_t length, int16_t* writtenValue, const ModbusEvent* event);
+    uint16_t writeMultipleRegistersRequest(request_packet* packet, uint16_t length, int16_t* writtenValue, const ModbusEvent* event);
+    uint16_t readWriteMultipleRegistersRequest(request_packet* packet, uint16_t length, int16_t* writtenValue,
+        const ModbusEvent* readEvent, const ModbusEvent* writeEvent);
+    uint16_t diagnosticsRequest(ModbusDiagnostics* diagnostics, request_packet* packet, uint16_t length);
+    uint16_t commEventCounterRequest(const ModbusDiagnostics* diagnostics, request_packet* packet, uint16_t length);
+    uint16_t readBitsRequest(request_packet* packet, uint16_t length);
+    uint16_t writeSingleCoilRequest(request_packet* packet, uint16_t length, int16_t* writtenValue, const ModbusEvent* event);
+    uint16_t writeMultipleCoilsRequest(request_packet* packet, uint16_t length, int16_t* writtenValue, const ModbusEvent* event);
+    void collectDiagnostics(const ModbusDiagnostics* diagnostics, ModbusDiagnostics* result);
+    void clearDiagnostics(ModbusDiagnostics* diagnostics, bool overrunsOnly);
+    void recordDiagnostics(ModbusDiagnostics* diagnostics, uint8_t event, ModbusPort* port, const request_packet* packet);
+
     private:
-    bool calculateCRC(volatile uint8_t* data, uint16_t length, bool append_crc);
-    void sendResponse(volatile uint8_t* packet_data, uint16_t length);
-    void sendErrorResponse(volatile request_packet* packet, uint8_t error_code);
-    void readRegistersHandler(volatile request_packet* packet);
-    int16_t writeRegisterHandler(volatile request_packet* packet);
-    int16_t handleRequest(request_packet* packet);
+    int16_t servePort(ModbusPort* port);
+    bool selectUnit(uint8_t address);
+    static bool acceptsAddress(uint8_t address, void* ctx);
+    uint16_t* resolveInputRegisters(uint16_t first, uint16_t count);
+    uint16_t* resolveHoldingRegisters(uint16_t first, uint16_t count);
+    //Bank addresses (no unit view), used by application side
+    uint16_t* resolveInputBank(uint16_t first, uint16_t count){
+        return inputRegisterResolver != NULL ? inputRegisterResolver(first, count, inputRegisterResolverCtx) : NULL;}
+    uint16_t* resolveHoldingBank(uint16_t first, uint16_t count){
+        return holdingRegisterResolver != NULL ? holdingRegisterResolver(first, count, holdingRegisterResolverCtx) : NULL;}
+    volatile modbus_sequence_t* inputSequence(){return registerSequence != NULL ? &registerSequence->input : NULL;}
+    volatile modbus_sequence_t* holdingSequence(){return registerSequence != NULL ? &registerSequence->holding : NULL;}
+    uint16_t readRegistersHandler(volatile request_packet* packet, const ModbusEvent* event);
+    uint16_t writeRegisterHandler(volatile request_packet* packet, int16_t* writtenValue, const ModbusEvent* event);
+    uint8_t writeMultipleRegistersHandler(volatile request_packet* packet, uint16_t length, uint8_t fieldsOffset,
+        int16_t* writtenValue, const ModbusEvent* event);
+    void notifyHoldingWrite(uint16_t first, uint16_t count);
+    static void addProvider(ModbusProvider** list, ModbusProvider* provider);
+    void provideRegisters(ModbusProvider* providers, bool input, uint16_t first, uint16_t count);
+    const ModbusBitTable* resolveBits(bool coilTable, uint16_t* first, uint16_t count);
+    static void copyToBits(ModbusBitTable* table, const uint8_t* data, uint16_t count, uint16_t startAddress);
+    static void copyFromBits(const ModbusBitTable* table, uint8_t* data, uint16_t count, uint16_t startAddress);
     
 };
 
+//Dense register buffer of ModbusServer (Id distinguishes input and holding buffers)
+template<uint8_t Id, uint16_t Count, bool External>
+struct ModbusRegisterStorage {
+    uint16_t registers[Count] = {};
+    uint16_t* get(){return registers;}
+};
 
+template<uint8_t Id, uint16_t Count>
+struct ModbusRegisterStorage<Id, Count, true> {
+    uint16_t* registers = NULL;
+    uint16_t* get(){return registers;}
+};
 
+//No dense registers, takes no memory
+template<uint8_t Id, bool External>
+struct ModbusRegisterStorage<Id, 0, External> {
+    uint16_t* get(){return NULL;}
+};
 
+template<uint8_t Id>
+struct ModbusRegisterStorage<Id, 0, true> {
+    uint16_t* get(){return NULL;}
+};
+
+//Packed bit table of ModbusServer (Id distinguishes coils and discrete inputs), takes no memory if Count is 0
+template<uint8_t Id, uint16_t Count>
+struct ModbusBitStorage {
+    uint8_t bits[(Count + 7) / 8] = {};
+    uint8_t* get(){return bits;}
+};
+
+template<uint8_t Id>
+struct ModbusBitStorage<Id, 0> {
+    uint8_t* get(){return NULL;}
+};
+
+//Event slot of ModbusServer, takes no memory if no enabled function code uses the event
+template<uint8_t Id, bool Enabled>
+struct ModbusEventSlot {
+    ModbusEvent event = {NULL, NULL};
+    const ModbusEvent* get(){return &event;}
+};
+
+template<uint8_t Id>
+struct ModbusEventSlot<Id, false> {
+    const ModbusEvent* get(){return NULL;}
+};
+
+//Flags of written holding registers and unit ID of their last writer, takes no memory if writes are not tracked
+template<uint16_t Count, bool Enabled>
+struct ModbusWriteTracker {
+    uint8_t changed[(Count + 7) / 8] = {};
+    uint8_t writer[Count] = {};
+    uint16_t changedCount = 0;
+    uint16_t scanStart = 0; //Bytes of bitmap below this index are clear
+
+    //Registers outside of dense buffer (i.e. in custom map) are not tracked
+    void mark(uint16_t first, uint16_t count, uint8_t unit){
+        uint32_t end = (uint32_t)first + count;
+        if (end > Count){
+            end = Count;
+        }
+        if (first < end && (first >> 3) < scanStart){
+            scanStart = first >> 3;
+        }
+        for (uint32_t address = first; address < end; ++address){
+            uint8_t mask = 1 << (address & 7);
+            if ((changed[address >> 3] & mask) == 0){
+                changed[address >> 3] |= mask;
+                ++changedCount;
+            }
+            writer[address] = unit;
+        }
+    }
+};
+
+//Sequence lock of ModbusServer, takes no memory if banks are not consistent
+template<bool Enabled>
+struct ModbusSequenceSlot {
+    ModbusRegisterSequence sequence = {0, 0};
+    ModbusRegisterSequence* get(){return &sequence;}
+};
+
+template<>
+struct ModbusSequenceSlot<false> {
+    ModbusRegisterSequence* get(){return NULL;}
+};
+
+//Diagnostics of ModbusServer, takes no memory if diagnostics are not collected
+template<bool Enabled>
+struct ModbusDiagnosticsSlot {
+    ModbusDiagnostics diagnostics = {};
+    ModbusDiagnostics* get(){return &diagnostics;}
+};
+
+template<>
+struct ModbusDiagnosticsSlot<false> {
+    ModbusDiagnostics* get(){return NULL;}
+};
+
+template<uint16_t Count>
+struct ModbusWriteTracker<Count, false> {
+    void mark(uint16_t first, uint16_t count, uint8_t unit){(void)first; (void)count; (void)unit;}
+};
+
+#define MODBUS_SLOT_INPUT 0
+#define MODBUS_SLOT_HOLDING 1
+#define MODBUS_SLOT_WRITE 2
+#define MODBUS_SLOT_COILS 3
+#define MODBUS_SLOT_DISCRETE_INPUTS 4
+
+/**
+ * @brief Modbus server with layout given at compile time. Instances with different layouts may coexist
+ * (i.e. one per serial port). Disabled function codes are answered with illegal function exception
+ * and their handlers, events and buffers take no flash and no RAM.
+ *
+ * Example (64 holding registers, only Read_Holding_Registers and Write_Single_Register):
+ *     ModbusServer<0, 64, MODBUS_FC_MASK(FC_READ_HOLDING_REGISTERS) | MODBUS_FC_MASK(FC_WRITE_SINGLE_REGISTER)> modbus;
+ * Example (16 holding registers, 256 coils and 512 discrete inputs, 96 bytes of bits):
+ *     ModbusServer<0, 16, MODBUS_FUNCTIONS_ALL | MODBUS_FUNCTIONS_BITS, 0, 256, 512> modbus;
+ *
+ * @tparam InputN Number of dense input registers (0 if not used or if custom map is set)
+ * @tparam HoldingN Number of dense holding registers (0 if not used or if custom map is set)
+ * @tparam Functions Mask of enabled function codes (MODBUS_FC_MASK() of each code)
+ * @tparam Storage Storage policy flags (MODBUS_EXTERNAL_*_REGISTERS, MODBUS_TRACK_HOLDING_WRITES,
+ * MODBUS_CONSISTENT_REGISTERS, MODBUS_DIAGNOSTICS), registers are owned by server if 0
+ * @tparam CoilN Number of coils (stored packed, 8 per byte)
+ * @tparam DiscreteN Number of discrete inputs (stored packed, 8 per byte)
+ */
+template<uint16_t InputN, uint16_t HoldingN, uint32_t Functions = MODBUS_FUNCTIONS_ALL, uint8_t Storage = 0,
+    uint16_t CoilN = 0, uint16_t DiscreteN = 0>
+class ModbusServer : public ModbusRTUBase,
+    private ModbusRegisterStorage<MODBUS_SLOT_INPUT, InputN, (Storage & MODBUS_EXTERNAL_INPUT_REGISTERS) != 0>,
+    private ModbusRegisterStorage<MODBUS_SLOT_HOLDING, HoldingN, (Storage & MODBUS_EXTERNAL_HOLDING_REGISTERS) != 0>,
+    private ModbusWriteTracker<HoldingN, (Storage & MODBUS_TRACK_HOLDING_WRITES) != 0>,
+    private ModbusSequenceSlot<(Storage & MODBUS_CONSISTENT_REGISTERS) != 0>,
+    private ModbusDiagnosticsSlot<(Storage & MODBUS_DIAGNOSTICS) != 0>,
+    private ModbusEventSlot<MODBUS_SLOT_INPUT, (Functions & MODBUS_FC_MASK(FC_READ_INPUT_REGISTERS)) != 0>,
+    private ModbusEventSlot<MODBUS_SLOT_HOLDING, (Functions & (MODBUS_FC_MASK(FC_READ_HOLDING_REGISTERS) |
+        MODBUS_FC_MASK(FC_READ_WRITE_MULTIPLE_REGISTERS))) != 0>,
+    private ModbusEventSlot<MODBUS_SLOT_WRITE, (Functions & (MODBUS_FC_MASK(FC_WRITE_SINGLE_REGISTER) |
+        MODBUS_FC_MASK(FC_WRITE_MULTIPLE_REGISTERS) | MODBUS_FC_MASK(FC_READ_WRITE_MULTIPLE_REGISTERS))) != 0>,
+    private ModbusEventSlot<MODBUS_SLOT_COILS, (Functions & (MODBUS_FC_MASK(FC_WRITE_SINGLE_COIL) |
+        MODBUS_FC_MASK(FC_WRITE_MULTIPLE_COILS))) != 0>,
+    private ModbusBitStorage<MODBUS_SLOT_COILS, CoilN>,
+    private ModbusBitStorage<MODBUS_SLOT_DISCRETE_INPUTS, DiscreteN> {
+
+    private:
+    typedef ModbusRegisterStorage<MODBUS_SLOT_INPUT, InputN, (Storage & MODBUS_EXTERNAL_INPUT_REGISTERS) != 0> InputStorage;
+    typedef ModbusRegisterStorage<MODBUS_SLOT_HOLDING, HoldingN, (Storage & MODBUS_EXTERNAL_HOLDING_REGISTERS) != 0> HoldingStorage;
+    typedef ModbusEventSlot<MODBUS_SLOT_INPUT, (Functions & MODBUS_FC_MASK(FC_READ_INPUT_REGISTERS)) != 0> ReadInputEvent;
+    typedef ModbusEventSlot<MODBUS_SLOT_HOLDING, (Functions & (MODBUS_FC_MASK(FC_READ_HOLDING_REGISTERS) |
+        MODBUS_FC_MASK(FC_READ_WRITE_MULTIPLE_REGISTERS))) != 0> ReadHoldingEvent;
+    typedef ModbusEventSlot<MODBUS_SLOT_WRITE, (Functions & (MODBUS_FC_MASK(FC_WRITE_SINGLE_REGISTER) |
+        MODBUS_FC_MASK(FC_WRITE_MULTIPLE_REGISTERS) | MODBUS_FC_MASK(FC_READ_WRITE_MULTIPLE_REGISTERS))) != 0> WriteHoldingEvent;
+    typedef ModbusEventSlot<MODBUS_SLOT_COILS, (Functions & (MODBUS_FC_MASK(FC_WRITE_SINGLE_COIL) |
+        MODBUS_FC_MASK(FC_WRITE_MULTIPLE_COILS))) != 0> WriteCoilsEvent;
+    typedef ModbusBitStorage<MODBUS_SLOT_COILS, CoilN> CoilStorage;
+    typedef ModbusBitStorage<MODBUS_SLOT_DISCRETE_INPUTS, DiscreteN> DiscreteInputStorage;
+
+    typedef ModbusWriteTracker<HoldingN, (Storage & MODBUS_TRACK_HOLDING_WRITES) != 0> WriteTracker;
+    typedef ModbusDiagnosticsSlot<(Storage & MODBUS_DIAGNOSTICS) != 0> DiagnosticsSlot;
+
+    static_assert((Storage & MODBUS_TRACK_HOLDING_WRITES) == 0 || HoldingN > 0, "Writes are tracked only in dense holding registers");
+    static_assert((Functions & MODBUS_FUNCTIONS_DIAGNOSTICS) == 0 || (Storage & MODBUS_DIAGNOSTICS) != 0,
+        "Diagnostics function codes require MODBUS_DIAGNOSTICS storage");
+
+    static bool enabled(uint8_t functionCode){return (Functions & MODBUS_FC_MASK(functionCode)) != 0;}
+
+    static void markHoldingWrite(ModbusRTUBase* base, uint16_t first, uint16_t count, uint8_t unit){
+        static_cast<ModbusServer*>(base)->WriteTracker::mark(first, count, unit);
+    }
+
+    static void countDiagnostics(ModbusRTUBase* base, uint8_t event, ModbusPort* port, const request_packet* packet){
+        ModbusServer* server = static_cast<ModbusServer*>(base);
+        server->recordDiagnostics(server->DiagnosticsSlot::get(), event, port, packet);
+    }
+
+    static uint16_t* resolveDenseInput(uint16_t first, uint16_t count, void* ctx){
+        return (uint32_t)first + count <= InputN ? ((ModbusServer*)ctx)->InputStorage::get() + first : NULL;
+    }
+
+    static uint16_t* resolveDenseHolding(uint16_t first, uint16_t count, void* ctx){
+        return (uint32_t)first + count <= HoldingN ? ((ModbusServer*)ctx)->HoldingStorage::get() + first : NULL;
+    }
+
+    //Function code is tested against constant mask, so handlers of disabled codes are not referenced
+    static uint16_t dispatchRequest(ModbusRTUBase* base, request_packet* packet, uint16_t length, int16_t* writtenValue){
+        ModbusServer* server = static_cast<ModbusServer*>(base);
+        switch (packet->function_code){
+            case FC_READ_COILS:
+                if (enabled(FC_READ_COILS)){
+                    return server->readBitsRequest(packet, length);
+                }
+                break;
+            case FC_READ_DISCRETE_INPUTS:
+                if (enabled(FC_READ_DISCRETE_INPUTS)){
+                    return server->readBitsRequest(packet, length);
+                }
+                break;
+            case FC_WRITE_SINGLE_COIL:
+                if (enabled(FC_WRITE_SINGLE_COIL)){
+                    return server->writeSingleCoilRequest(packet, length, writtenValue, server->WriteCoilsEvent::get());
+                }
+                break;
+            case FC_WRITE_MULTIPLE_COILS:
+                if (enabled(FC_WRITE_MULTIPLE_COILS)){
+                    return server->writeMultipleCoilsRequest(packet, length, writtenValue, server->WriteCoilsEvent::get());
+                }
+                break;
+            case FC_READ_HOLDING_REGISTERS:
+                if (enabled(FC_READ_HOLDING_REGISTERS)){
+                    return server->readRegistersRequest(packet, length, server->ReadHoldingEvent::get());
+                }
+                break;
+            case FC_READ_INPUT_REGISTERS:
+                if (enabled(FC_READ_INPUT_REGISTERS)){
+                    return server->readRegistersRequest(packet, length, server->ReadInputEvent::get());
+                }
+                break;
+            case FC_WRITE_SINGLE_REGISTER:
+                if (enabled(FC_WRITE_SINGLE_REGISTER)){
+                    return server->writeSingleRegisterRequest(packet, length, writtenValue, server->WriteHoldingEvent::get());
+                }
+                break;
+            case FC_WRITE_MULTIPLE_REGISTERS:
+                if (enabled(FC_WRITE_MULTIPLE_REGISTERS)){
+                    return server->writeMultipleRegistersRequest(packet, length, writtenValue, server->WriteHoldingEvent::get());
+                }
+                break;
+            case FC_READ_WRITE_MULTIPLE_REGISTERS:
+                if (enabled(FC_READ_WRITE_MULTIPLE_REGISTERS)){
+                    return server->readWriteMultipleRegistersRequest(packet, length, writtenValue,
+                        server->ReadHoldingEvent::get(), server->WriteHoldingEvent::get());
+                }
+                break;
+            case FC_DIAGNOSTICS:
+                if (enabled(FC_DIAGNOSTICS)){
+                    return server->diagnosticsRequest(server->DiagnosticsSlot::get(), packet, length);
+                }
+                break;
+            case FC_GET_COMM_EVENT_COUNTER:
+                if (enabled(FC_GET_COMM_EVENT_COUNTER)){
+                    return server->commEventCounterRequest(server->DiagnosticsSlot::get(), packet, length);
+                }
+                break;
+        }
+        return server->buildErrorResponse(packet, EX_ILLEGAL_FUNCTION);
+    }
+
+    public:
+    ModbusServer() : ModbusRTUBase(dispatchRequest){
+        if (InputN > 0){
+            setInputRegisterMap(resolveDenseInput, this);
+        }
+        if (HoldingN > 0){
+            setHoldingRegisterMap(resolveDenseHolding, this);
+        }
+        if ((Storage & MODBUS_TRACK_HOLDING_WRITES) != 0){
+            setHoldingWriteHook(markHoldingWrite);
+        }
+        setRegisterSequence(ModbusSequenceSlot<(Storage & MODBUS_CONSISTENT_REGISTERS) != 0>::get());
+        if ((Storage & MODBUS_DIAGNOSTICS) != 0){
+            setDiagnosticsHook(countDiagnostics);
+        }
+        setBitTables(CoilStorage::get(), CoilN, DiscreteInputStorage::get(), DiscreteN);
+    }
+
+    /**
+     * @brief Reads diagnostics of server, including frames dropped by ports (MODBUS_DIAGNOSTICS storage only)
+     * @param result Diagnostics
+     */
+    void getDiagnostics(ModbusDiagnostics* result){
+        static_assert((Storage & MODBUS_DIAGNOSTICS) != 0, "Diagnostics are not collected");
+        collectDiagnostics(DiagnosticsSlot::get(), result);
+    }
+
+    /**
+     * @brief Clears all diagnostics counters and latency histogram (same as FC8 Clear_Counters)
+     */
+    void resetDiagnostics(){
+        static_assert((Storage & MODBUS_DIAGNOSTICS) != 0, "Diagnostics are not collected");
+        clearDiagnostics(DiagnosticsSlot::get(), false);
+    }
+
+    /**
+     * @brief Takes changed holding register (the lowest address first) and clears its flag
+     * (MODBUS_TRACK_HOLDING_WRITES storage only). Register is flagged when it is written by request,
+     * even if its value did not change.
+     * @param address Address of register (in dense holding registers)
+     * @param unit Unit ID (slave address) of the last request, which wrote the register (may be NULL)
+     * @return Whether changed register was found
+     */
+    bool getChangedHoldingRegister(uint16_t* address, uint8_t* unit){
+        static_assert((Storage & MODBUS_TRACK_HOLDING_WRITES) != 0, "Holding register writes are not tracked");
+        if (WriteTracker::changedCount == 0){
+            return false;
+        }
+        for (uint16_t i = WriteTracker::scanStart; i < (HoldingN + 7) / 8; ++i){
+            uint8_t bits = WriteTracker::changed[i];
+            if (bits != 0){
+                uint8_t bit = 0;
+                while ((bits & (1 << bit)) == 0){
+                    ++bit;
+                }
+                WriteTracker::changed[i] = bits & ~(1 << bit);
+                WriteTracker::scanStart = i;
+                --WriteTracker::changedCount;
+                *address = (i << 3) + bit;
+                if (unit != NULL){
+                    *unit = WriteTracker::writer[*address];
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Number of changed holding registers, which were not taken yet
+     */
+    uint16_t changedHoldingRegisterCount(){
+        static_assert((Storage & MODBUS_TRACK_HOLDING_WRITES) != 0, "Holding register writes are not tracked");
+        return WriteTracker::changedCount;
+    }
+
+    /**
+     * @brief Clears flags of all changed holding registers
+     */
+    void clearChangedHoldingRegisters(){
+        static_assert((Storage & MODBUS_TRACK_HOLDING_WRITES) != 0, "Holding register writes are not tracked");
+        memset(WriteTracker::changed, 0, sizeof(WriteTracker::changed));
+        WriteTracker::changedCount = 0;
+        WriteTracker::scanStart = 0;
+    }
+
+    /**
+     * @brief Sets custom buffer for input registers (MODBUS_EXTERNAL_INPUT_REGISTERS storage only)
+     * @param inputs Input registers (at least InputN long)
+     */
+    void setInputRegistersBuffer(uint16_t* inputs){
+        static_assert((Storage & MODBUS_EXTERNAL_INPUT_REGISTERS) != 0, "Input registers are not external");
+        InputStorage::registers = inputs;
+    }
+
+    /**
+     * @brief Sets custom buffer for holding registers (MODBUS_EXTERNAL_HOLDING_REGISTERS storage only)
+     * @param holding Holding registers (at least HoldingN long)
+     */
+    void setHoldingRegistersBuffer(uint16_t* holding){
+        static_assert((Storage & MODBUS_EXTERNAL_HOLDING_REGISTERS) != 0, "Holding registers are not external");
+        HoldingStorage::registers = holding;
+    }
+
+    /**
+     * @brief Sets event, which will be called when input registers are read (right before response is sent)
+     * @param event Function pointer to event handler
+     * @param ctx User-defined context, which will be passed to event handler
+     */
+    void setReadInputRegistersEvent(void(*event) (uint8_t* buffer, uint16_t bufferLen, void* ctx), void* ctx){
+        static_assert((Functions & MODBUS_FC_MASK(FC_READ_INPUT_REGISTERS)) != 0, "Read_Input_Registers is disabled");
+        ReadInputEvent::event.function = event; ReadInputEvent::event.ctx = ctx;}
+
+    /**
+     * @brief Sets event, which will be called when holding registers are read (right before response is sent)
+     * @param event Function pointer to event handler
+     * @param ctx User-defined context, which will be passed to event handler
+     */
+    void setReadHoldingRegistersEvent(void(*event) (uint8_t* buffer, uint16_t bufferLen, void* ctx), void* ctx){
+        static_assert((Functions & (MODBUS_FC_MASK(FC_READ_HOLDING_REGISTERS) | MODBUS_FC_MASK(FC_READ_WRITE_MULTIPLE_REGISTERS))) != 0,
+            "No read holding registers function is enabled");
+        ReadHoldingEvent::event.function = event; ReadHoldingEvent::event.ctx = ctx;}
+
+    /**
+     * @brief Sets event, which will be called when holding register is written (right before data are written)
+     * For multiple registers write, event is called once for the whole block. Buffer holds request frame,
+     * where address and count of written block are in host byte order, written data in big endian.
+     * @param event Function pointer to event handler
+     * @param ctx User-defined context, which will be passed to event handler
+     */
+    void setWriteHoldingRegisterEvent(void(*event) (uint8_t* buffer, uint16_t bufferLen, void* ctx), void* ctx){
+        static_assert((Functions & (MODBUS_FC_MASK(FC_WRITE_SINGLE_REGISTER) | MODBUS_FC_MASK(FC_WRITE_MULTIPLE_REGISTERS) |
+            MODBUS_FC_MASK(FC_READ_WRITE_MULTIPLE_REGISTERS))) != 0, "No write holding registers function is enabled");
+        WriteHoldingEvent::event.function = event; WriteHoldingEvent::event.ctx = ctx;}
+
+    /**
+     * @brief Sets event, which will be called when coils are written (right before data are written)
+     * Buffer holds request frame, where address (and count) of written coils are in host byte order,
+     * value of Write_Single_Coil (COIL_ON or 0) too, packed bits of Write_Multiple_Coils as transmitted.
+     * @param event Function pointer to event handler
+     * @param ctx User-defined context, which will be passed to event handler
+     */
+    void setWriteCoilsEvent(void(*event) (uint8_t* buffer, uint16_t bufferLen, void* ctx), void* ctx){
+        static_assert((Functions & (MODBUS_FC_MASK(FC_WRITE_SINGLE_COIL) | MODBUS_FC_MASK(FC_WRITE_MULTIPLE_COILS))) != 0,
+            "No write coils function is enabled");
+        WriteCoilsEvent::event.function = event; WriteCoilsEvent::event.ctx = ctx;}
+};
+
+//Server configured by macros above (all register function codes enabled)
+class ModbusRTU : public ModbusServer<INPUT_REGISTER_NUM, HOLDING_REGISTER_NUM,
+    MODBUS_FUNCTIONS_ALL | (DIAGNOSTICS_COUNTERS ? MODBUS_FUNCTIONS_DIAGNOSTICS : 0) |
+    (COIL_NUM > 0 || DISCRETE_INPUT_NUM > 0 ? MODBUS_FUNCTIONS_BITS : 0),
+    (USE_EXTERNALL_INPUT_REGISTER_BUFFER ? MODBUS_EXTERNAL_INPUT_REGISTERS : 0) |
+    (USE_EXTERNALL_HOLDING_REGISTER_BUFFER ? MODBUS_EXTERNAL_HOLDING_REGISTERS : 0) |
+    (TRACK_HOLDING_REGISTER_WRITES ? MODBUS_TRACK_HOLDING_WRITES : 0) |
+    (CONSISTENT_REGISTER_BLOCKS ? MODBUS_CONSISTENT_REGISTERS : 0) |
+    (DIAGNOSTICS_COUNTERS ? MODBUS_DIAGNOSTICS : 0), COIL_NUM, DISCRETE_INPUT_NUM> {
+};
 
+#endif
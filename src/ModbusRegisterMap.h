@@ -0,0 +1,113 @@
+#ifndef MODBUS_REGISTER_MAP_H
+#define MODBUS_REGISTER_MAP_H
+
+#include "ModbusRTU.h"
+
+/*Sparse register map made of several address ranges, each backed by its own buffer, so the gaps
+between ranges do not occupy memory. Ranges are given as template parameters, so resolution of an address
+is unrolled at compile time into a few comparisons against constants (no search, no table in memory).
+Ranges must be sorted by address and must not overlap. Request spanning several ranges (even adjacent ones)
+is rejected with illegal address exception.
+
+Example (blocks at 0-20, 1000-1040 and 30000-30010):
+    SparseRegisterMap<RegisterRange<0, 21>, RegisterRange<1000, 41>, RegisterRange<30000, 11>> holding;
+    modbus.setHoldingRegisterMap(holding);
+    holding.write(1005, 42);
+*/
+
+/**
+ * @brief Address range of registers with its own storage
+ * @tparam Start Address of the first register
+ * @tparam Length Number of registers
+ */
+template<uint16_t Start, uint16_t Length>
+struct RegisterRange {
+    static_assert(Length > 0, "Register range must not be empty");
+    static_assert((uint32_t)Start + Length <= 0x10000UL, "Register range exceeds address space");
+    static const uint16_t start = Start;
+    static const uint16_t length = Length;
+    uint16_t data[Length] = {0};
+};
+
+//Address of the first range in list (end of address space for empty list)
+template<typename... Ranges>
+struct RegisterRangeStart {
+    static const uint32_t value = 0x10000UL;
+};
+
+template<typename Range, typename... Ranges>
+struct RegisterRangeStart<Range, Ranges...> {
+    static const uint32_t value = Range::start;
+};
+
+template<typename... Ranges>
+class SparseRegisterMap;
+
+//Terminates recursion, address is not mapped
+template<>
+class SparseRegisterMap<> {
+    public:
+    static const uint16_t registerCount = 0;
+    uint16_t* resolve(uint16_t first, uint16_t count){(void)first; (void)count; return NULL;}
+    static uint16_t* resolveRegisters(uint16_t first, uint16_t count, void* ctx){(void)first; (void)count; (void)ctx; return NULL;}
+};
+
+template<typename Range, typename... Ranges>
+class SparseRegisterMap<Range, Ranges...> : private SparseRegisterMap<Ranges...> {
+    private:
+    typedef SparseRegisterMap<Ranges...> Next;
+    Range range;
+
+    static_assert((uint32_t)Range::start + Range::length <= RegisterRangeStart<Ranges...>::value,
+        "Register ranges must be sorted by address and must not overlap");
+
+    public:
+    //Total number of registers (memory used by map)
+    static const uint16_t registerCount = Range::length + Next::registerCount;
+
+    /**
+     * @brief Finds storage of block of registers
+     *
+     * @param first Address of first register
+     * @param count Number of registers
+     * @return uint16_t* Pointer to the first register, NULL if block is not mapped as a whole
+     */
+    uint16_t* resolve(uint16_t first, uint16_t count){
+        //Unsigned subtraction wraps for addresses below range, so one comparison checks both bounds
+        uint16_t offset = first - Range::start;
+        if (offset < Range::length){
+            return (uint32_t)offset + count <= Range::length ? range.data + offset : NULL;
+        }
+        return Next::resolve(first, count);
+    }
+
+    /**
+     * @brief Resolver for ModbusRTU::setInputRegisterMap()/setHoldingRegisterMap()
+     */
+    static uint16_t* resolveRegisters(uint16_t first, uint16_t count, void* ctx){
+        return ((SparseRegisterMap*)ctx)->resolve(first, count);
+    }
+
+    /**
+     * @brief Reads register value (in host byte order), 0 if address is not mapped
+     */
+    uint16_t read(uint16_t address){
+        uint16_t* reg = resolve(address, 1);
+        return reg != NULL ? register_to_host(*reg) : 0;
+    }
+
+    /**
+     * @brief Writes register value (in host byte order)
+     * @return Whether address is mapped
+     */
+    bool write(uint16_t address, uint16_t value){
+        uint16_t* reg = resolve(address, 1);
+        if (reg == NULL){
+            return false;
+        }
+        *reg = register_from_host(value);
+        return true;
+    }
+};
+
+#endif
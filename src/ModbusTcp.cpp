@@ -0,0 +1,390 @@
+#include "ModbusTcp.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define MODBUS_TCP_LISTEN_BACKLOG 16
+#define MODBUS_TCP_EVENTS 16
+#define MODBUS_TCP_LISTEN_ID 0xFFFFFFFFUL //Epoll data of listening socket (clients use their index)
+
+
+ModbusTcpServer::ModbusTcpServer(){
+    for (uint8_t i = 0; i < MODBUS_TCP_MAX_CLIENTS; ++i){
+        clients[i].fd = -1;
+        clients[i].rxLength = 0;
+        clients[i].txLength = 0;
+        clients[i].txBlocked = false;
+        clients[i].awaiting = false;
+        clients[i].generation = 0;
+    }
+    serialReadFunction = tcpReadFunction;
+    serialReadCtx = this;
+    serialWriteFunction = tcpWriteFunction;
+    serialWriteCtx = this;
+    serialTransmitDoneFunction = NULL;
+    tcpPort = true;
+}
+
+bool ModbusTcpServer::begin(uint16_t port, uint8_t streamFraming, const char* address){
+    end();
+    framing = streamFraming;
+
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (address != NULL && inet_pton(AF_INET, address, &local.sin_addr) != 1){
+        errno = EINVAL;
+        return false;
+    }
+
+    listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0){
+        return false;
+    }
+    int enable = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if (bind(listenFd, (struct sockaddr*)&local, sizeof(local)) != 0 || listen(listenFd, MODBUS_TCP_LISTEN_BACKLOG) != 0){
+        end();
+        return false;
+    }
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = MODBUS_TCP_LISTEN_ID;
+    if (epollFd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event) != 0){
+        end();
+        return false;
+    }
+    return true;
+}
+
+void ModbusTcpServer::end(){
+    for (uint8_t i = 0; i < MODBUS_TCP_MAX_CLIENTS; ++i){
+        closeClient(&clients[i]);
+    }
+    if (epollFd >= 0){
+        close(epollFd);
+        epollFd = -1;
+    }
+    if (listenFd >= 0){
+        close(listenFd);
+        listenFd = -1;
+    }
+}
+
+uint16_t ModbusTcpServer::getPort(){
+    struct sockaddr_in local;
+    socklen_t length = sizeof(local);
+    if (listenFd < 0 || getsockname(listenFd, (struct sockaddr*)&local, &length) != 0){
+        return 0;
+    }
+    return ntohs(local.sin_port);
+}
+
+uint8_t ModbusTcpServer::clientCount(){
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < MODBUS_TCP_MAX_CLIENTS; ++i){
+        count += clients[i].fd >= 0;
+    }
+    return count;
+}
+
+/**
+ * @brief Finds length of the first request in receive buffer of client
+ *
+ * @param client Client
+ * @return int32_t Length of request (with MBAP header or CRC), 0 if it is not complete yet,
+ * -1 if stream is not valid (connection must be closed)
+ */
+int32_t ModbusTcpServer::requestLength(const ModbusTcpClient* client){
+    if (framing == MODBUS_TCP){
+        if (client->rxLength < MBAP_HEADER_LEN - 1){
+            return 0;
+        }
+        uint16_t length = ((uint16_t)client->rx[4] << 8) | client->rx[5];
+        if (client->rx[2] != 0 || client->rx[3] != 0 || length < 2 || length > MODBUS_TCP_MAX_LENGTH){
+            return -1;
+        }
+        return client->rxLength >= MBAP_HEADER_LEN - 1 + length ? MBAP_HEADER_LEN - 1 + length : 0;
+    }
+
+    //RTU frames are delimited by length predicted from their header (buffer is longer than the longest frame)
+    if (client->rxLength < MODBUS_MIN_FRAME_LEN){
+        return 0;
+    }
+    uint16_t length = modbusRequestLength(client->rx, client->rxLength);
+    if (length == 0 && modbusRequestLength(client->rx, MODBUS_MAX_FRAME_LEN) == 0){
+        //Length of unknown function code can not be predicted, frame is all received data
+        length = client->rxLength < MODBUS_MAX_FRAME_LEN ? client->rxLength : MODBUS_MAX_FRAME_LEN;
+    }
+    if (length > MODBUS_MAX_FRAME_LEN){
+        return -1;
+    }
+    return length != 0 && client->rxLength >= length ? length : 0;
+}
+
+bool ModbusTcpServer::hasRequest(){
+    for (uint8_t i = 0; i < MODBUS_TCP_MAX_CLIENTS; ++i){
+        if (clients[i].fd >= 0 && clients[i].txLength == 0 && !clients[i].awaiting && requestLength(&clients[i]) > 0){
+            return true;
+        }
+    }
+    return false;
+}
+
+int ModbusTcpServer::wait(int timeout){
+    if (epollFd < 0){
+        return -1;
+    }
+    if (hasRequest()){
+        timeout = 0;
+    }
+
+    struct epoll_event events[MODBUS_TCP_EVENTS];
+    int count;
+    do {
+        count = epoll_wait(epollFd, events, MODBUS_TCP_EVENTS, timeout);
+    } while (count < 0 && errno == EINTR);
+
+    for (int i = 0; i < count; ++i){
+        if (events[i].data.u32 == MODBUS_TCP_LISTEN_ID){
+            acceptClients();
+            continue;
+        }
+        ModbusTcpClient* client = &clients[events[i].data.u32];
+        if (events[i].events & EPOLLOUT){
+            flush(client);
+        }
+        if (client->fd >= 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))){
+            receive(client);
+        }
+    }
+    if (count < 0){
+        return -1;
+    }
+    return hasRequest() ? 1 : 0;
+}
+
+void ModbusTcpServer::acceptClients(){
+    int fd;
+    while ((fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0){
+        uint8_t index = 0;
+        while (index < MODBUS_TCP_MAX_CLIENTS && clients[index].fd >= 0){
+            ++index;
+        }
+        if (index == MODBUS_TCP_MAX_CLIENTS){
+            //No free slot
+            close(fd);
+            continue;
+        }
+        //Responses are sent immediately (not delayed by Nagle algorithm)
+        int enable = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u32 = index;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0){
+            close(fd);
+            continue;
+        }
+        clients[index].fd = fd;
+        clients[index].rxLength = 0;
+        clients[index].txLength = 0;
+        clients[index].txBlocked = false;
+        clients[index].awaiting = false;
+        ++clients[index].generation;
+    }
+}
+
+/**
+ * @brief Reads received data of client into its receive buffer
+ */
+void ModbusTcpServer::receive(ModbusTcpClient* client){
+    uint16_t space = MODBUS_TCP_BUFFER_SIZE - client->rxLength;
+    if (space == 0){
+        //Buffer holds complete requests, the rest is read after they are handled
+        return;
+    }
+    ssize_t count = recv(client->fd, client->rx + client->rxLength, space, 0);
+    if (count == 0 || (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+        closeClient(client);
+        return;
+    }
+    if (count > 0){
+        client->rxLength += (uint16_t)count;
+        if (requestLength(client) < 0){
+            closeClient(client);
+        }
+    }
+}
+
+/**
+ * @brief Sends pending part of response, waits for writability of socket if it is not sent completely
+ */
+void ModbusTcpServer::flush(ModbusTcpClient* client){
+    if (client->fd < 0 || client->txLength == 0){
+        return;
+    }
+    ssize_t count = send(client->fd, client->tx, client->txLength, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (count < 0){
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+            closeClient(client);
+            return;
+        }
+        count = 0;
+    }
+    client->txLength -= (uint16_t)count;
+    memmove(client->tx, client->tx + count, client->txLength);
+
+    //While response is blocked, requests of client are not read (client must read responses first)
+    bool blocked = client->txLength > 0;
+    if (blocked != client->txBlocked){
+        client->txBlocked = blocked;
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = blocked ? EPOLLOUT : EPOLLIN;
+        event.data.u32 = (uint32_t)(client - clients);
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, client->fd, &event);
+    }
+}
+
+void ModbusTcpServer::closeClient(ModbusTcpClient* client){
+    if (client->fd >= 0){
+        if (epollFd >= 0){
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, client->fd, NULL);
+        }
+        close(client->fd);
+        client->fd = -1;
+    }
+    client->rxLength = 0;
+    client->txLength = 0;
+    client->txBlocked = false;
+    client->awaiting = false;
+    if (activeClient == client - clients){
+        activeClient = -1;
+    }
+}
+
+/**
+ * @brief Read function of TCP port, takes the first request of next client (round robin)
+ * MBAP header is removed, unit ID and PDU form frame without CRC (verification is skipped),
+ * RTU frames are passed with CRC.
+ * @param buffer Frame buffer of port
+ * @param ctx ModbusTcpServer object
+ * @return uint16_t Length of frame (see ModbusPort::setSerialReadFunction), 0 if no request is waiting
+ */
+uint16_t ModbusTcpServer::tcpReadFunction(char* buffer, void* ctx){
+    ModbusTcpServer* server = (ModbusTcpServer*)ctx;
+    for (uint8_t i = 0; i < MODBUS_TCP_MAX_CLIENTS; ++i){
+        uint8_t index = (uint8_t)((server->nextClient + i) % MODBUS_TCP_MAX_CLIENTS);
+        ModbusTcpClient* client = &server->clients[index];
+        if (client->fd < 0 || client->txLength != 0 || client->awaiting){
+            continue;
+        }
+        int32_t length = server->requestLength(client);
+        if (length <= 0){
+            continue;
+        }
+
+        server->nextClient = (uint8_t)((index + 1) % MODBUS_TCP_MAX_CLIENTS);
+        server->activeClient = index;
+        uint16_t result;
+        if (server->framing == MODBUS_TCP){
+            memcpy(server->activeHeader, client->rx, sizeof(server->activeHeader));
+            uint16_t frameLength = (uint16_t)length - (MBAP_HEADER_LEN - 1);
+            memcpy(buffer, client->rx + MBAP_HEADER_LEN - 1, frameLength);
+            //Space for CRC is included, as in RTU frame
+            result = (frameLength + CRC_LEN) | MODBUS_FRAME_CRC_OK;
+        }
+        else {
+            memcpy(buffer, client->rx, length);
+            result = (uint16_t)length;
+        }
+        client->rxLength -= (uint16_t)length;
+        memmove(client->rx, client->rx + length, client->rxLength);
+        return result;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write function of TCP port, sends response to client of the last request
+ * @param buffer Response (RTU frame with CRC)
+ * @param length Length of response
+ * @param ctx ModbusTcpServer object
+ */
+void ModbusTcpServer::tcpWriteFunction(const char* buffer, uint16_t length, void* ctx){
+    ModbusTcpServer* server = (ModbusTcpServer*)ctx;
+    if (server->activeClient < 0){
+        return;
+    }
+    ModbusTcpClient* client = &server->clients[server->activeClient];
+    server->activeClient = -1;
+    server->queueResponse(client, server->activeHeader, (const uint8_t*)buffer, length);
+}
+
+/**
+ * @brief Sends response to client. CRC is replaced by MBAP header (Modbus TCP), or sent (RTU over TCP).
+ *
+ * @param client Client
+ * @param header Transaction ID and protocol ID of request
+ * @param frame Response (RTU frame with CRC)
+ * @param length Length of response
+ */
+void ModbusTcpServer::queueResponse(ModbusTcpClient* client, const uint8_t* header, const uint8_t* frame, uint16_t length){
+    uint16_t offset = 0;
+    if (framing == MODBUS_TCP){
+        length -= CRC_LEN;
+        memcpy(client->tx, header, sizeof(activeHeader));
+        client->tx[4] = (uint8_t)(length >> 8);
+        client->tx[5] = (uint8_t)length;
+        offset = MBAP_HEADER_LEN - 1;
+    }
+    memcpy(client->tx + offset, frame, length);
+    client->txLength = offset + length;
+    flush(client);
+}
+
+uint16_t ModbusTcpServer::takeRequest(uint8_t* frame, uint32_t* token){
+    uint16_t result = tcpReadFunction((char*)frame, this);
+    if (result == 0){
+        return 0;
+    }
+    ModbusTcpClient* client = &clients[activeClient];
+    memcpy(client->header, activeHeader, sizeof(activeHeader));
+    client->awaiting = true;
+    *token = ((uint32_t)client->generation << 8) | (uint32_t)activeClient;
+    activeClient = -1;
+    return result;
+}
+
+void ModbusTcpServer::respond(uint32_t token, const uint8_t* frame, uint16_t length){
+    uint8_t index = (uint8_t)token;
+    if (index >= MODBUS_TCP_MAX_CLIENTS){
+        return;
+    }
+    ModbusTcpClient* client = &clients[index];
+    //Connection was closed meanwhile (slot may be used by new connection)
+    if (client->fd < 0 || !client->awaiting || client->generation != (uint8_t)(token >> 8)){
+        return;
+    }
+    client->awaiting = false;
+    if (length > 0){
+        queueResponse(client, client->header, frame, length);
+    }
+}
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef MODBUS_TCP_H
+#define MODBUS_TCP_H
+
+#include "ModbusRTU.h"
+
+#if defined(__linux__)
+
+/*Modbus TCP (MBAP header) and RTU over TCP front end for Linux. ModbusTcpServer is a port of server,
+so requests received over TCP are handled by the same request handlers and registers as requests
+received on serial ports. Unit ID of request is used as slave address (device address or unit added by addUnit()),
+unit IDs 0 and 0xFF address the device itself (no broadcast) and unknown units are answered with exception 0x0B.
+Connections are served by one non-blocking epoll loop. Clients may pipeline requests, requests of one
+connection are answered in order and connections are served round robin. While response can not be
+sent completely (client does not read), no other request of the connection is processed.
+
+Example:
+    ModbusTcpServer tcp;
+    tcp.begin(MODBUS_TCP_PORT);
+    modbus.addPort(&tcp);
+    while (true){
+        tcp.wait(100);
+        while (tcp.hasRequest()){
+            modbus.communicationLoop();
+        }
+    }
+*/
+
+//Adjust if necessary
+#define MODBUS_TCP_MAX_CLIENTS 32
+#define MODBUS_TCP_BUFFER_SIZE 520 //Receive buffer of connection (two ADUs of max length)
+
+#define MODBUS_TCP_PORT 502
+#define MBAP_HEADER_LEN 7 //Transaction ID, protocol ID, length, unit ID
+#define MODBUS_TCP_MAX_LENGTH 254 //Max value of length field of MBAP header (unit ID and PDU)
+
+//Framing of TCP stream (argument of begin())
+#define MODBUS_TCP 0 //MBAP header
+#define MODBUS_RTU_OVER_TCP 1 //RTU frames (with CRC) in TCP stream
+
+typedef struct {
+    int fd; //-1 if slot is free
+    uint16_t rxLength;
+    uint16_t txLength; //Part of response, which was not sent yet
+    bool txBlocked; //Socket is waiting for writability
+    bool awaiting; //Request was taken by takeRequest() and is not answered yet
+    uint8_t generation; //Incremented by each connection using the slot (part of request token)
+    uint8_t header[4]; //Transaction ID and protocol ID of request taken by takeRequest()
+    uint8_t rx[MODBUS_TCP_BUFFER_SIZE];
+    uint8_t tx[MBAP_HEADER_LEN + MODBUS_MAX_FRAME_LEN];
+} ModbusTcpClient;
+
+class ModbusTcpServer : public ModbusPort{
+
+    private:
+    int listenFd = -1;
+    int epollFd = -1;
+    uint8_t framing = MODBUS_TCP;
+    ModbusTcpClient clients[MODBUS_TCP_MAX_CLIENTS];
+    uint8_t nextClient = 0; //Requests are taken round robin starting from this client
+    int16_t activeClient = -1; //Client of request being handled
+    uint8_t activeHeader[4]; //Transaction ID and protocol ID of request being handled
+
+    public:
+    ModbusTcpServer();
+    ~ModbusTcpServer(){end();}
+    ModbusTcpServer(const ModbusTcpServer&) = delete;
+    ModbusTcpServer& operator=(const ModbusTcpServer&) = delete;
+
+    /**
+     * @brief Starts listening
+     *
+     * @param port TCP port (MODBUS_TCP_PORT, 0 for any free port, see getPort())
+     * @param streamFraming MODBUS_TCP or MODBUS_RTU_OVER_TCP
+     * @param address IPv4 address to listen on, NULL for all interfaces
+     * @return Whether server listens (errno is set otherwise)
+     */
+    bool begin(uint16_t port, uint8_t streamFraming = MODBUS_TCP, const char* address = NULL);
+
+    /**
+     * @brief Closes all connections and stops listening
+     */
+    void end();
+
+    /**
+     * @brief Accepts connections, receives requests and sends pending responses. Waits until request
+     * is received (returns immediately if request is already waiting).
+     *
+     * @param timeout Timeout in milliseconds, -1 to wait forever
+     * @return int Positive if request is waiting, 0 on timeout, -1 on error
+     */
+    int wait(int timeout);
+
+    /**
+     * @brief Whether complete request is waiting (communicationLoop() of server handles one request per call)
+     */
+    bool hasRequest();
+
+    /**
+     * @brief Takes the next request (round robin) to be answered later by respond(), i.e. by gateway,
+     * which has to forward it first. No other request of the client is taken until it is answered.
+     *
+     * @param frame Buffer of MODBUS_MAX_FRAME_LEN bytes, request is stored as RTU frame (see setSerialReadFunction())
+     * @param token Identifies request in respond()
+     * @return uint16_t Length of frame (with CRC), | MODBUS_FRAME_CRC_OK if CRC need not be checked, 0 if no request is waiting
+     */
+    uint16_t takeRequest(uint8_t* frame, uint32_t* token);
+
+    /**
+     * @brief Sends response to request taken by takeRequest(). Response is dropped if client has disconnected.
+     *
+     * @param token Token of request
+     * @param frame Response (RTU frame, CRC is calculated by caller)
+     * @param length Length of response (with CRC), 0 to release client without response (broadcast)
+     */
+    void respond(uint32_t token, const uint8_t* frame, uint16_t length);
+
+    /**
+     * @brief Number of connected clients
+     */
+    uint8_t clientCount();
+
+    /**
+     * @brief Port server listens on (useful after begin() with port 0), 0 if not listening
+     */
+    uint16_t getPort();
+
+    /**
+     * @brief File descriptor of epoll set (i.e. to be added to epoll set of application), -1 if not listening
+     */
+    int getFd(){return epollFd;}
+
+    private:
+    static uint16_t tcpReadFunction(char* buffer, void* ctx);
+    static void tcpWriteFunction(const char* buffer, uint16_t length, void* ctx);
+    int32_t requestLength(const ModbusTcpClient* client);
+    void acceptClients();
+    void receive(ModbusTcpClient* client);
+    void flush(ModbusTcpClient* client);
+    void queueResponse(ModbusTcpClient* client, const uint8_t* header, const uint8_t* frame, uint16_t length);
+    void closeClient(ModbusTcpClient* client);
+};
+
+#endif
+
+#endif